@@ -0,0 +1,172 @@
+/*
+ * mirror_buffer_bench: throughput (MB/s) of the decryption of mirrored video frames
+ * by mirror_buffer_decrypt_nal_units, with 1, 2, 4 and 8 decryption threads.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ *=================================================================
+ * usage: mirror_buffer_bench [seconds per measurement (default 0.5)]
+ *
+ * mirror_buffer.c is compiled into this benchmark with PARALLEL_DECRYPT_MIN_BYTES = 16,
+ * so frames of every size are split between the threads when more than one is used:
+ * comparing each row with the 1-thread column shows the frame size above which
+ * parallel decryption pays off on the machine running the benchmark.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "mirror_buffer.h"
+#include "raop_rtp.h"
+#include "logger.h"
+
+static const int frame_sizes[] = { 16 * 1024, 64 * 1024, 128 * 1024, 256 * 1024, 512 * 1024,
+                                   1024 * 1024, 2048 * 1024, 4096 * 1024 };
+static const int thread_counts[] = { 1, 2, 4, 8 };
+
+#define N_FRAME_SIZES ((int) (sizeof(frame_sizes) / sizeof(frame_sizes[0])))
+#define N_THREAD_COUNTS ((int) (sizeof(thread_counts) / sizeof(thread_counts[0])))
+#define MIN_FRAMES 8
+
+static double
+get_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+/* a frame holding a single h264 (non-IDR slice) NAL unit with random payload, in AVCC format */
+static void
+make_frame(unsigned char *frame, int size)
+{
+    int nal_len = size - 4;
+    frame[0] = (unsigned char) (nal_len >> 24);
+    frame[1] = (unsigned char) (nal_len >> 16);
+    frame[2] = (unsigned char) (nal_len >> 8);
+    frame[3] = (unsigned char) nal_len;
+    frame[4] = 0x21;
+    for (int i = 5; i < size; i++) {
+        frame[i] = (unsigned char) rand();
+    }
+}
+
+/* returns the decryption throughput in MB/s, or a negative value if decryption failed */
+static double
+measure(logger_t *logger, const unsigned char *frame, unsigned char *buffer, int size, int threads,
+        double seconds)
+{
+    unsigned char aeskey[RAOP_AESKEY_LEN];
+    uint64_t stream_connection_id = 0x0123456789abcdefULL;
+    video_nal_unit_t nal_units[4];
+    int nal_count;
+    double elapsed = 0.0;
+    long frames = 0;
+
+    for (int i = 0; i < RAOP_AESKEY_LEN; i++) {
+        aeskey[i] = (unsigned char) i;
+    }
+    /* AES-CTR: "decrypting" the plaintext with a second context on the same keystream encrypts it */
+    mirror_buffer_t *encrypter = mirror_buffer_init(logger, aeskey);
+    mirror_buffer_t *decrypter = mirror_buffer_init(logger, aeskey);
+    if (!encrypter || !decrypter) {
+        mirror_buffer_destroy(encrypter);
+        mirror_buffer_destroy(decrypter);
+        return -1.0;
+    }
+    mirror_buffer_init_aes(encrypter, &stream_connection_id, 1);
+    mirror_buffer_init_aes(decrypter, &stream_connection_id, threads);
+
+    while (elapsed < seconds || frames < MIN_FRAMES) {
+        memcpy(buffer, frame, size);
+        mirror_buffer_decrypt_nal_units(encrypter, buffer, size, false, nal_units, 4, &nal_count);
+        if (nal_count) {
+            /* rarely, the encrypted frame starts like a NAL unit, and its "length prefix" was replaced by  *
+             * a start code: skip this frame, but keep the decrypter at the same keystream position          */
+            mirror_buffer_decrypt_nal_units(decrypter, buffer, size, false, nal_units, 4, &nal_count);
+            continue;
+        }
+
+        double start = get_seconds();
+        bool valid = mirror_buffer_decrypt_nal_units(decrypter, buffer, size, false, nal_units, 4, &nal_count);
+        elapsed += get_seconds() - start;
+        frames++;
+
+        /* the decrypted frame is the original one, with an Annex-B start code instead of the length prefix */
+        if (!valid || nal_count != 1 || memcmp(buffer + 4, frame + 4, size - 4) ||
+            buffer[0] || buffer[1] || buffer[2] || buffer[3] != 1) {
+            frames = -1;
+            break;
+        }
+    }
+    mirror_buffer_destroy(encrypter);
+    mirror_buffer_destroy(decrypter);
+    if (frames < 0) {
+        return -1.0;
+    }
+    return (double) size * (double) frames / elapsed / 1e6;
+}
+
+int
+main(int argc, char *argv[])
+{
+    double seconds = 0.5;
+    if (argc > 1) {
+        seconds = atof(argv[1]);
+        if (seconds <= 0.0) {
+            fprintf(stderr, "usage: %s [seconds per measurement (default 0.5)]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    logger_t *logger = logger_init();
+    logger_set_level(logger, LOGGER_WARNING);
+    unsigned char *frame = malloc(frame_sizes[N_FRAME_SIZES - 1]);
+    unsigned char *buffer = malloc(frame_sizes[N_FRAME_SIZES - 1]);
+    if (!logger || !frame || !buffer) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    printf("mirror_buffer_decrypt_nal_units throughput (MB/s), %.2f s per measurement\n", seconds);
+    printf("%10s", "frame");
+    for (int j = 0; j < N_THREAD_COUNTS; j++) {
+        printf("  %7d thr", thread_counts[j]);
+    }
+    printf("\n");
+
+    int ret = 0;
+    for (int i = 0; i < N_FRAME_SIZES; i++) {
+        int size = frame_sizes[i];
+        make_frame(frame, size);
+        printf("%8d K", size / 1024);
+        for (int j = 0; j < N_THREAD_COUNTS; j++) {
+            double mbps = measure(logger, frame, buffer, size, thread_counts[j], seconds);
+            if (mbps < 0.0) {
+                printf("  %11s", "FAILED");
+                ret = 1;
+            } else {
+                printf("  %11.1f", mbps);
+            }
+            fflush(stdout);
+        }
+        printf("\n");
+    }
+
+    free(frame);
+    free(buffer);
+    logger_destroy(logger);
+    return ret;
+}
@@ -0,0 +1,205 @@
+/*
+ * raop_ntp_bench: throughput of the readers of the raop_ntp clock sync params (the seqlock
+ * raop_ntp_read_sync, used for every audio packet and video frame), compared with the mutex
+ * that guarded them before, with N reader threads and a writer thread publishing updates.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ *=================================================================
+ * usage: raop_ntp_bench [seconds per measurement (default 0.5)]
+ *
+ * raop_ntp.c is included, so the seqlock reader and writer measured are the static
+ * functions used by raop_ntp itself.  Each measurement is made with the writer publishing
+ * an update every millisecond, and with the writer publishing updates back to back (the
+ * real writer, raop_ntp_thread, publishes one update every few seconds).  Readers check
+ * that every copy they get is consistent.
+ */
+
+#include "raop_ntp.c"
+
+#include <time.h>
+
+static const int reader_counts[] = { 1, 2, 4, 8 };
+#define N_READER_COUNTS ((int) (sizeof(reader_counts) / sizeof(reader_counts[0])))
+
+typedef enum {
+    BENCH_SEQLOCK,
+    BENCH_MUTEX
+} bench_mode_t;
+
+typedef struct bench_s {
+    raop_ntp_t raop_ntp;
+    mutex_handle_t sync_params_mutex;   /* the mutex formerly used for raop_ntp->sync */
+    bench_mode_t mode;
+    int write_interval_us;              /* 0: publish back to back */
+    atomic_bool stop;
+    atomic_bool failed;
+} bench_t;
+
+typedef struct bench_thread_s {
+    bench_t *bench;
+    thread_handle_t thread;
+    uint64_t count;
+    char pad[64];                       /* keep the counters of different threads on separate cache lines */
+} bench_thread_t;
+
+static double
+get_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+static THREAD_RETVAL
+reader_thread(void *arg)
+{
+    bench_thread_t *reader = (bench_thread_t *) arg;
+    bench_t *bench = reader->bench;
+    raop_ntp_t *raop_ntp = &bench->raop_ntp;
+    raop_ntp_sync_params_t sync;
+    uint64_t count = 0;
+    int64_t sum = 0;
+
+    while (!atomic_load_explicit(&bench->stop, memory_order_relaxed)) {
+        if (bench->mode == BENCH_SEQLOCK) {
+            raop_ntp_read_sync(raop_ntp, &sync);
+        } else {
+            MUTEX_LOCK(bench->sync_params_mutex);
+            sync = raop_ntp->sync;
+            MUTEX_UNLOCK(bench->sync_params_mutex);
+        }
+        /* the writer keeps delay == offset and dispersion == -offset */
+        if (sync.delay != sync.offset || sync.dispersion != -sync.offset) {
+            atomic_store(&bench->failed, true);
+        }
+        sum += raop_ntp_sync_offset(&sync, 1000000000ULL + count);
+        count++;
+    }
+    reader->count = count + (sum == 1);   /* (use sum, so the conversions are not optimized away) */
+    return 0;
+}
+
+static THREAD_RETVAL
+writer_thread(void *arg)
+{
+    bench_thread_t *writer = (bench_thread_t *) arg;
+    bench_t *bench = writer->bench;
+    raop_ntp_t *raop_ntp = &bench->raop_ntp;
+    uint64_t count = 0;
+
+    while (!atomic_load_explicit(&bench->stop, memory_order_relaxed)) {
+        count++;
+        if (bench->mode == BENCH_SEQLOCK) {
+            raop_ntp->sync.offset = (int64_t) count;
+            raop_ntp->sync.delay = (int64_t) count;
+            raop_ntp->sync.dispersion = -(int64_t) count;
+            raop_ntp_publish_sync(raop_ntp);
+        } else {
+            MUTEX_LOCK(bench->sync_params_mutex);
+            raop_ntp->sync.offset = (int64_t) count;
+            raop_ntp->sync.delay = (int64_t) count;
+            raop_ntp->sync.dispersion = -(int64_t) count;
+            MUTEX_UNLOCK(bench->sync_params_mutex);
+        }
+        if (bench->write_interval_us) {
+            struct timespec ts = { 0, bench->write_interval_us * 1000L };
+            nanosleep(&ts, NULL);
+        }
+    }
+    writer->count = count;
+    return 0;
+}
+
+/* returns the total number of reads per second by all readers, or a negative value if a reader *
+ * got inconsistent params; *writes is set to the number of updates per second by the writer    */
+static double
+measure(bench_mode_t mode, int readers, int write_interval_us, double seconds, double *writes)
+{
+    bench_t *bench = calloc(1, sizeof(bench_t));
+    bench_thread_t *threads = calloc(readers + 1, sizeof(bench_thread_t));
+    assert(bench && threads);
+
+    bench->mode = mode;
+    bench->write_interval_us = write_interval_us;
+    atomic_init(&bench->stop, false);
+    atomic_init(&bench->failed, false);
+    atomic_init(&bench->raop_ntp.sync_seq, 0);
+    for (unsigned int i = 0; i < RAOP_NTP_SYNC_WORDS; i++) {
+        atomic_init(&bench->raop_ntp.sync_words[i], 0);
+    }
+    bench->raop_ntp.sync.skew = 1.0e-6;
+    raop_ntp_publish_sync(&bench->raop_ntp);
+    MUTEX_CREATE(bench->sync_params_mutex);
+
+    double start = get_seconds();
+    for (int i = 0; i <= readers; i++) {
+        threads[i].bench = bench;
+        THREAD_CREATE(threads[i].thread, (i == readers ? writer_thread : reader_thread), &threads[i]);
+    }
+    struct timespec ts = { (time_t) seconds, (long) ((seconds - (double) (time_t) seconds) * 1e9) };
+    nanosleep(&ts, NULL);
+    atomic_store(&bench->stop, true);
+    uint64_t reads = 0;
+    for (int i = 0; i <= readers; i++) {
+        THREAD_JOIN(threads[i].thread);
+        if (i < readers) {
+            reads += threads[i].count;
+        }
+    }
+    double elapsed = get_seconds() - start;
+    *writes = (double) threads[readers].count / elapsed;
+    bool failed = atomic_load(&bench->failed);
+
+    MUTEX_DESTROY(bench->sync_params_mutex);
+    free(threads);
+    free(bench);
+    return (failed ? -1.0 : (double) reads / elapsed);
+}
+
+int
+main(int argc, char *argv[])
+{
+    static const int write_intervals_us[] = { 1000, 0 };
+    double seconds = 0.5;
+    if (argc > 1) {
+        seconds = atof(argv[1]);
+        if (seconds <= 0.0) {
+            fprintf(stderr, "usage: %s [seconds per measurement (default 0.5)]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    int ret = 0;
+    printf("clock sync param reads (millions/s, all readers), %.2f s per measurement\n", seconds);
+    for (int w = 0; w < 2; w++) {
+        if (write_intervals_us[w]) {
+            printf("\nwriter publishing every %d us\n", write_intervals_us[w]);
+        } else {
+            printf("\nwriter publishing back to back\n");
+        }
+        printf("%8s  %12s  %12s  %16s  %16s\n", "readers", "mutex", "seqlock", "mutex writes/s", "seqlock writes/s");
+        for (int r = 0; r < N_READER_COUNTS; r++) {
+            double mutex_writes, seqlock_writes;
+            double mutex_reads = measure(BENCH_MUTEX, reader_counts[r], write_intervals_us[w], seconds, &mutex_writes);
+            double seqlock_reads = measure(BENCH_SEQLOCK, reader_counts[r], write_intervals_us[w], seconds,
+                                           &seqlock_writes);
+            if (mutex_reads < 0.0 || seqlock_reads < 0.0) {
+                printf("%8d  FAILED: a reader got inconsistent params\n", reader_counts[r]);
+                ret = 1;
+                continue;
+            }
+            printf("%8d  %12.2f  %12.2f  %16.0f  %16.0f\n", reader_counts[r], mutex_reads / 1e6,
+                   seqlock_reads / 1e6, mutex_writes, seqlock_writes);
+        }
+    }
+    return ret;
+}
@@ -28,7 +28,10 @@
 
 struct media_item_s {
   char *uri;
-  char *playlist;
+  char *playlist;    /* expanded by adjust_yt_condensed_playlist when stored */
+  int playlist_len;
+  int chunks;
+  float duration;
   int num;
 };
 
@@ -222,38 +225,72 @@ void create_media_data_store(airplay_video_t * airplay_video, char ** uri_list,
     airplay_video->num_uri = num_uri;
 }
 
+/* takes ownership of media_playlist: the playlist is expanded (once) here, and served from the store */
 int store_media_playlist(airplay_video_t *airplay_video, char * media_playlist, int num) {
     media_item_t *media_data_store = airplay_video->media_data_store;
     if ( num < 0 ||  num >= airplay_video->num_uri) {
+        free (media_playlist);
         return -1;
     } else if (media_data_store[num].playlist) {
+        free (media_playlist);
         return -2;
     }
+    char *playlist = adjust_yt_condensed_playlist(media_playlist);
+    free (media_playlist);
     for (int i = 0; i < num ; i++) {
         if (strcmp(media_data_store[i].uri, media_data_store[num].uri) == 0) {
-            assert(strcmp(media_data_store[i].playlist, media_playlist) == 0);
+            assert(strcmp(media_data_store[i].playlist, playlist) == 0);
             media_data_store[num].num = i;
-            free (media_playlist);
+            free (playlist);
             return 1;
         }
     }
-    media_data_store[num].playlist = media_playlist;
+    media_data_store[num].playlist = playlist;
+    media_data_store[num].playlist_len = (int) strlen(playlist);
+    media_data_store[num].chunks = analyze_media_playlist(playlist, &media_data_store[num].duration);
     return 0;
 }
 
-char * get_media_playlist(airplay_video_t *airplay_video, const char *uri) {
+/* returns the stored (expanded) Media Playlist and its length, or NULL */
+const char * get_media_playlist(airplay_video_t *airplay_video, const char *uri, int *len) {
     media_item_t *media_data_store = airplay_video->media_data_store;
     if (media_data_store == NULL) {
         return NULL;
     }
     for (int i = 0; i < airplay_video->num_uri; i++) {
         if (strstr(media_data_store[i].uri, uri)) {
-            return media_data_store[media_data_store[i].num].playlist;
+            media_item_t *item = &media_data_store[media_data_store[i].num];
+            if (len) {
+                *len = item->playlist_len;
+            }
+            return item->playlist;
         }
     }
     return NULL;
 }
 
+/* number of chunks and total duration of a stored Media Playlist, found by uri or (if uri is NULL) num */
+int get_media_playlist_info(airplay_video_t *airplay_video, const char *uri, int num, float *duration) {
+    media_item_t *media_data_store = airplay_video->media_data_store;
+    *duration = 0.0f;
+    if (media_data_store == NULL) {
+        return 0;
+    }
+    if (uri) {
+        for (num = 0; num < airplay_video->num_uri; num++) {
+            if (strstr(media_data_store[num].uri, uri)) {
+                break;
+            }
+        }
+    }
+    if (num < 0 || num >= airplay_video->num_uri) {
+        return 0;
+    }
+    media_item_t *item = &media_data_store[media_data_store[num].num];
+    *duration = item->duration;
+    return item->chunks;
+}
+
 char * get_media_uri_by_num(airplay_video_t *airplay_video, int num) {
     media_item_t * media_data_store = airplay_video->media_data_store;
     if (num >= 0 && num < airplay_video->num_uri) {
@@ -47,7 +47,8 @@ int create_media_uri_table(const char *url_prefix, const char *master_playlist_d
 void store_master_playlist(airplay_video_t *airplay_video, char *master_playlist);
 int store_media_playlist(airplay_video_t *airplay_video, char *media_playlist, int num);
 char *get_master_playlist(airplay_video_t *airplay_video);
-char *get_media_playlist(airplay_video_t *airplay_video, const char *uri);
+const char *get_media_playlist(airplay_video_t *airplay_video, const char *uri, int *len);
+int get_media_playlist_info(airplay_video_t *airplay_video, const char *uri, int num, float *duration);
 
 void destroy_media_data_store(airplay_video_t *airplay_video);
 void create_media_data_store(airplay_video_t * airplay_video, char ** media_data_store, int num_uri);
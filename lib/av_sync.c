@@ -0,0 +1,178 @@
+/*
+ * Copyright (c) 2026 agent, All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ *=================================================================
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <assert.h>
+
+#include "av_sync.h"
+#include "raop_ntp.h"
+#include "threads.h"
+
+#define SECOND_IN_NSECS 1000000000LL
+
+/* offset corrections are slewed at up to AV_SYNC_MAX_SLEW_PPM of elapsed time, *
+ * unless they are larger than AV_SYNC_MAX_SLEW_ERROR, when they are stepped     */
+#define AV_SYNC_MAX_SLEW_PPM 500
+#define AV_SYNC_MAX_SLEW_ERROR (SECOND_IN_NSECS / 4)
+/* limit on the total delay added for pipelines that started late */
+#define AV_SYNC_MAX_DELAY (2 * SECOND_IN_NSECS)
+
+struct av_sync_s {
+    logger_t *logger;
+    mutex_handle_t mutex;
+
+    /* MUTEX LOCKED VARIABLES START */
+    bool have_offset;
+    int64_t offset;          /* applied (local - remote) offset */
+    int64_t target;          /* latest (local - remote) offset from raop_ntp */
+    uint64_t last_update;    /* local time when the offset was last slewed */
+    int64_t delay;           /* added for pipelines that started late */
+    int64_t stream_offset[AV_SYNC_STREAMS];   /* total offset applied to the latest buffer of each stream */
+    bool stream_active[AV_SYNC_STREAMS];
+    uint64_t steps;
+    /* MUTEX LOCKED VARIABLES END */
+};
+
+av_sync_t *
+av_sync_init(logger_t *logger)
+{
+    av_sync_t *av_sync = calloc(1, sizeof(av_sync_t));
+    if (!av_sync) {
+        return NULL;
+    }
+    av_sync->logger = logger;
+    MUTEX_CREATE(av_sync->mutex);
+    av_sync_reset(av_sync);
+    return av_sync;
+}
+
+/* start a new mapping (at the start of a session, or after video_reset) */
+void
+av_sync_reset(av_sync_t *av_sync)
+{
+    assert(av_sync);
+    MUTEX_LOCK(av_sync->mutex);
+    av_sync->have_offset = false;
+    av_sync->offset = 0;
+    av_sync->target = 0;
+    av_sync->last_update = 0;
+    av_sync->delay = 0;
+    for (int i = 0; i < AV_SYNC_STREAMS; i++) {
+        av_sync->stream_offset[i] = 0;
+        av_sync->stream_active[i] = false;
+    }
+    av_sync->steps = 0;
+    MUTEX_UNLOCK(av_sync->mutex);
+}
+
+/* Returns the local presentation time for a buffer of the stream with client time remote_time.  *
+ * local_time is raop_ntp's conversion of remote_time (0 if the clocks are not yet synchronized), *
+ * and stream_delay is an extra (user-requested) delay for this stream only.                      */
+uint64_t
+av_sync_get_pts(av_sync_t *av_sync, av_sync_stream_t stream, uint64_t remote_time, uint64_t local_time,
+                int64_t stream_delay)
+{
+    assert(av_sync);
+    assert(stream < AV_SYNC_STREAMS);
+    uint64_t now = raop_ntp_get_local_time();
+
+    MUTEX_LOCK(av_sync->mutex);
+    if (local_time) {
+        av_sync->target = (int64_t) (local_time - remote_time);
+    }
+    if (!av_sync->have_offset) {
+        /* without clock sync, assume the first buffer is due now */
+        if (!local_time) {
+            av_sync->target = (int64_t) (now - remote_time);
+        }
+        av_sync->offset = av_sync->target;
+        av_sync->have_offset = true;
+    } else if (local_time) {
+        int64_t error = av_sync->target - av_sync->offset;
+        if (error > AV_SYNC_MAX_SLEW_ERROR || error < -AV_SYNC_MAX_SLEW_ERROR) {
+            logger_log(av_sync->logger, LOGGER_INFO, "av_sync: client clock offset changed by %8.6f secs",
+                       (double) error / SECOND_IN_NSECS);
+            av_sync->offset = av_sync->target;
+            av_sync->steps++;
+        } else {
+            int64_t max_slew = (int64_t) (now - av_sync->last_update) * AV_SYNC_MAX_SLEW_PPM / 1000000;
+            if (error > max_slew) {
+                error = max_slew;
+            } else if (error < -max_slew) {
+                error = -max_slew;
+            }
+            av_sync->offset += error;
+        }
+    }
+    av_sync->last_update = now;
+    int64_t offset = av_sync->offset + av_sync->delay + stream_delay;
+    av_sync->stream_offset[stream] = offset;
+    av_sync->stream_active[stream] = true;
+    MUTEX_UNLOCK(av_sync->mutex);
+
+    return (uint64_t) ((int64_t) remote_time + offset);
+}
+
+/* a renderer received a buffer with a PTS that was "delay" nsecs before its pipeline started:  *
+ * delay both streams to keep them in sync.  Returns false if the total delay would be too large */
+bool
+av_sync_delay_streams(av_sync_t *av_sync, uint64_t delay)
+{
+    bool ret = true;
+    assert(av_sync);
+    MUTEX_LOCK(av_sync->mutex);
+    if (av_sync->delay + (int64_t) delay > AV_SYNC_MAX_DELAY) {
+        ret = false;
+    } else {
+        av_sync->delay += (int64_t) delay;
+    }
+    MUTEX_UNLOCK(av_sync->mutex);
+    if (ret) {
+        logger_log(av_sync->logger, LOGGER_INFO, "av_sync: delay streams by %8.6f secs", (double) delay / SECOND_IN_NSECS);
+    } else {
+        logger_log(av_sync->logger, LOGGER_ERR, "av_sync: cannot delay streams by %8.6f secs (limit %8.6f secs)",
+                   (double) delay / SECOND_IN_NSECS, (double) AV_SYNC_MAX_DELAY / SECOND_IN_NSECS);
+    }
+    return ret;
+}
+
+void
+av_sync_get_stats(av_sync_t *av_sync, av_sync_stats_t *stats)
+{
+    assert(av_sync);
+    assert(stats);
+    MUTEX_LOCK(av_sync->mutex);
+    stats->offset_error = (double) (av_sync->target - av_sync->offset) / SECOND_IN_NSECS;
+    stats->delay = (double) av_sync->delay / SECOND_IN_NSECS;
+    stats->configured_av_offset_valid = (av_sync->stream_active[AV_SYNC_AUDIO] && av_sync->stream_active[AV_SYNC_VIDEO]);
+    stats->configured_av_offset = (stats->configured_av_offset_valid ?
+                                   (double) (av_sync->stream_offset[AV_SYNC_AUDIO] -
+                                             av_sync->stream_offset[AV_SYNC_VIDEO]) / SECOND_IN_NSECS
+                                   : 0.0);
+    stats->steps = av_sync->steps;
+    MUTEX_UNLOCK(av_sync->mutex);
+}
+
+void
+av_sync_destroy(av_sync_t *av_sync)
+{
+    if (av_sync) {
+        MUTEX_DESTROY(av_sync->mutex);
+        free(av_sync);
+    }
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2026 agent, All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ *=================================================================
+ */
+
+/* The mapping from client (remote) time to local presentation time, shared by the audio and *
+ * video streams.  It follows the (local - remote) clock offset that raop_ntp provides with   *
+ * each audio packet and video frame, with corrections that are rate-limited (slewed) so the  *
+ * PTS given to the renderers never jump, except for very large changes (a new client clock). *
+ * A stream that reaches its pipeline too late can delay both streams by a bounded amount.    */
+
+#ifndef AV_SYNC_H
+#define AV_SYNC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "logger.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct av_sync_s av_sync_t;
+
+typedef enum av_sync_stream_e {
+    AV_SYNC_AUDIO,
+    AV_SYNC_VIDEO,
+    AV_SYNC_STREAMS
+} av_sync_stream_t;
+
+typedef struct av_sync_stats_s {
+    double offset_error;     /* (target - applied) offset still to be slewed, in seconds */
+    double delay;            /* delay of both streams added for pipelines that started late, in seconds */
+    /* configured (not measured) offset: (audio PTS - video PTS) for the same client time, from the offsets *
+     * applied to the latest buffer of each stream.  This is the user-requested audio delay, plus any slew  *
+     * of the mapping between the times the two buffers were mapped; the latencies of the renderers'     *
+     * pipelines are not included.                                                                        */
+    double configured_av_offset;
+    bool configured_av_offset_valid;   /* both streams have been active since the last reset */
+    uint64_t steps;          /* corrections too large to be slewed */
+} av_sync_stats_t;
+
+av_sync_t *av_sync_init(logger_t *logger);
+void av_sync_reset(av_sync_t *av_sync);
+uint64_t av_sync_get_pts(av_sync_t *av_sync, av_sync_stream_t stream, uint64_t remote_time, uint64_t local_time,
+                         int64_t stream_delay);
+bool av_sync_delay_streams(av_sync_t *av_sync, uint64_t delay);
+void av_sync_get_stats(av_sync_t *av_sync, av_sync_stats_t *stats);
+void av_sync_destroy(av_sync_t *av_sync);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //AV_SYNC_H
@@ -161,6 +161,23 @@ void aes_ctr_reset(aes_ctx_t *ctx) {
     aes_reset(ctx, EVP_aes_128_ctr(), AES_ENCRYPT);
 }
 
+/* position the keystream at the start of block number "block" (counted from the initial iv) */
+void aes_ctr_seek_block(aes_ctx_t *ctx, uint64_t block) {
+    uint8_t counter[AES_128_BLOCK_SIZE];
+    uint64_t carry = block;
+    memcpy(counter, ctx->iv, AES_128_BLOCK_SIZE);
+    /* the counter is the 128-bit big-endian iv, incremented once per block */
+    for (int i = AES_128_BLOCK_SIZE - 1; i >= 0 && carry; i--) {
+        carry += counter[i];
+        counter[i] = (uint8_t) (carry & 0xff);
+        carry >>= 8;
+    }
+    if (!EVP_EncryptInit_ex(ctx->cipher_ctx, NULL, NULL, NULL, counter)) {
+        handle_error(__func__);
+    }
+    ctx->block_offset = 0;
+}
+
 void aes_ctr_destroy(aes_ctx_t *ctx) {
     aes_destroy(ctx);
 }
@@ -48,6 +48,7 @@ void aes_ctr_reset(aes_ctx_t *ctx);
 void aes_ctr_encrypt(aes_ctx_t *ctx, const uint8_t *in, uint8_t *out, int len);
 void aes_ctr_decrypt(aes_ctx_t *ctx, const uint8_t *in, uint8_t *out, int len);
 void aes_ctr_start_fresh_block(aes_ctx_t *ctx);
+void aes_ctr_seek_block(aes_ctx_t *ctx, uint64_t block);
 void aes_ctr_destroy(aes_ctx_t *ctx);
 
 aes_ctx_t *aes_cbc_init(const uint8_t *key, const uint8_t *iv, aes_direction_t direction);
@@ -90,23 +90,19 @@ int fcup_request(void *conn_opaque, const char *media_url, const char *client_se
     free(plist_xml);
 
     const char *http_request = http_response_get_data(request, &requestlen); 
-    int send_len = send(socket_fd, http_request, requestlen, 0);
-    if (send_len < 0) {
-        int sock_err = SOCKET_GET_ERROR();
-	logger_log(conn->raop->logger, LOGGER_ERR, "fcup_request: send  error %d:%s\n",
-		 sock_err, SOCKET_ERROR_STRING(sock_err));
-	http_response_destroy(request);
-        /* shut down connection? */
-        return -1;
-    }
-
     if (logger_get_level(conn->raop->logger) >= LOGGER_DEBUG) {
       char *request_str =  utils_data_to_text(http_request, requestlen);
         logger_log(conn->raop->logger, LOGGER_DEBUG, "\n%s", request_str);
         free (request_str);
     }
-    http_response_destroy(request);
-    logger_log(conn->raop->logger, LOGGER_DEBUG,"fcup_request: send sent Request of %d bytes from socket %d\n",
-               send_len, socket_fd);
+
+    /* httpd queues the request on the (non-blocking) socket, and takes ownership of it */
+    if (httpd_send_by_type(conn->raop->httpd, CONNECTION_TYPE_PTTH, 1, request) < 0) {
+	logger_log(conn->raop->logger, LOGGER_ERR, "fcup_request: send error on socket %d\n", socket_fd);
+        return -1;
+    }
+
+    logger_log(conn->raop->logger, LOGGER_DEBUG,"fcup_request: send queued Request of %d bytes on socket %d\n",
+               requestlen, socket_fd);
     return 0;
 }
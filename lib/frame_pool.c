@@ -0,0 +1,206 @@
+/*
+ * Copyright (c) 2026 agent, All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ *=================================================================
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <assert.h>
+
+#include "frame_pool.h"
+#include "threads.h"
+
+/* size classes are powers of two from 1 kB to 16 MB; larger requests are not pooled */
+#define MIN_CLASS_SHIFT 10
+#define MAX_CLASS_SHIFT 24
+#define NUM_CLASSES (MAX_CLASS_SHIFT - MIN_CLASS_SHIFT + 1)
+
+typedef struct frame_pool_block_s {
+    frame_pool_t *pool;
+    struct frame_pool_block_s *next;
+    size_t capacity;
+    int size_class;              /* -1 for unpooled (oversize) blocks */
+} frame_pool_block_t;
+
+/* keep the data that follows the block header 16-byte aligned */
+#define BLOCK_HEADER_SIZE ((sizeof(frame_pool_block_t) + 15) & ~((size_t) 15))
+
+struct frame_pool_s {
+    logger_t *logger;
+    mutex_handle_t mutex;
+
+    /* MUTEX LOCKED VARIABLES START */
+    frame_pool_block_t *free_list[NUM_CLASSES];
+    size_t max_cached_bytes;
+    frame_pool_stats_t stats;
+    unsigned int outstanding;    /* number of buffers handed out and not yet released */
+    bool destroyed;
+    /* MUTEX LOCKED VARIABLES END */
+};
+
+static int
+frame_pool_size_class(size_t size)
+{
+    int size_class = 0;
+    size_t capacity = ((size_t) 1) << MIN_CLASS_SHIFT;
+    while (capacity < size) {
+        capacity <<= 1;
+        size_class++;
+        if (size_class == NUM_CLASSES) {
+            return -1;
+        }
+    }
+    return size_class;
+}
+
+static void
+frame_pool_free_cached(frame_pool_t *frame_pool)
+{
+    for (int i = 0; i < NUM_CLASSES; i++) {
+        frame_pool_block_t *block = frame_pool->free_list[i];
+        while (block) {
+            frame_pool_block_t *next = block->next;
+            free(block);
+            block = next;
+        }
+        frame_pool->free_list[i] = NULL;
+    }
+    frame_pool->stats.bytes_cached = 0;
+}
+
+frame_pool_t *
+frame_pool_init(logger_t *logger, size_t max_cached_bytes)
+{
+    frame_pool_t *frame_pool = calloc(1, sizeof(frame_pool_t));
+    if (!frame_pool) {
+        return NULL;
+    }
+    frame_pool->logger = logger;
+    frame_pool->max_cached_bytes = max_cached_bytes;
+    frame_pool->outstanding = 0;
+    frame_pool->destroyed = false;
+    MUTEX_CREATE(frame_pool->mutex);
+    return frame_pool;
+}
+
+/* returns a buffer with room for at least size bytes, or NULL if allocation failed */
+unsigned char *
+frame_pool_get(frame_pool_t *frame_pool, size_t size)
+{
+    frame_pool_block_t *block = NULL;
+    assert(frame_pool);
+    int size_class = frame_pool_size_class(size);
+    size_t capacity = (size_class < 0 ? size : ((size_t) 1) << (size_class + MIN_CLASS_SHIFT));
+
+    MUTEX_LOCK(frame_pool->mutex);
+    if (size_class >= 0 && frame_pool->free_list[size_class]) {
+        block = frame_pool->free_list[size_class];
+        frame_pool->free_list[size_class] = block->next;
+        frame_pool->stats.bytes_cached -= block->capacity;
+        frame_pool->stats.hits++;
+    } else {
+        frame_pool->stats.misses++;
+    }
+    MUTEX_UNLOCK(frame_pool->mutex);
+
+    if (!block) {
+        block = (frame_pool_block_t *) malloc(BLOCK_HEADER_SIZE + capacity);
+        if (!block) {
+            logger_log(frame_pool->logger, LOGGER_ERR, "frame_pool: failed to allocate %zu bytes", capacity);
+            return NULL;
+        }
+        block->pool = frame_pool;
+        block->capacity = capacity;
+        block->size_class = size_class;
+    }
+    block->next = NULL;
+
+    MUTEX_LOCK(frame_pool->mutex);
+    frame_pool->outstanding++;
+    frame_pool->stats.bytes_in_use += block->capacity;
+    size_t total = frame_pool->stats.bytes_in_use + frame_pool->stats.bytes_cached;
+    if (total > frame_pool->stats.peak_bytes) {
+        frame_pool->stats.peak_bytes = total;
+    }
+    MUTEX_UNLOCK(frame_pool->mutex);
+
+    return ((unsigned char *) block) + BLOCK_HEADER_SIZE;
+}
+
+/* may be called from any thread (e.g., a GStreamer streaming thread) */
+void
+frame_pool_release(void *data)
+{
+    if (!data) {
+        return;
+    }
+    frame_pool_block_t *block = (frame_pool_block_t *) (((unsigned char *) data) - BLOCK_HEADER_SIZE);
+    frame_pool_t *frame_pool = block->pool;
+    bool free_pool = false;
+    assert(frame_pool);
+
+    MUTEX_LOCK(frame_pool->mutex);
+    assert(frame_pool->outstanding > 0);
+    frame_pool->outstanding--;
+    frame_pool->stats.bytes_in_use -= block->capacity;
+    if (!frame_pool->destroyed && block->size_class >= 0 &&
+        frame_pool->stats.bytes_cached + block->capacity <= frame_pool->max_cached_bytes) {
+        block->next = frame_pool->free_list[block->size_class];
+        frame_pool->free_list[block->size_class] = block;
+        frame_pool->stats.bytes_cached += block->capacity;
+        block = NULL;
+    }
+    free_pool = (frame_pool->destroyed && frame_pool->outstanding == 0);
+    MUTEX_UNLOCK(frame_pool->mutex);
+
+    if (block) {
+        free(block);
+    }
+    if (free_pool) {
+        MUTEX_DESTROY(frame_pool->mutex);
+        free(frame_pool);
+    }
+}
+
+void
+frame_pool_get_stats(frame_pool_t *frame_pool, frame_pool_stats_t *stats)
+{
+    assert(frame_pool);
+    assert(stats);
+    MUTEX_LOCK(frame_pool->mutex);
+    memcpy(stats, &frame_pool->stats, sizeof(frame_pool_stats_t));
+    MUTEX_UNLOCK(frame_pool->mutex);
+}
+
+/* buffers that are still in use (e.g., held by GStreamer) remain valid;  *
+ * the pool itself is freed when the last of them is released            */
+void
+frame_pool_destroy(frame_pool_t *frame_pool)
+{
+    bool free_pool;
+    if (!frame_pool) {
+        return;
+    }
+    MUTEX_LOCK(frame_pool->mutex);
+    frame_pool_free_cached(frame_pool);
+    frame_pool->destroyed = true;
+    free_pool = (frame_pool->outstanding == 0);
+    MUTEX_UNLOCK(frame_pool->mutex);
+
+    if (free_pool) {
+        MUTEX_DESTROY(frame_pool->mutex);
+        free(frame_pool);
+    }
+}
@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2026 agent, All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ *=================================================================
+ */
+
+/* A pool of recycled buffers for received video frames, in power-of-two size classes.     *
+ * Buffers are obtained with frame_pool_get() and returned with frame_pool_release(), which *
+ * (like free()) only needs the buffer pointer, so it can be used as a GDestroyNotify.      *
+ * Released buffers are kept for reuse, up to a maximum total of cached bytes.  The pool is *
+ * only freed when it has been destroyed and all its buffers have been released.           */
+
+#ifndef FRAME_POOL_H
+#define FRAME_POOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "logger.h"
+
+typedef struct frame_pool_s frame_pool_t;
+
+typedef struct frame_pool_stats_s {
+    uint64_t hits;          /* requests served by a recycled buffer */
+    uint64_t misses;        /* requests that needed a new heap allocation */
+    size_t bytes_in_use;    /* capacity of buffers currently handed out */
+    size_t bytes_cached;    /* capacity of released buffers kept for reuse */
+    size_t peak_bytes;      /* maximum of bytes_in_use + bytes_cached */
+} frame_pool_stats_t;
+
+frame_pool_t *frame_pool_init(logger_t *logger, size_t max_cached_bytes);
+unsigned char *frame_pool_get(frame_pool_t *frame_pool, size_t size);
+void frame_pool_release(void *data);
+void frame_pool_get_stats(frame_pool_t *frame_pool, frame_pool_stats_t *stats);
+void frame_pool_destroy(frame_pool_t *frame_pool);
+
+#endif //FRAME_POOL_H
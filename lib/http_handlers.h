@@ -19,13 +19,11 @@
 #include "airplay_video.h"
 #include "fcup_request.h"
 
+/* the XML plist sent in response to GET /server-info */
 static void
-http_handler_server_info(raop_conn_t *conn, http_request_t *request, http_response_t *response,
-                         char **response_data, int *response_datalen)  {
-
-    assert(conn->raop->dnssd);
+http_server_info_build(raop_t *raop, char **data, int *datalen) {
     int hw_addr_raw_len = 0;
-    const char *hw_addr_raw = dnssd_get_hw_addr(conn->raop->dnssd, &hw_addr_raw_len);
+    const char *hw_addr_raw = dnssd_get_hw_addr(raop->dnssd, &hw_addr_raw_len);
 
     char *hw_addr = calloc(1, 3 * hw_addr_raw_len);
     //int hw_addr_len =
@@ -68,21 +66,43 @@ http_handler_server_info(raop_conn_t *conn, http_request_t *request, http_respon
     plist_t device_id_node = plist_new_string(hw_addr);
     plist_dict_set_item(r_node, "deviceid", device_id_node);
 
-    plist_to_xml(r_node, response_data, (uint32_t *) response_datalen);
+    plist_to_xml(r_node, data, (uint32_t *) datalen);
 
-    //assert(*response_datalen == strlen(*response_data));
+    //assert(*datalen == strlen(*data));
 
-    /* last character (at *response_data[response_datalen - 1]) is  0x0a = '\n'
-     * (*response_data[response_datalen] is '\0').
-     * apsdk removes the last "\n" by overwriting it with '\0', and reducing response_datalen by 1. 
+    /* last character (at *data[datalen - 1]) is  0x0a = '\n'
+     * (*data[datalen] is '\0').
+     * apsdk removes the last "\n" by overwriting it with '\0', and reducing datalen by 1. 
      * TODO: check if this is necessary  */
     
     plist_free(r_node);
-    http_response_add_header(response, "Content-Type", "text/x-apple-plist+xml");
     free(hw_addr);
+}
+
+static void
+http_handler_server_info(raop_conn_t *conn, http_request_t *request, http_response_t *response,
+                         char **response_data, int *response_datalen)  {
+
+    raop_t *raop = conn->raop;
+    assert(raop->dnssd);
+
+    MUTEX_LOCK(raop->info_mutex);
+    if (!raop->server_info_data) {
+        http_server_info_build(raop, &raop->server_info_data, &raop->server_info_datalen);
+    }
+    *response_data = NULL;
+    *response_datalen = 0;
+    if (raop->server_info_data) {
+        *response_data = malloc(raop->server_info_datalen);
+        assert(*response_data);
+        memcpy(*response_data, raop->server_info_data, raop->server_info_datalen);
+        *response_datalen = raop->server_info_datalen;
+    }
+    MUTEX_UNLOCK(raop->info_mutex);
+    http_response_add_header(response, "Content-Type", "text/x-apple-plist+xml");
     
     /* initialize the airplay video service */
-    const char *session_id = http_request_get_header(request, "X-Apple-Session-ID");
+    const char *session_id = http_request_get_known_header(request, HTTP_HEADER_APPLE_SESSION_ID);
 
     airplay_video_service_init(conn->raop, conn->raop->port, session_id);
 
@@ -275,7 +295,7 @@ http_handler_playback_info(raop_conn_t *conn, http_request_t *request, http_resp
                            char **response_data, int *response_datalen)
 {
     logger_log(conn->raop->logger, LOGGER_DEBUG, "http_handler_playback_info");
-    //const char *session_id = http_request_get_header(request, "X-Apple-Session-ID");
+    //const char *session_id = http_request_get_known_header(request, HTTP_HEADER_APPLE_SESSION_ID);
     playback_info_t playback_info;
 
     playback_info.stallcount = 0;
@@ -370,7 +390,7 @@ http_handler_action(raop_conn_t *conn, http_request_t *request, http_response_t
     bool logger_debug = (logger_get_level(conn->raop->logger) >= LOGGER_DEBUG);
     
 
-    const char* session_id = http_request_get_header(request, "X-Apple-Session-ID");
+    const char* session_id = http_request_get_known_header(request, HTTP_HEADER_APPLE_SESSION_ID);
     if (!session_id) {
         logger_log(conn->raop->logger, LOGGER_ERR, "Play request had no X-Apple-Session-ID");
         goto post_action_error;
@@ -562,7 +582,7 @@ http_handler_action(raop_conn_t *conn, http_request_t *request, http_response_t
 	--uri_num;    // (next num is current num + 1)
 	store_media_playlist(conn->raop->airplay_video, playlist, uri_num);
         float duration = 0.0f;
-        int count = analyze_media_playlist(playlist, &duration);
+        int count = get_media_playlist_info(conn->raop->airplay_video, NULL, uri_num, &duration);
         if (count) {
         logger_log(conn->raop->logger, LOGGER_DEBUG,
                    "\n%s:\nreceived media playlist has %5d chunks, total duration %9.3f secs\n",
@@ -624,7 +644,7 @@ http_handler_play(raop_conn_t *conn, http_request_t *request, http_response_t *r
 
     logger_log(conn->raop->logger, LOGGER_DEBUG, "http_handler_play");
 
-    const char* session_id = http_request_get_header(request, "X-Apple-Session-ID");
+    const char* session_id = http_request_get_known_header(request, HTTP_HEADER_APPLE_SESSION_ID);
     if (!session_id) {
         logger_log(conn->raop->logger, LOGGER_ERR, "Play request had no X-Apple-Session-ID");
         goto play_error;
@@ -773,13 +793,17 @@ http_handler_hls(raop_conn_t *conn,  http_request_t *request, http_response_t *r
         }
 
     } else {
-        char *media_playlist = get_media_playlist(conn->raop->airplay_video, url);
+        /* the playlist was expanded when it was stored: send a copy */
+        int len = 0;
+        const char *media_playlist = get_media_playlist(conn->raop->airplay_video, url, &len);
         if (media_playlist) {
-            char *data  = adjust_yt_condensed_playlist(media_playlist);
+            char *data = (char *) malloc(len + 1);
+            assert(data);
+            memcpy(data, media_playlist, len + 1);
             *response_data = data;
-            *response_datalen = strlen(data);
+            *response_datalen = len;
             float duration = 0.0f;
-            int chunks = analyze_media_playlist(data, &duration);
+            int chunks = get_media_playlist_info(conn->raop->airplay_video, url, -1, &duration);
             logger_log(conn->raop->logger, LOGGER_INFO,
                        "Requested media_playlist %s has %5d chunks, total duration %9.3f secs", url, chunks, duration); 
         } else {
@@ -19,44 +19,151 @@
 #include <string.h>
 #include <assert.h>
 #include <stdio.h>
+#include <limits.h>
+#include <strings.h>
 
 #include "http_request.h"
 #include "llhttp/llhttp.h"
 
+/* the request line, headers and body are copied into a single arena owned by the request, and *
+ * kept as (offset, length) slices of it: the data passed to http_request_add_data is a transient *
+ * receive buffer, and a request can be handled on another thread after it was parsed.  The arena *
+ * (and the header table) are kept when the request is reset for the next request on a connection */
+#define HTTP_REQUEST_ARENA_SIZE 1024
+/* larger arenas (left by requests with large bodies) are freed on reset */
+#define HTTP_REQUEST_ARENA_KEEP (64 * 1024)
+#define HTTP_REQUEST_HEADERS_SIZE 16
+
+typedef struct http_slice_s {
+    int offset;    /* -1 if not set */
+    int len;
+} http_slice_t;
+
+typedef struct http_header_s {
+    http_slice_t field;
+    http_slice_t value;
+} http_header_t;
+
+/* the item currently being received: llhttp may deliver each of them in several fragments */
+typedef enum http_item_e {
+    HTTP_ITEM_NONE,
+    HTTP_ITEM_URL,
+    HTTP_ITEM_PROTOCOL,
+    HTTP_ITEM_FIELD,
+    HTTP_ITEM_VALUE,
+    HTTP_ITEM_BODY
+} http_item_t;
+
+static const char *known_header_names[HTTP_HEADER_KNOWN] = {
+    "CSeq",
+    "Content-Type",
+    "X-Apple-Session-ID",
+    "DACP-ID",
+    "Active-Remote",
+    "Authorization"
+};
+
 struct http_request_s {
     llhttp_t parser;
     llhttp_settings_t parser_settings;
 
     bool is_reverse;  // if true, this is a reverse-response from client
     const char *method;
-    char *url;
-    char protocol[9];
+    http_slice_t url;
+    http_slice_t protocol;
 
-    char **headers;
+    http_header_t *headers;
     int headers_size;
-    int headers_index;
+    int headers_count;
+    /* index + 1 in headers of the first occurrence of each known header (0 if absent) */
+    int known_headers[HTTP_HEADER_KNOWN];
+
+    http_slice_t data;
 
-    char *data;
-    int datalen;
+    char *arena;
+    int arena_size;
+    int arena_len;    /* includes the terminating '\0' of the last slice */
+    http_item_t item;
 
     int complete;
 };
 
+static void
+http_slice_clear(http_slice_t *slice)
+{
+    slice->offset = -1;
+    slice->len = 0;
+}
+
+static const char *
+http_slice_get(http_request_t *request, http_slice_t *slice)
+{
+    if (slice->offset < 0) {
+        return NULL;
+    }
+    return request->arena + slice->offset;
+}
+
+/* append a fragment of the item being received to its slice, starting a new slice at the end of *
+ * the arena if this is the first fragment.  Slices are always '\0'-terminated in the arena      */
+static int
+http_request_append(http_request_t *request, http_item_t item, http_slice_t *slice, const char *at, size_t length)
+{
+    if (request->item != item || slice->offset < 0) {
+        slice->offset = request->arena_len;
+        slice->len = 0;
+        request->item = item;
+    }
+    if (length > (size_t) (INT_MAX / 2 - slice->offset - slice->len - 1)) {
+        return -1;
+    }
+    int needed = slice->offset + slice->len + (int) length + 1;
+    if (needed > request->arena_size) {
+        int size = (request->arena_size ? request->arena_size : HTTP_REQUEST_ARENA_SIZE);
+        while (size < needed) {
+            size *= 2;
+        }
+        char *arena = realloc(request->arena, size);
+        if (!arena) {
+            return -1;
+        }
+        request->arena = arena;
+        request->arena_size = size;
+    }
+    memcpy(request->arena + slice->offset + slice->len, at, length);
+    slice->len += (int) length;
+    request->arena[slice->offset + slice->len] = '\0';
+    request->arena_len = needed;
+    return 0;
+}
+
 static int
 on_url(llhttp_t *parser, const char *at, size_t length)
 {
     http_request_t *request = parser->data;
-    int urllen = request->url ? strlen(request->url) : 0;
-
-    request->url = realloc(request->url, urllen+length+1);
-    assert(request->url);
+    return http_request_append(request, HTTP_ITEM_URL, &request->url, at, length);
+}
 
-    request->url[urllen] = '\0';
-    strncat(request->url, at, length);
+static int
+on_protocol(llhttp_t *parser, const char *at, size_t length)
+{
+    http_request_t *request = parser->data;
+    return http_request_append(request, HTTP_ITEM_PROTOCOL, &request->protocol, at, length);
+}
 
-    strncpy(request->protocol, at + length + 1, 8);
+/* the protocol is stored as "RTSP/1.0" */
+static int
+on_protocol_complete(llhttp_t *parser)
+{
+    http_request_t *request = parser->data;
+    return http_request_append(request, HTTP_ITEM_PROTOCOL, &request->protocol, "/", 1);
+}
 
-    return 0;
+static int
+on_version(llhttp_t *parser, const char *at, size_t length)
+{
+    http_request_t *request = parser->data;
+    return http_request_append(request, HTTP_ITEM_PROTOCOL, &request->protocol, at, length);
 }
 
 static int
@@ -64,33 +171,39 @@ on_header_field(llhttp_t *parser, const char *at, size_t length)
 {
     http_request_t *request = parser->data;
 
-    /* Check if our index is a value */
-    if (request->headers_index%2 == 1) {
-        request->headers_index++;
+    /* Allocate space for a new field-value pair */
+    if (request->item != HTTP_ITEM_FIELD) {
+        if (request->headers_count == request->headers_size) {
+            int size = request->headers_size + HTTP_REQUEST_HEADERS_SIZE;
+            http_header_t *headers = realloc(request->headers, size * sizeof(http_header_t));
+            if (!headers) {
+                return -1;
+            }
+            request->headers = headers;
+            request->headers_size = size;
+        }
+        http_header_t *header = &request->headers[request->headers_count++];
+        http_slice_clear(&header->field);
+        http_slice_clear(&header->value);
     }
+    return http_request_append(request, HTTP_ITEM_FIELD, &request->headers[request->headers_count - 1].field,
+                               at, length);
+}
 
-    /* Allocate space for new field-value pair */
-    if (request->headers_index == request->headers_size) {
-        request->headers_size += 2;
-        request->headers = realloc(request->headers,
-                                   request->headers_size*sizeof(char*));
-        assert(request->headers);
-        request->headers[request->headers_index] = NULL;
-        request->headers[request->headers_index+1] = NULL;
-    }
+/* note the first occurrence of the headers that have a known_headers slot */
+static int
+on_header_field_complete(llhttp_t *parser)
+{
+    http_request_t *request = parser->data;
+    http_header_t *header = &request->headers[request->headers_count - 1];
+    const char *field = http_slice_get(request, &header->field);
 
-    /* Allocate space in the current header string */
-    if (request->headers[request->headers_index] == NULL) {
-        request->headers[request->headers_index] = calloc(1, length+1);
-    } else {
-        request->headers[request->headers_index] = realloc(
-                request->headers[request->headers_index],
-                strlen(request->headers[request->headers_index])+length+1
-        );
+    for (int i = 0; i < HTTP_HEADER_KNOWN; i++) {
+        if (!request->known_headers[i] && !strcasecmp(field, known_header_names[i])) {
+            request->known_headers[i] = request->headers_count;
+            break;
+        }
     }
-    assert(request->headers[request->headers_index]);
-
-    strncat(request->headers[request->headers_index], at, length);
     return 0;
 }
 
@@ -98,24 +211,19 @@ static int
 on_header_value(llhttp_t *parser, const char *at, size_t length)
 {
     http_request_t *request = parser->data;
+    return http_request_append(request, HTTP_ITEM_VALUE, &request->headers[request->headers_count - 1].value,
+                               at, length);
+}
 
-    /* Check if our index is a field */
-    if (request->headers_index%2 == 0) {
-        request->headers_index++;
-    }
-
-    /* Allocate space in the current header string */
-    if (request->headers[request->headers_index] == NULL) {
-        request->headers[request->headers_index] = calloc(1, length+1);
-    } else {
-        request->headers[request->headers_index] = realloc(
-                request->headers[request->headers_index],
-                strlen(request->headers[request->headers_index])+length+1
-        );
+/* a header with an empty value has no on_header_value callback */
+static int
+on_header_value_complete(llhttp_t *parser)
+{
+    http_request_t *request = parser->data;
+    if (request->item != HTTP_ITEM_VALUE) {
+        return http_request_append(request, HTTP_ITEM_VALUE, &request->headers[request->headers_count - 1].value,
+                                   "", 0);
     }
-    assert(request->headers[request->headers_index]);
-
-    strncat(request->headers[request->headers_index], at, length);
     return 0;
 }
 
@@ -123,13 +231,7 @@ static int
 on_body(llhttp_t *parser, const char *at, size_t length)
 {
     http_request_t *request = parser->data;
-
-    request->data = realloc(request->data, request->datalen+length);
-    assert(request->data);
-
-    memcpy(request->data+request->datalen, at, length);
-    request->datalen += length;
-    return 0;
+    return http_request_append(request, HTTP_ITEM_BODY, &request->data, at, length);
 }
 
 static int
@@ -139,9 +241,25 @@ on_message_complete(llhttp_t *parser)
 
     request->method = llhttp_method_name(request->parser.method);
     request->complete = 1;
+    request->item = HTTP_ITEM_NONE;
     return 0;
 }
 
+static void
+http_request_clear(http_request_t *request)
+{
+    request->is_reverse = false;
+    request->method = NULL;
+    http_slice_clear(&request->url);
+    http_slice_clear(&request->protocol);
+    http_slice_clear(&request->data);
+    request->headers_count = 0;
+    memset(request->known_headers, 0, sizeof(request->known_headers));
+    request->arena_len = 0;
+    request->item = HTTP_ITEM_NONE;
+    request->complete = 0;
+}
+
 http_request_t *
 http_request_init(void)
 {
@@ -154,29 +272,42 @@ http_request_init(void)
 
     llhttp_settings_init(&request->parser_settings);
     request->parser_settings.on_url = &on_url;
+    request->parser_settings.on_protocol = &on_protocol;
+    request->parser_settings.on_protocol_complete = &on_protocol_complete;
+    request->parser_settings.on_version = &on_version;
     request->parser_settings.on_header_field = &on_header_field;
+    request->parser_settings.on_header_field_complete = &on_header_field_complete;
     request->parser_settings.on_header_value = &on_header_value;
+    request->parser_settings.on_header_value_complete = &on_header_value_complete;
     request->parser_settings.on_body = &on_body;
     request->parser_settings.on_message_complete = &on_message_complete;
 
     llhttp_init(&request->parser, HTTP_REQUEST, &request->parser_settings);
     request->parser.data = request;
-    request->is_reverse = false;
+    http_request_clear(request);
     return request;
 }
 
+/* prepare the request for the next request on the same connection, keeping its storage */
 void
-http_request_destroy(http_request_t *request)
+http_request_reset(http_request_t *request)
 {
-    int i;
+    assert(request);
+    llhttp_reset(&request->parser);
+    http_request_clear(request);
+    if (request->arena_size > HTTP_REQUEST_ARENA_KEEP) {
+        free(request->arena);
+        request->arena = NULL;
+        request->arena_size = 0;
+    }
+}
 
+void
+http_request_destroy(http_request_t *request)
+{
     if (request) {
-        free(request->url);
-        for (i=0; i<request->headers_size; i++) {
-            free(request->headers[i]);
-        }
         free(request->headers);
-        free(request->data);
+        free(request->arena);
         free(request);
     }
 }
@@ -250,7 +381,7 @@ http_request_get_url(http_request_t *request)
     if (request->is_reverse) {
         return NULL;
     }
-    return request->url;
+    return http_slice_get(request, &request->url);
 }
 
 const char *
@@ -260,9 +391,11 @@ http_request_get_protocol(http_request_t *request)
     if (request->is_reverse) {
         return NULL;
     }
-    return request->protocol;
+    const char *protocol = http_slice_get(request, &request->protocol);
+    return (protocol ? protocol : "");
 }
 
+/* headers without a known_headers slot are found by a (case-insensitive) linear search */
 const char *
 http_request_get_header(http_request_t *request, const char *name)
 {
@@ -273,28 +406,40 @@ http_request_get_header(http_request_t *request, const char *name)
         return NULL;
     }
 
-    for (i=0; i<request->headers_size; i+=2) {
-        if (!strcmp(request->headers[i], name)) {
-            return request->headers[i+1];
+    for (i=0; i<request->headers_count; i++) {
+        const char *field = http_slice_get(request, &request->headers[i].field);
+        if (field && !strcasecmp(field, name)) {
+            return http_slice_get(request, &request->headers[i].value);
         }
     }
     return NULL;
 }
 
+const char *
+http_request_get_known_header(http_request_t *request, http_header_id_t id)
+{
+    assert(request);
+    assert(id < HTTP_HEADER_KNOWN);
+    if (request->is_reverse || !request->known_headers[id]) {
+        return NULL;
+    }
+    return http_slice_get(request, &request->headers[request->known_headers[id] - 1].value);
+}
+
 const char *
 http_request_get_data(http_request_t *request, int *datalen)
 {
     assert(request);
     if (datalen) {
-        *datalen = request->datalen;
+        *datalen = request->data.len;
     }
-    return request->data;
+    return http_slice_get(request, &request->data);
 }
 
 int 
 http_request_get_header_string(http_request_t *request, char **header_str)
 {
-    if(!request || request->headers_size == 0) {
+    if(!request || request->headers_count == 0) {
         *header_str = NULL;
         return 0;
     }
@@ -303,33 +448,26 @@ http_request_get_header_string(http_request_t *request, char **header_str)
         return 0;
     }    
     int len = 0;
-    for (int i = 0; i < request->headers_size; i++) {
-        len += strlen(request->headers[i]);
-        if (i%2 == 0) {
-            len += 2;
-        } else {
-            len++;
-        }
+    for (int i = 0; i < request->headers_count; i++) {
+        len += request->headers[i].field.len + 2 + request->headers[i].value.len + 1;
     }
     char *str = calloc(len+1, sizeof(char));
     assert(str);
     *header_str = str;
     char *p = str;
-    int n = len + 1;
-    for (int i = 0; i < request->headers_size; i++) {
-        int hlen = strlen(request->headers[i]); 
-        snprintf(p, n, "%s", request->headers[i]);
-        n -= hlen;
-        p += hlen;
-        if (i%2 == 0) {
-            snprintf(p, n, ": ");
-            n -= 2;
-            p += 2;
-        } else {
-	    snprintf(p, n, "\n");
-            n--;
-            p++;
+    for (int i = 0; i < request->headers_count; i++) {
+        http_header_t *header = &request->headers[i];
+        if (header->field.len) {
+            memcpy(p, request->arena + header->field.offset, header->field.len);
+            p += header->field.len;
+        }
+        memcpy(p, ": ", 2);
+        p += 2;
+        if (header->value.len) {
+            memcpy(p, request->arena + header->value.offset, header->value.len);
+            p += header->value.len;
         }
+        *p++ = '\n';
     }
     assert(p == &(str[len]));
     return len;
@@ -19,7 +19,19 @@
 
 typedef struct http_request_s http_request_t;
 
+/* headers with a slot for constant-time lookup by http_request_get_known_header */
+typedef enum http_header_id_e {
+    HTTP_HEADER_CSEQ,
+    HTTP_HEADER_CONTENT_TYPE,
+    HTTP_HEADER_APPLE_SESSION_ID,
+    HTTP_HEADER_DACP_ID,
+    HTTP_HEADER_ACTIVE_REMOTE,
+    HTTP_HEADER_AUTHORIZATION,
+    HTTP_HEADER_KNOWN
+} http_header_id_t;
+
 http_request_t *http_request_init(void);
+void http_request_reset(http_request_t *request);
 
 int http_request_add_data(http_request_t *request, const char *data, int datalen);
 int http_request_is_complete(http_request_t *request);
@@ -31,6 +43,7 @@ const char *http_request_get_method(http_request_t *request);
 const char *http_request_get_url(http_request_t *request);
 const char *http_request_get_protocol(http_request_t *request);
 const char *http_request_get_header(http_request_t *request, const char *name);
+const char *http_request_get_known_header(http_request_t *request, http_header_id_t id);
 const char *http_request_get_data(http_request_t *request, int *datalen);
 int http_request_get_header_string(http_request_t *request, char **header_str);
 bool http_request_is_reverse(http_request_t *request);
@@ -20,7 +20,32 @@
 #include <stdio.h>
 #include <assert.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <errno.h>
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/uio.h>
+#endif
+
+/* All sockets are non-blocking.  On Linux, the httpd thread sleeps in epoll_wait() (edge-triggered) *
+ * until a socket is ready, and is woken through an eventfd when it must stop, or when a worker has  *
+ * finished with a request.  Elsewhere it uses select() with a 1 sec timeout, checking httpd->running *
+ * each time.  Responses are queued on their connection and written with a single gather-write when *
+ * the socket can accept them, so a slow client never blocks the other connections.                  *
+ *                                                                                                   *
+ * Requests are handled on the httpd thread, or (on Linux, after httpd_set_workers) by a pool of     *
+ * worker threads, so that slow handlers (pairing, FairPlay, plist parsing) do not delay the I/O of  *
+ * other connections.  A connection has at most one request in progress on the workers, and is not   *
+ * read from until it has finished, so its requests are handled in order; requests on different      *
+ * connections are handled in parallel, and the callbacks must protect any state they share.         *
+ * conn_init is called on the httpd thread; conn_destroy is never called from inside another        *
+ * callback (with workers, it is called on a worker, as the application state it changes may be in   *
+ * use by the handlers of other connections).                                                        */
+#ifdef __linux__
+#define HTTPD_USE_EPOLL
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
 
 #include "httpd.h"
 #include "netutils.h"
@@ -29,6 +54,39 @@
 #include "logger.h"
 #include "utils.h"
 
+#define MAX_CONNECTIONS 12  /* default value, used in AppleTV 3*/
+/* without epoll, all sockets must fit in an fd_set */
+#ifdef HTTPD_USE_EPOLL
+#define HTTPD_CONNECTIONS_LIMIT 1024
+#else
+#define HTTPD_CONNECTIONS_LIMIT (FD_SETSIZE / 2)
+#endif
+
+/* a connection is dropped if its client does not read its queued responses */
+#define HTTPD_MAX_OUTPUT (16 * 1024 * 1024)
+#define HTTPD_MAX_IOVECS 16
+
+#define HTTPD_MAX_WORKERS 8
+
+#ifdef MSG_NOSIGNAL
+#define HTTPD_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define HTTPD_SEND_FLAGS 0
+#endif
+
+#define HTTPD_WOULD_BLOCK(err) ((err) == SOCKET_ERRORNAME(EAGAIN) || (err) == SOCKET_ERRORNAME(EWOULDBLOCK))
+
+#ifdef HTTPD_USE_EPOLL
+/* epoll event data for the sockets that are not connections (whose event data is their index) */
+#define HTTPD_EVENT_WAKE    ((uint64_t) -1)
+#define HTTPD_EVENT_SERVER4 ((uint64_t) -2)
+#define HTTPD_EVENT_SERVER6 ((uint64_t) -3)
+#define HTTPD_MAX_EVENTS 32
+#endif
+
+/* length of "HTTP/1.1", which starts reverse-http responses from the client */
+#define HTTP_PREFIX_LEN 8
+
 static const char *typename[] = {
     [CONNECTION_TYPE_UNKNOWN] = "Unknown",
     [CONNECTION_TYPE_RAOP]    = "RAOP",
@@ -37,13 +95,52 @@ static const char *typename[] = {
     [CONNECTION_TYPE_HLS]     = "HLS"
 };
 
+/* work for the worker threads: a request to handle, or (if request is NULL) user_data to destroy */
+struct httpd_job_s {
+    int index;
+    void *user_data;
+    http_request_t *request;
+    http_response_t *response;
+    struct httpd_job_s *next;
+};
+typedef struct httpd_job_s httpd_job_t;
+
+/* a response (or reverse-http request) waiting to be sent */
+struct http_output_s {
+    http_response_t *response;
+    const char *data;
+    int datalen;
+    int sent;
+    struct http_output_s *next;
+};
+typedef struct http_output_s http_output_t;
+
 struct http_connection_s {
     int connected;
 
     int socket_fd;
     void *user_data;
     connection_type_t type;
+    /* reused (after http_request_reset) for each request on the connection */
     http_request_t *request;
+    bool in_request;
+
+    /* start of a new request, held until it is known whether it is a reverse-http response */
+    char prefix[HTTP_PREFIX_LEN];
+    int prefix_len;
+
+    /* queue of output waiting for the socket to become writable */
+    http_output_t *output_head;
+    http_output_t *output_tail;
+    int output_len;
+    bool disconnect;
+
+    /* a request handler (or the destruction of user_data) is in progress for this connection */
+    bool busy;
+    /* conn_destroy is due for user_data, without workers (see httpd_destroy_pending) */
+    bool destroy_pending;
+    /* the connection is being removed: its slot is freed when it is no longer busy */
+    bool closing;
 };
 typedef struct http_connection_s http_connection_t;
 
@@ -65,6 +162,32 @@ struct httpd_s {
     /* Server fds for accepting connections */
     int server_fd4;
     int server_fd6;
+
+    /* a connection attempt is waiting for a free connection slot */
+    bool accept_pending;
+
+    /* epoll instance of the httpd thread, and eventfd used to wake it (-1 if not used) */
+    int epoll_fd;
+    int wake_fd;
+
+    /* protects the connections, which are also used by request handlers on other threads */
+    mutex_handle_t conn_mutex;
+
+    /* worker threads (none if requests are handled on the httpd thread) */
+    int num_workers;
+    thread_handle_t *workers;
+    bool workers_running;
+    /* some connection has destroy_pending set */
+    bool destroy_pending;
+
+    /* These variables only edited work_mutex locked */
+    mutex_handle_t work_mutex;
+    cond_handle_t work_cond;
+    bool workers_stop;
+    httpd_job_t *jobs_head;
+    httpd_job_t *jobs_tail;
+    httpd_job_t *done_head;
+    httpd_job_t *done_tail;
 };
 
 const char *
@@ -72,87 +195,106 @@ httpd_get_connection_typename (connection_type_t type) {
   return typename[type];
 }
 
+/* connections that are being removed are not reported by these functions, which may be called from *
+ * any thread (in particular, by request handlers running on the worker threads)                     */
 int
 httpd_get_connection_socket (httpd_t *httpd, void *user_data) {
+    int socket_fd = -1;
+    MUTEX_LOCK(httpd->conn_mutex);
     for (int i = 0; i < httpd->max_connections; i++) {
         http_connection_t *connection = &httpd->connections[i];
-	if (!connection->connected) {
+	if (!connection->connected || connection->closing) {
             continue;
         }
         if (connection->user_data == user_data) {
-            return connection->socket_fd;
+            socket_fd = connection->socket_fd;
+            break;
         }
     }
-    return -1;
+    MUTEX_UNLOCK(httpd->conn_mutex);
+    return socket_fd;
 }
 
 int
 httpd_set_connection_type (httpd_t *httpd, void *user_data, connection_type_t type) {
+    int ret = -1;
+    MUTEX_LOCK(httpd->conn_mutex);
     for (int i = 0; i < httpd->max_connections; i++) {
         http_connection_t *connection = &httpd->connections[i];
-	if (!connection->connected) {
+	if (!connection->connected || connection->closing) {
             continue;
         }
         if (connection->user_data == user_data) {
             connection->type = type;
-            return i;
+            ret = i;
+            break;
         }
     }
-    return -1;
+    MUTEX_UNLOCK(httpd->conn_mutex);
+    return ret;
 }
-  
+
 int
 httpd_count_connection_type (httpd_t *httpd, connection_type_t type) {
     int count = 0;
+    MUTEX_LOCK(httpd->conn_mutex);
     for (int i = 0; i < httpd->max_connections; i++) {
         http_connection_t *connection = &httpd->connections[i];
-        if (!connection->connected) {
+        if (!connection->connected || connection->closing) {
             continue;
         }
         if (connection->type == type) {
             count++;
         }
     }
+    MUTEX_UNLOCK(httpd->conn_mutex);
     return count;
 }
 
 int
 httpd_get_connection_socket_by_type (httpd_t *httpd, connection_type_t type, int instance){
     int count = 0;
+    int socket_fd = 0;
+    MUTEX_LOCK(httpd->conn_mutex);
     for (int i = 0; i < httpd->max_connections; i++) {
         http_connection_t *connection = &httpd->connections[i];
-        if (!connection->connected) {
+        if (!connection->connected || connection->closing) {
             continue;
         }
         if (connection->type == type) {
             count++;
             if (count == instance) {
-                return connection->socket_fd;
+                socket_fd = connection->socket_fd;
+                break;
             }
         }
     }
-    return 0;
+    MUTEX_UNLOCK(httpd->conn_mutex);
+    return socket_fd;
 }
 
 void *
 httpd_get_connection_by_type (httpd_t *httpd, connection_type_t type, int instance){
     int count = 0;
+    void *user_data = NULL;
+    MUTEX_LOCK(httpd->conn_mutex);
     for (int i = 0; i < httpd->max_connections; i++) {
         http_connection_t *connection = &httpd->connections[i];
-        if (!connection->connected) {
+        if (!connection->connected || connection->closing) {
             continue;
         }
         if (connection->type == type) {
             count++;
             if (count == instance) {
-                return connection->user_data;
+                user_data = connection->user_data;
+                break;
             }
         }
     }
-    return NULL;
+    MUTEX_UNLOCK(httpd->conn_mutex);
+    return user_data;
 }
 
-#define MAX_CONNECTIONS 12  /* value used in AppleTV 3*/
 httpd_t *
 httpd_init(logger_t *logger, httpd_callbacks_t *callbacks, int nohold)
 {
@@ -167,7 +309,7 @@ httpd_init(logger_t *logger, httpd_callbacks_t *callbacks, int nohold)
     }
 
     httpd->nohold = (nohold ? 1 : 0);
-    httpd->max_connections = MAX_CONNECTIONS;  
+    httpd->max_connections = MAX_CONNECTIONS;
     httpd->connections = calloc(httpd->max_connections, sizeof(http_connection_t));
     if (!httpd->connections) {
         free(httpd);
@@ -180,38 +322,289 @@ httpd_init(logger_t *logger, httpd_callbacks_t *callbacks, int nohold)
     /* Save callback pointers */
     memcpy(&httpd->callbacks, callbacks, sizeof(httpd_callbacks_t));
 
+    httpd->server_fd4 = -1;
+    httpd->server_fd6 = -1;
+    httpd->epoll_fd = -1;
+    httpd->wake_fd = -1;
+#ifdef HTTPD_USE_EPOLL
+    httpd->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (httpd->wake_fd == -1) {
+        int sock_err = SOCKET_GET_ERROR();
+        logger_log(logger, LOGGER_ERR, "httpd could not create eventfd %d %s", sock_err, SOCKET_ERROR_STRING(sock_err));
+        free(httpd->connections);
+        free(httpd);
+        return NULL;
+    }
+#endif
+
     /* Initial status joined */
     httpd->running = 0;
     httpd->joined = 1;
+    MUTEX_CREATE(httpd->run_mutex);
+    MUTEX_CREATE(httpd->conn_mutex);
+    MUTEX_CREATE(httpd->work_mutex);
+    COND_CREATE(httpd->work_cond);
 
     return httpd;
 }
 
+/* handle requests on num_workers worker threads (0: on the httpd thread, the default); this must be *
+ * done while httpd is stopped.  Workers are only used on Linux, where the httpd thread uses epoll   */
+int
+httpd_set_workers(httpd_t *httpd, int num_workers)
+{
+    thread_handle_t *workers = NULL;
+    assert(httpd);
+
+    if (num_workers < 0 || num_workers > HTTPD_MAX_WORKERS) {
+        logger_log(httpd->logger, LOGGER_ERR, "httpd: invalid number of worker threads %d (limit %d)",
+                   num_workers, HTTPD_MAX_WORKERS);
+        return -1;
+    }
+#ifndef HTTPD_USE_EPOLL
+    if (num_workers) {
+        logger_log(httpd->logger, LOGGER_ERR, "httpd: worker threads are not supported on this system");
+        return -1;
+    }
+#endif
+    MUTEX_LOCK(httpd->run_mutex);
+    if (httpd->running || !httpd->joined) {
+        MUTEX_UNLOCK(httpd->run_mutex);
+        return -1;
+    }
+    if (num_workers) {
+        workers = calloc(num_workers, sizeof(thread_handle_t));
+        if (!workers) {
+            MUTEX_UNLOCK(httpd->run_mutex);
+            return -1;
+        }
+    }
+    free(httpd->workers);
+    httpd->workers = workers;
+    httpd->num_workers = num_workers;
+    MUTEX_UNLOCK(httpd->run_mutex);
+    return 0;
+}
+
+/* sets the maximum number of simultaneous connections; this must be done while httpd is stopped */
+int
+httpd_set_max_connections(httpd_t *httpd, int max_connections)
+{
+    http_connection_t *connections;
+    assert(httpd);
+
+    if (max_connections < 1 || max_connections > HTTPD_CONNECTIONS_LIMIT) {
+        logger_log(httpd->logger, LOGGER_ERR, "httpd: invalid max_connections %d (limit %d)",
+                   max_connections, HTTPD_CONNECTIONS_LIMIT);
+        return -1;
+    }
+    MUTEX_LOCK(httpd->run_mutex);
+    if (httpd->running || !httpd->joined) {
+        MUTEX_UNLOCK(httpd->run_mutex);
+        return -1;
+    }
+    connections = calloc(max_connections, sizeof(http_connection_t));
+    if (!connections) {
+        MUTEX_UNLOCK(httpd->run_mutex);
+        return -1;
+    }
+    free(httpd->connections);
+    httpd->connections = connections;
+    httpd->max_connections = max_connections;
+    MUTEX_UNLOCK(httpd->run_mutex);
+    return 0;
+}
+
 void
 httpd_destroy(httpd_t *httpd)
 {
     if (httpd) {
         httpd_stop(httpd);
 
+#ifdef HTTPD_USE_EPOLL
+        close(httpd->wake_fd);
+#endif
+        COND_DESTROY(httpd->work_cond);
+        MUTEX_DESTROY(httpd->work_mutex);
+        MUTEX_DESTROY(httpd->conn_mutex);
+        MUTEX_DESTROY(httpd->run_mutex);
+        free(httpd->workers);
         free(httpd->connections);
         free(httpd);
     }
 }
 
+static void
+httpd_free_output(http_connection_t *connection)
+{
+    while (connection->output_head) {
+        http_output_t *output = connection->output_head;
+        connection->output_head = output->next;
+        http_response_destroy(output->response);
+        free(output);
+    }
+    connection->output_tail = NULL;
+    connection->output_len = 0;
+}
+
+/* wake the httpd thread */
+static void
+httpd_wake(httpd_t *httpd)
+{
+#ifdef HTTPD_USE_EPOLL
+    eventfd_write(httpd->wake_fd, 1);
+#else
+    (void) httpd;
+#endif
+}
+
+/* give work for a connection to the worker threads */
+static void
+httpd_post_job(httpd_t *httpd, int index, void *user_data, http_request_t *request)
+{
+    httpd_job_t *job = (httpd_job_t *) calloc(1, sizeof(httpd_job_t));
+    assert(job);
+    job->index = index;
+    job->user_data = user_data;
+    job->request = request;
+
+    MUTEX_LOCK(httpd->work_mutex);
+    if (httpd->jobs_tail) {
+        httpd->jobs_tail->next = job;
+    } else {
+        httpd->jobs_head = job;
+    }
+    httpd->jobs_tail = job;
+    COND_SIGNAL(httpd->work_cond);
+    MUTEX_UNLOCK(httpd->work_mutex);
+}
+
+static THREAD_RETVAL
+httpd_worker_thread(void *arg)
+{
+    httpd_t *httpd = arg;
+    assert(httpd);
+
+    MUTEX_LOCK(httpd->work_mutex);
+    while (1) {
+        httpd_job_t *job;
+        /* when stopping, finish the jobs that were already posted */
+        while (!httpd->jobs_head && !httpd->workers_stop) {
+            COND_WAIT(httpd->work_cond, httpd->work_mutex);
+        }
+        job = httpd->jobs_head;
+        if (!job) {
+            break;
+        }
+        httpd->jobs_head = job->next;
+        if (!httpd->jobs_head) {
+            httpd->jobs_tail = NULL;
+        }
+        job->next = NULL;
+        MUTEX_UNLOCK(httpd->work_mutex);
+
+        if (job->request) {
+            httpd->callbacks.conn_request(job->user_data, job->request, &job->response);
+        } else {
+            httpd->callbacks.conn_destroy(job->user_data);
+        }
+
+        /* post the completed job back to the httpd thread */
+        MUTEX_LOCK(httpd->work_mutex);
+        if (httpd->done_tail) {
+            httpd->done_tail->next = job;
+        } else {
+            httpd->done_head = job;
+        }
+        httpd->done_tail = job;
+        httpd_wake(httpd);
+    }
+    MUTEX_UNLOCK(httpd->work_mutex);
+    return 0;
+}
+
+/* free the slot of a closing connection, once its user_data has been destroyed (conn_mutex must be locked) */
+static void
+httpd_free_connection(httpd_t *httpd, http_connection_t *connection)
+{
+    connection->busy = false;
+    connection->user_data = NULL;
+    connection->type = CONNECTION_TYPE_UNKNOWN;
+    connection->closing = false;
+    connection->connected = 0;
+    httpd->open_connections--;
+}
+
+/* a connection is closing and not busy: its slot stays reserved until its user_data is destroyed, *
+ * on a worker, or by httpd_destroy_pending, as this may be called from inside a callback          *
+ * (conn_mutex must be locked)                                                                     */
+static void
+httpd_release_connection(httpd_t *httpd, http_connection_t *connection)
+{
+    assert(connection->closing && !connection->busy);
+
+    if (!connection->user_data) {
+        httpd_free_connection(httpd, connection);
+        return;
+    }
+    connection->busy = true;
+    if (httpd->workers_running) {
+        /* queued ahead of any later request (the slot is freed when the job is completed) */
+        httpd_post_job(httpd, (int) (connection - httpd->connections), connection->user_data, NULL);
+        return;
+    }
+    connection->destroy_pending = true;
+    httpd->destroy_pending = true;
+    httpd_wake(httpd);
+}
+
+/* call conn_destroy for the connections released without workers (on the httpd thread, *
+ * with conn_mutex locked; it is unlocked during conn_destroy)                           */
+static void
+httpd_destroy_pending(httpd_t *httpd)
+{
+    if (!httpd->destroy_pending) {
+        return;
+    }
+    httpd->destroy_pending = false;
+    for (int i = 0; i < httpd->max_connections; i++) {
+        http_connection_t *connection = &httpd->connections[i];
+        if (!connection->destroy_pending) {
+            continue;
+        }
+        connection->destroy_pending = false;
+        void *user_data = connection->user_data;
+        MUTEX_UNLOCK(httpd->conn_mutex);
+        httpd->callbacks.conn_destroy(user_data);
+        MUTEX_LOCK(httpd->conn_mutex);
+        httpd_free_connection(httpd, connection);
+    }
+}
+
+/* close a connection: its user_data is destroyed when no handler is using it (conn_mutex must be locked) */
 static void
 httpd_remove_connection(httpd_t *httpd, http_connection_t *connection)
 {
-    if (connection->request) {
+    if (!connection->connected || connection->closing) {
+        return;
+    }
+    connection->closing = true;
+    /* a busy connection's request is in use by its handler */
+    if (connection->request && !connection->busy) {
         http_request_destroy(connection->request);
         connection->request = NULL;
     }
+    connection->in_request = false;
+    httpd_free_output(connection);
+    connection->disconnect = false;
     logger_log(httpd->logger, LOGGER_DEBUG, "removing connection type %s socket %d conn %p", typename[connection->type],
                connection->socket_fd, connection->user_data);
-    if (connection->user_data) {
-        httpd->callbacks.conn_destroy(connection->user_data);
-        connection->user_data = NULL;
-    }
     if (connection->socket_fd) {
+#ifdef HTTPD_USE_EPOLL
+        if (httpd->epoll_fd != -1) {
+            epoll_ctl(httpd->epoll_fd, EPOLL_CTL_DEL, connection->socket_fd, NULL);
+        }
+#endif
         shutdown(connection->socket_fd, SHUT_WR);
         int ret = closesocket(connection->socket_fd);
         if (ret == -1) {
@@ -219,13 +612,43 @@ httpd_remove_connection(httpd_t *httpd, http_connection_t *connection)
         }
         connection->socket_fd = 0;
     }
-    if (connection->connected) {
-        connection->connected = 0;
-        httpd->open_connections--;
+    if (!connection->busy) {
+        httpd_release_connection(httpd, connection);
     }
-    connection->type = CONNECTION_TYPE_UNKNOWN;
 }
 
+static int
+httpd_set_nonblocking(int fd)
+{
+#ifdef WIN32
+    u_long mode = 1;
+    return (ioctlsocket(fd, FIONBIO, &mode) ? -1 : 0);
+#else
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+#endif
+}
+
+#ifdef HTTPD_USE_EPOLL
+static int
+httpd_epoll_add(httpd_t *httpd, int fd, uint32_t events, uint64_t data)
+{
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = events;
+    event.data.u64 = data;
+    if (epoll_ctl(httpd->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        int sock_err = SOCKET_GET_ERROR();
+        logger_log(httpd->logger, LOGGER_ERR, "httpd error in epoll_ctl %d %s", sock_err, SOCKET_ERROR_STRING(sock_err));
+        return -1;
+    }
+    return 0;
+}
+#endif
+
 static int
 httpd_add_connection(httpd_t *httpd, int fd, unsigned char *local, int local_len, unsigned char *remote,
                      int remote_len, unsigned int zone_id)
@@ -239,24 +662,49 @@ httpd_add_connection(httpd_t *httpd, int fd, unsigned char *local, int local_len
         }
     }
     if (i == httpd->max_connections) {
-        /* This code should never be reached, we do not select server_fds when full */
+        /* This code should never be reached, we do not accept connections when full */
         logger_log(httpd->logger, LOGGER_INFO, "Max connections reached");
         return -1;
     }
+    if (httpd_set_nonblocking(fd) == -1) {
+        int sock_err = SOCKET_GET_ERROR();
+        logger_log(httpd->logger, LOGGER_ERR, "httpd could not make socket %d non-blocking %d %s",
+                   fd, sock_err, SOCKET_ERROR_STRING(sock_err));
+        return -1;
+    }
+#ifdef HTTPD_USE_EPOLL
+    /* edge-triggered: readable and writable events are only reported when the socket state changes */
+    if (httpd_epoll_add(httpd, fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, (uint64_t) i)) {
+        return -1;
+    }
+#endif
+
+    /* reserve the slot (hidden from the public functions) while conn_init is called, without conn_mutex */
+    http_connection_t *connection = &httpd->connections[i];
+    httpd->open_connections++;
+    connection->socket_fd = fd;
+    connection->connected = 1;
+    connection->closing = true;
+    connection->user_data = NULL;
+    connection->type = CONNECTION_TYPE_UNKNOWN;   //should not be necessary ...
+    MUTEX_UNLOCK(httpd->conn_mutex);
     user_data = httpd->callbacks.conn_init(httpd->callbacks.opaque, local, local_len, remote, remote_len, zone_id);
+    MUTEX_LOCK(httpd->conn_mutex);
+    connection->closing = false;
     if (!user_data) {
         logger_log(httpd->logger, LOGGER_ERR, "Error initializing HTTP request handler");
+#ifdef HTTPD_USE_EPOLL
+        epoll_ctl(httpd->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+#endif
+        connection->connected = 0;
+        httpd->open_connections--;
         return -1;
     }
-
-    httpd->open_connections++;
-    httpd->connections[i].socket_fd = fd;
-    httpd->connections[i].connected = 1;
-    httpd->connections[i].user_data = user_data;
-    httpd->connections[i].type = CONNECTION_TYPE_UNKNOWN;   //should not be necessary ...
+    connection->user_data = user_data;
     return 0;
 }
 
+/* returns 1 if a connection attempt was handled, 0 if there are none waiting, -1 on error */
 static int
 httpd_accept_connection(httpd_t *httpd, int server_fd, int is_ipv6)
 {
@@ -272,7 +720,14 @@ httpd_accept_connection(httpd_t *httpd, int server_fd, int is_ipv6)
     remote_saddrlen = sizeof(remote_saddr);
     fd = accept(server_fd, (struct sockaddr *)&remote_saddr, &remote_saddrlen);
     if (fd == -1) {
-        /* FIXME: Error happened */
+        int sock_err = SOCKET_GET_ERROR();
+        if (HTTPD_WOULD_BLOCK(sock_err)) {
+            return 0;
+        } else if (sock_err == SOCKET_ERRORNAME(EINTR) || sock_err == SOCKET_ERRORNAME(ECONNABORTED)) {
+            return 1;
+        }
+        logger_log(httpd->logger, LOGGER_ERR, "httpd error in accept %s: %d %s", (is_ipv6 ? "ipv6" : "ipv4"),
+                   sock_err, SOCKET_ERROR_STRING(sock_err));
         return -1;
     }
 
@@ -281,7 +736,7 @@ httpd_accept_connection(httpd_t *httpd, int server_fd, int is_ipv6)
     if (ret == -1) {
         shutdown(fd, SHUT_RDWR);
         closesocket(fd);
-        return 0;
+        return 1;
     }
 
     logger_log(httpd->logger, LOGGER_INFO, "Accepted %s client on socket %d",
@@ -294,11 +749,34 @@ httpd_accept_connection(httpd_t *httpd, int server_fd, int is_ipv6)
     if (ret == -1) {
         shutdown(fd, SHUT_RDWR);
         closesocket(fd);
-        return 0;
     }
     return 1;
 }
 
+/* accept waiting connection attempts while there are free connection slots */
+static void
+httpd_accept_connections(httpd_t *httpd)
+{
+    int server_fds[2] = { httpd->server_fd4, httpd->server_fd6 };
+
+    httpd->accept_pending = false;
+    for (int j = 0; j < 2; j++) {
+        if (server_fds[j] == -1) {
+            continue;
+        }
+        while (1) {
+            if (httpd->open_connections >= httpd->max_connections) {
+                /* try again when a connection is removed */
+                httpd->accept_pending = true;
+                return;
+            }
+            if (httpd_accept_connection(httpd, server_fds[j], j) <= 0) {
+                break;
+            }
+        }
+    }
+}
+
 bool
 httpd_nohold(httpd_t *httpd) {
     return (httpd->nohold ? true: false);
@@ -306,43 +784,471 @@ httpd_nohold(httpd_t *httpd) {
 
 void
 httpd_remove_known_connections(httpd_t *httpd) {
+    MUTEX_LOCK(httpd->conn_mutex);
     for (int i = 0; i < httpd->max_connections; i++) {
         http_connection_t *connection = &httpd->connections[i];
-        if (!connection->connected || connection->type == CONNECTION_TYPE_UNKNOWN) {
+        if (!connection->connected || connection->closing || connection->type == CONNECTION_TYPE_UNKNOWN) {
             continue;
         }
         httpd_remove_connection(httpd, connection);
     }
+    MUTEX_UNLOCK(httpd->conn_mutex);
 }
 
 void
 httpd_remove_connections_by_type(httpd_t *httpd, connection_type_t type) {
+    MUTEX_LOCK(httpd->conn_mutex);
+    for (int i = 0; i < httpd->max_connections; i++) {
+        http_connection_t *connection = &httpd->connections[i];
+        if (!connection->connected || connection->closing || connection->type != type) {
+            continue;
+        }
+        httpd_remove_connection(httpd, connection);
+    }
+    MUTEX_UNLOCK(httpd->conn_mutex);
+}
+
+/* write as much queued output as the socket will take: returns -1 if the connection failed */
+static int
+httpd_send_output(httpd_t *httpd, http_connection_t *connection)
+{
+    while (connection->output_head) {
+        http_output_t *output;
+        int count = 0;
+        int sent;
+#ifdef WIN32
+        WSABUF buffers[HTTPD_MAX_IOVECS];
+        DWORD bytes;
+        for (output = connection->output_head; output && count < HTTPD_MAX_IOVECS; output = output->next) {
+            buffers[count].buf = (char *) (output->data + output->sent);
+            buffers[count].len = (ULONG) (output->datalen - output->sent);
+            count++;
+        }
+        sent = (WSASend(connection->socket_fd, buffers, count, &bytes, 0, NULL, NULL) ? -1 : (int) bytes);
+#else
+        struct iovec iov[HTTPD_MAX_IOVECS];
+        struct msghdr msg;
+        for (output = connection->output_head; output && count < HTTPD_MAX_IOVECS; output = output->next) {
+            iov[count].iov_base = (void *) (output->data + output->sent);
+            iov[count].iov_len = (size_t) (output->datalen - output->sent);
+            count++;
+        }
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        sent = (int) sendmsg(connection->socket_fd, &msg, HTTPD_SEND_FLAGS);
+#endif
+        if (sent == -1) {
+            int sock_err = SOCKET_GET_ERROR();
+            if (HTTPD_WOULD_BLOCK(sock_err)) {
+                /* socket buffer is full: continue when it becomes writable */
+                return 0;
+            } else if (sock_err == SOCKET_ERRORNAME(EINTR)) {
+                continue;
+            }
+            logger_log(httpd->logger, LOGGER_ERR, "httpd error in sending data on socket %d: %d %s",
+                       connection->socket_fd, sock_err, SOCKET_ERROR_STRING(sock_err));
+            return -1;
+        }
+        connection->output_len -= sent;
+        while (sent > 0) {
+            output = connection->output_head;
+            int remaining = output->datalen - output->sent;
+            if (sent < remaining) {
+                output->sent += sent;
+                break;
+            }
+            sent -= remaining;
+            connection->output_head = output->next;
+            if (!connection->output_head) {
+                connection->output_tail = NULL;
+            }
+            http_response_destroy(output->response);
+            free(output);
+        }
+    }
+    return 0;
+}
+
+/* add a response to the connection's output queue (which takes ownership of it), and send what can be sent */
+static int
+httpd_queue_output(httpd_t *httpd, http_connection_t *connection, http_response_t *response)
+{
+    http_output_t *output;
+    int datalen;
+    const char *data = http_response_get_data(response, &datalen);
+
+    if (datalen <= 0) {
+        http_response_destroy(response);
+        return 0;
+    }
+    if (connection->output_len + datalen > HTTPD_MAX_OUTPUT) {
+        logger_log(httpd->logger, LOGGER_ERR, "httpd: client on socket %d is not reading its responses",
+                   connection->socket_fd);
+        http_response_destroy(response);
+        return -1;
+    }
+    output = (http_output_t *) calloc(1, sizeof(http_output_t));
+    if (!output) {
+        http_response_destroy(response);
+        return -1;
+    }
+    output->response = response;
+    output->data = data;
+    output->datalen = datalen;
+    if (connection->output_tail) {
+        connection->output_tail->next = output;
+    } else {
+        connection->output_head = output;
+    }
+    connection->output_tail = output;
+    connection->output_len += datalen;
+    return httpd_send_output(httpd, connection);
+}
+
+/* send a reverse-http request (created with http_response_reverse_request_init) on a connection *
+ * of the given type; httpd takes ownership of the request                                       */
+int
+httpd_send_by_type(httpd_t *httpd, connection_type_t type, int instance, http_response_t *request)
+{
+    int count = 0;
+    int ret = -1;
+    MUTEX_LOCK(httpd->conn_mutex);
+    for (int i = 0; i < httpd->max_connections; i++) {
+        http_connection_t *connection = &httpd->connections[i];
+        if (!connection->connected || connection->closing || connection->type != type) {
+            continue;
+        }
+        if (++count == instance) {
+            ret = httpd_queue_output(httpd, connection, request);
+            if (ret == -1) {
+                httpd_remove_connection(httpd, connection);
+            }
+            request = NULL;
+            break;
+        }
+    }
+    MUTEX_UNLOCK(httpd->conn_mutex);
+    http_response_destroy(request);
+    return ret;
+}
+
+static void
+httpd_log_connections(httpd_t *httpd, http_connection_t *active)
+{
+    logger_log(httpd->logger, LOGGER_DEBUG,"\nhttpd: current connections:");
     for (int i = 0; i < httpd->max_connections; i++) {
         http_connection_t *connection = &httpd->connections[i];
-        if (!connection->connected || connection->type != type) {
+        if(!connection->connected) {
             continue;
         }
+        logger_log(httpd->logger, LOGGER_DEBUG, "connection %d type %d socket %d  conn %p %s%s", i,
+                   connection->type, connection->socket_fd, connection->user_data, typename [connection->type],
+                   (connection == active ? " ACTIVE CONNECTION" : ""));
+    }
+    logger_log(httpd->logger, LOGGER_DEBUG, " ");
+}
+
+/* a request handler has finished: send its response (conn_mutex must be locked) */
+static void
+httpd_finish_request(httpd_t *httpd, int i, http_response_t *response)
+{
+    http_connection_t *connection = &httpd->connections[i];
+
+    connection->busy = false;
+    connection->in_request = false;
+    if (connection->closing) {
+        /* the connection was removed while the request was handled */
+        http_request_destroy(connection->request);
+        connection->request = NULL;
+        http_response_destroy(response);
+        httpd_release_connection(httpd, connection);
+        return;
+    }
+
+    if (response) {
+        connection->disconnect = http_response_get_disconnect(response);
+        if (httpd_queue_output(httpd, connection, response) == -1) {
+            httpd_remove_connection(httpd, connection);
+            return;
+        }
+        if (connection->disconnect && !connection->output_head) {
+            logger_log(httpd->logger, LOGGER_INFO, "Disconnecting on software request");
+            httpd_remove_connection(httpd, connection);
+        }
+    } else {
+        logger_log(httpd->logger, LOGGER_WARNING, "httpd didn't get response");
+    }
+}
+
+/* pass received data to the connection's request, and handle the request when it is complete */
+static void
+httpd_process_data(httpd_t *httpd, int i, char *buffer, int len)
+{
+    http_connection_t *connection = &httpd->connections[i];
+    bool logger_debug = (logger_get_level(httpd->logger) >= LOGGER_DEBUG);
+    int prefix_len = 0;
+
+    /* If not in the middle of request, start one */
+    if (!connection->in_request) {
+        if (!connection->request) {
+            connection->request = http_request_init();
+            assert(connection->request);
+        } else {
+            http_request_reset(connection->request);
+        }
+        connection->in_request = true;
+        connection->prefix_len = 0;
+        if (connection->type == CONNECTION_TYPE_PTTH) {
+            http_request_is_reverse(connection->request);
+        }
+        logger_log(httpd->logger, LOGGER_DEBUG, "new request, connection %d, socket %d type %s",
+                   i, connection->socket_fd, typename [connection->type]);
+        if (logger_debug) {
+            httpd_log_connections(httpd, connection);
+        }
+    }
+
+    /* reverse-http responses from the client must not be sent to the llhttp parser:
+     * such messages start with "HTTP/1.1" */
+    if (connection->prefix_len < HTTP_PREFIX_LEN) {
+        int n = HTTP_PREFIX_LEN - connection->prefix_len;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(connection->prefix + connection->prefix_len, buffer, n);
+        connection->prefix_len += n;
+        buffer += n;
+        len -= n;
+        if (connection->prefix_len < HTTP_PREFIX_LEN) {
+            return;
+        }
+        prefix_len = HTTP_PREFIX_LEN;
+        if (!memcmp(connection->prefix, "HTTP/1.1", HTTP_PREFIX_LEN)) {
+            http_request_set_reverse(connection->request);
+        }
+        if (!http_request_is_reverse(connection->request)) {
+            http_request_add_data(connection->request, connection->prefix, HTTP_PREFIX_LEN);
+        }
+    }
+
+    if (http_request_is_reverse(connection->request)) {
+        /* this is a response from the client to a
+         * GET /event reverse HTTP request from the server */
+        if (logger_debug) {
+            buffer[len] = '\0';
+            logger_log(httpd->logger, LOGGER_INFO, "<<<< received response from client"
+                       " (reversed HTTP = \"PTTH/1.0\") connection"
+                       " on socket %d:\n%.*s%s\n", connection->socket_fd, prefix_len, connection->prefix, buffer);
+        }
+        return;
+    }
+
+    /* Parse HTTP request from data read from connection */
+    if (len > 0) {
+        http_request_add_data(connection->request, buffer, len);
+    }
+    if (http_request_has_error(connection->request)) {
+        logger_log(httpd->logger, LOGGER_ERR, "httpd error in parsing: %s",
+                   http_request_get_error_name(connection->request));
+        httpd_remove_connection(httpd, connection);
+        return;
+    }
+
+    /* If request is finished, process it */
+    if (http_request_is_complete(connection->request)) {
+        http_response_t *response = NULL;
+        // Callback the received data to raop
+        if (logger_debug) {
+            const char *method = http_request_get_method(connection->request);
+            const char *url = http_request_get_url(connection->request);
+            const char *protocol = http_request_get_protocol(connection->request);
+            logger_log(httpd->logger, LOGGER_INFO, "httpd request received on socket %d, "
+                       "connection %d, method = %s, url = %s, protocol = %s",
+                       connection->socket_fd, i, method, url, protocol);
+        }
+        connection->busy = true;
+        if (httpd->workers_running) {
+            /* the response is sent when the worker has finished */
+            httpd_post_job(httpd, i, connection->user_data, connection->request);
+            return;
+        }
+        MUTEX_UNLOCK(httpd->conn_mutex);
+        httpd->callbacks.conn_request(connection->user_data, connection->request, &response);
+        MUTEX_LOCK(httpd->conn_mutex);
+        httpd_finish_request(httpd, i, response);
+    } else {
+        logger_log(httpd->logger, LOGGER_DEBUG, "Request not complete, waiting for more data...");
+    }
+}
+
+/* read everything waiting on the connection's socket */
+static void
+httpd_receive(httpd_t *httpd, int i)
+{
+    http_connection_t *connection = &httpd->connections[i];
+    char buffer[1024];
+
+    logger_log(httpd->logger, LOGGER_DEBUG, "httpd receiving on socket %d, connection %d",
+               connection->socket_fd, i);
+    /* a busy connection is read again when its handler has finished */
+    while (connection->connected && !connection->closing && !connection->busy) {
+        int ret = recv(connection->socket_fd, buffer, sizeof(buffer) - 1, 0);
+        if (ret == 0) {
+            logger_log(httpd->logger, LOGGER_INFO, "Connection closed for socket %d",
+                       connection->socket_fd);
+            httpd_remove_connection(httpd, connection);
+            return;
+        } else if (ret == -1) {
+            int sock_err = SOCKET_GET_ERROR();
+            if (HTTPD_WOULD_BLOCK(sock_err)) {
+                return;
+            } else if (sock_err == SOCKET_ERRORNAME(EINTR)) {
+                continue;
+            }
+            logger_log(httpd->logger, LOGGER_ERR, "httpd: recv socket error %d:%s",
+                       sock_err, SOCKET_ERROR_STRING(sock_err));
+            httpd_remove_connection(httpd, connection);
+            return;
+        }
+        httpd_process_data(httpd, i, buffer, ret);
+    }
+}
+
+/* the connection's socket became writable */
+static void
+httpd_transmit(httpd_t *httpd, int i)
+{
+    http_connection_t *connection = &httpd->connections[i];
+    if (connection->closing || !connection->output_head) {
+        return;
+    }
+    if (httpd_send_output(httpd, connection) == -1) {
+        httpd_remove_connection(httpd, connection);
+    } else if (connection->disconnect && !connection->output_head) {
+        logger_log(httpd->logger, LOGGER_INFO, "Disconnecting on software request");
         httpd_remove_connection(httpd, connection);
     }
 }
 
+/* handle the jobs finished by the workers (conn_mutex must be locked) */
+static void
+httpd_complete_jobs(httpd_t *httpd, bool resume)
+{
+    httpd_job_t *job;
+
+    MUTEX_LOCK(httpd->work_mutex);
+    job = httpd->done_head;
+    httpd->done_head = NULL;
+    httpd->done_tail = NULL;
+    MUTEX_UNLOCK(httpd->work_mutex);
+
+    while (job) {
+        httpd_job_t *next = job->next;
+        if (!job->request) {
+            /* the connection's user_data has been destroyed */
+            httpd_free_connection(httpd, &httpd->connections[job->index]);
+        } else {
+            httpd_finish_request(httpd, job->index, job->response);
+            if (resume) {
+                /* read any data that arrived while the request was handled */
+                httpd_receive(httpd, job->index);
+            }
+        }
+        free(job);
+        job = next;
+    }
+}
+
 static THREAD_RETVAL
 httpd_thread(void *arg)
 {
     httpd_t *httpd = arg;
-    char http[] = "HTTP/1.1";
-    char buffer[1024];
     int i;
 
-    bool logger_debug = (logger_get_level(httpd->logger) >= LOGGER_DEBUG);
     assert(httpd);
 
+    httpd->accept_pending = false;
+#ifdef HTTPD_USE_EPOLL
+    httpd->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (httpd->epoll_fd == -1) {
+        int sock_err = SOCKET_GET_ERROR();
+        logger_log(httpd->logger, LOGGER_ERR, "httpd error in epoll_create1 %d %s", sock_err, SOCKET_ERROR_STRING(sock_err));
+    } else if (httpd_epoll_add(httpd, httpd->wake_fd, EPOLLIN, HTTPD_EVENT_WAKE) ||
+               (httpd->server_fd4 != -1 &&
+                httpd_epoll_add(httpd, httpd->server_fd4, EPOLLIN | EPOLLET, HTTPD_EVENT_SERVER4)) ||
+               (httpd->server_fd6 != -1 &&
+                httpd_epoll_add(httpd, httpd->server_fd6, EPOLLIN | EPOLLET, HTTPD_EVENT_SERVER6))) {
+        close(httpd->epoll_fd);
+        httpd->epoll_fd = -1;
+    }
+    if (httpd->epoll_fd != -1 && httpd->num_workers) {
+        httpd->workers_stop = false;
+        httpd->workers_running = true;
+        for (i = 0; i < httpd->num_workers; i++) {
+            THREAD_CREATE(httpd->workers[i], httpd_worker_thread, httpd);
+        }
+        logger_log(httpd->logger, LOGGER_DEBUG, "httpd: requests are handled by %d worker threads", httpd->num_workers);
+    }
+#endif
+
     while (1) {
-        fd_set rfds;
+        int ret;
+#ifdef HTTPD_USE_EPOLL
+        /* wait (with no timeout) for socket activity, finished jobs, or a stop request */
+        struct epoll_event events[HTTPD_MAX_EVENTS];
+        bool stop = (httpd->epoll_fd == -1);
+        bool wake = false;
+        ret = (stop ? 0 : epoll_wait(httpd->epoll_fd, events, HTTPD_MAX_EVENTS, -1));
+        if (ret == -1) {
+            int sock_err = SOCKET_GET_ERROR();
+            if (sock_err == EINTR) {
+                continue;
+            }
+            logger_log(httpd->logger, LOGGER_ERR, "httpd error in epoll_wait: %d %s", sock_err, SOCKET_ERROR_STRING(sock_err));
+            break;
+        }
+        MUTEX_LOCK(httpd->conn_mutex);
+        for (i = 0; i < ret; i++) {
+            uint64_t data = events[i].data.u64;
+            if (data == HTTPD_EVENT_WAKE) {
+                wake = true;
+            } else if (data == HTTPD_EVENT_SERVER4 || data == HTTPD_EVENT_SERVER6) {
+                httpd->accept_pending = true;
+            } else if (data < (uint64_t) httpd->max_connections && httpd->connections[data].connected) {
+                /* errors and hangups are discovered by recv() */
+                if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP)) {
+                    httpd_receive(httpd, (int) data);
+                }
+                if ((events[i].events & EPOLLOUT) && httpd->connections[data].connected) {
+                    httpd_transmit(httpd, (int) data);
+                }
+            }
+        }
+        if (wake) {
+            eventfd_t value;
+            eventfd_read(httpd->wake_fd, &value);
+            MUTEX_LOCK(httpd->run_mutex);
+            stop = !httpd->running;
+            MUTEX_UNLOCK(httpd->run_mutex);
+            if (!stop) {
+                httpd_complete_jobs(httpd, true);
+            }
+        }
+        if (!stop) {
+            httpd_destroy_pending(httpd);
+        }
+        if (!stop && httpd->accept_pending && httpd->open_connections < httpd->max_connections) {
+            httpd_accept_connections(httpd);
+        }
+        MUTEX_UNLOCK(httpd->conn_mutex);
+        if (stop) {
+            break;
+        }
+#else
+        fd_set rfds, wfds;
         struct timeval tv;
         int nfds=0;
-        int ret;
-	int new_request;
 
         MUTEX_LOCK(httpd->run_mutex);
         if (!httpd->running) {
@@ -351,12 +1257,17 @@ httpd_thread(void *arg)
         }
         MUTEX_UNLOCK(httpd->run_mutex);
 
-        /* Set timeout value to 5ms */
+        MUTEX_LOCK(httpd->conn_mutex);
+        httpd_destroy_pending(httpd);
+        MUTEX_UNLOCK(httpd->conn_mutex);
+
+        /* Set timeout value to 1s */
         tv.tv_sec = 1;
         tv.tv_usec = 5000;
 
-        /* Get the correct nfds value and set rfds */
+        /* Get the correct nfds value and set rfds, wfds */
         FD_ZERO(&rfds);
+        FD_ZERO(&wfds);
         if (httpd->open_connections < httpd->max_connections) {
             if (httpd->server_fd4 != -1) {
                 FD_SET(httpd->server_fd4, &rfds);
@@ -378,204 +1289,95 @@ httpd_thread(void *arg)
             }
             socket_fd = httpd->connections[i].socket_fd;
             FD_SET(socket_fd, &rfds);
+            if (httpd->connections[i].output_head) {
+                FD_SET(socket_fd, &wfds);
+            }
             if (nfds <= socket_fd) {
                 nfds = socket_fd+1;
             }
         }
 
-        ret = select(nfds, &rfds, NULL, NULL, &tv);
+        ret = select(nfds, &rfds, &wfds, NULL, &tv);
         if (ret == 0) {
             /* Timeout happened */
             continue;
         } else if (ret == -1) {
-            logger_log(httpd->logger, LOGGER_ERR, "httpd error in select: %d %s", errno, strerror(errno));
-            break;
-        }
-
-        if (httpd->open_connections < httpd->max_connections &&
-            httpd->server_fd4 != -1 && FD_ISSET(httpd->server_fd4, &rfds)) {
-            ret = httpd_accept_connection(httpd, httpd->server_fd4, 0);
-            if (ret == -1) {
-                logger_log(httpd->logger, LOGGER_ERR, "httpd error in accept ipv4");
-                break;
-            } else if (ret == 0) {
-                continue;
-            }
-        }
-        if (httpd->open_connections < httpd->max_connections &&
-            httpd->server_fd6 != -1 && FD_ISSET(httpd->server_fd6, &rfds)) {
-            ret = httpd_accept_connection(httpd, httpd->server_fd6, 1);
-            if (ret == -1) {
-                logger_log(httpd->logger, LOGGER_ERR, "httpd error in accept ipv6");
-                break;
-            } else if (ret == 0) {
+            int sock_err = SOCKET_GET_ERROR();
+            if (sock_err == SOCKET_ERRORNAME(EINTR)) {
                 continue;
             }
+            logger_log(httpd->logger, LOGGER_ERR, "httpd error in select: %d %s", sock_err, SOCKET_ERROR_STRING(sock_err));
+            break;
         }
+
+        /* only the connections that were selected are handled: slots may be reused by new connections */
+        MUTEX_LOCK(httpd->conn_mutex);
         for (i=0; i<httpd->max_connections; i++) {
             http_connection_t *connection = &httpd->connections[i];
-
+            int socket_fd = connection->socket_fd;
             if (!connection->connected) {
                 continue;
             }
-            if (!FD_ISSET(connection->socket_fd, &rfds)) {
-                continue;
-            }
-
-            /* If not in the middle of request, allocate one */
-            if (!connection->request) {
-                connection->request = http_request_init();
-                assert(connection->request);
-                new_request = 1;
-                if (connection->type == CONNECTION_TYPE_PTTH) {
-                    http_request_is_reverse(connection->request);
-                }
-		logger_log(httpd->logger, LOGGER_DEBUG, "new request, connection %d, socket %d type %s",
-                           i, connection->socket_fd, typename [connection->type]);
-            } else {
-                new_request = 0;
-	    }
-
-            logger_log(httpd->logger, LOGGER_DEBUG, "httpd receiving on socket %d, connection %d",
-                       connection->socket_fd, i);
-            if (logger_debug) {
-                logger_log(httpd->logger, LOGGER_DEBUG,"\nhttpd: current connections:");
-                for (int i = 0; i < httpd->max_connections; i++) {
-                    http_connection_t *connection = &httpd->connections[i];
-                    if(!connection->connected) {
-                        continue;
-                    }
-                    if (!FD_ISSET(connection->socket_fd, &rfds)) {
-                        logger_log(httpd->logger, LOGGER_DEBUG, "connection %d type %d socket %d  conn %p %s", i,
-                                   connection->type, connection->socket_fd,
-                                   connection->user_data, typename [connection->type]);
-		    } else {
-		      logger_log(httpd->logger, LOGGER_DEBUG, "connection %d type %d socket %d  conn %p %s ACTIVE CONNECTION",
-                                 i, connection->type, connection->socket_fd, connection->user_data, typename [connection->type]);
-                    }
-                }
-		logger_log(httpd->logger, LOGGER_DEBUG, " ");
-	    }
-            /* reverse-http responses from the client must not be sent to the llhttp parser:
-             * such messages start with "HTTP/1.1" */
-            if (new_request) {
-                int readstart = 0;
-                new_request = 0;
-                while (readstart < 8) {
-                    ret = recv(connection->socket_fd, buffer + readstart, sizeof(buffer) - 1 - readstart, 0);
-                    if (ret == 0) {
-                        logger_log(httpd->logger, LOGGER_INFO, "Connection closed for socket %d",
-                                   connection->socket_fd);
-                        break;
-                    } else if (ret == -1) {
-		      if (errno == EAGAIN) {
-			continue;
-		      } else {
-                        int sock_err = SOCKET_GET_ERROR();
-                        logger_log(httpd->logger, LOGGER_ERR, "httpd: recv socket error %d:%s",
-                                   sock_err, SOCKET_ERROR_STRING(sock_err));
-                        break;
-		      }
-                    } else {
-                        readstart += ret;
-                        ret = readstart;
-                    }
-                }
-                if (!memcmp(buffer, http, 8)) {
-                    http_request_set_reverse(connection->request);  
-                }
-            } else {
-                ret = recv(connection->socket_fd, buffer, sizeof(buffer) - 1, 0);
-                if (ret == 0) {
-                    logger_log(httpd->logger, LOGGER_INFO, "Connection closed for socket %d",
-                               connection->socket_fd);
-                    httpd_remove_connection(httpd, connection);
-                    continue;
-                }
-            }
-            if (http_request_is_reverse(connection->request)) {
-                /* this is a response from the client to a
-                 * GET /event reverse HTTP request from the server */
-                if (ret && logger_debug) {
-                    buffer[ret] = '\0';
-                    logger_log(httpd->logger, LOGGER_INFO, "<<<< received response from client"
-                               " (reversed HTTP = \"PTTH/1.0\") connection"
-                               " on socket %d:\n%s\n", connection->socket_fd, buffer);
-                }
-                if (ret == 0) {
-                    httpd_remove_connection(httpd, connection);
-                }
-                continue;
+            if (FD_ISSET(socket_fd, &rfds)) {
+                httpd_receive(httpd, i);
             }
-
-            /* Parse HTTP request from data read from connection */
-            http_request_add_data(connection->request, buffer, ret);
-            if (http_request_has_error(connection->request)) {
-                logger_log(httpd->logger, LOGGER_ERR, "httpd error in parsing: %s",
-                           http_request_get_error_name(connection->request));
-                httpd_remove_connection(httpd, connection);
-                continue;
+            if (connection->connected && socket_fd == connection->socket_fd && FD_ISSET(socket_fd, &wfds)) {
+                httpd_transmit(httpd, i);
             }
+        }
+        if ((httpd->server_fd4 != -1 && FD_ISSET(httpd->server_fd4, &rfds)) ||
+            (httpd->server_fd6 != -1 && FD_ISSET(httpd->server_fd6, &rfds))) {
+            httpd_accept_connections(httpd);
+        }
+        MUTEX_UNLOCK(httpd->conn_mutex);
+#endif
+    }
 
-            /* If request is finished, process and deallocate */
-            if (http_request_is_complete(connection->request)) {
-                http_response_t *response = NULL;
-                // Callback the received data to raop
-                if (logger_debug) {
-                    const char *method = http_request_get_method(connection->request);
-                    const char *url = http_request_get_url(connection->request);
-                    const char *protocol = http_request_get_protocol(connection->request);
-                    logger_log(httpd->logger, LOGGER_INFO, "httpd request received on socket %d, "
-                               "connection %d, method = %s, url = %s, protocol = %s",
-                               connection->socket_fd, i, method, url, protocol);
-                }
-                httpd->callbacks.conn_request(connection->user_data, connection->request, &response);
-                http_request_destroy(connection->request);
-                connection->request = NULL;
-
-                if (response) {
-                    const char *data;
-                    int datalen;
-                    int written;
-                    int ret;
-
-                    /* Get response data and datalen */
-                    data = http_response_get_data(response, &datalen);
-
-                    written = 0;
-                    while (written < datalen) {
-                        ret = send(connection->socket_fd, data+written, datalen-written, 0);
-                        if (ret == -1) {
-                            logger_log(httpd->logger, LOGGER_ERR, "httpd error in sending data");
-                            break;
-                        }
-                        written += ret;
-                    }
-
-                    if (http_response_get_disconnect(response)) {
-                        logger_log(httpd->logger, LOGGER_INFO, "Disconnecting on software request");
-                        httpd_remove_connection(httpd, connection);
-                    }
-                } else {
-                    logger_log(httpd->logger, LOGGER_WARNING, "httpd didn't get response");
-                }
-                http_response_destroy(response);
-            } else {
-                logger_log(httpd->logger, LOGGER_DEBUG, "Request not complete, waiting for more data...");
-            }
+    /* let the workers finish the jobs already posted */
+    if (httpd->workers_running) {
+        MUTEX_LOCK(httpd->work_mutex);
+        httpd->workers_stop = true;
+        COND_BROADCAST(httpd->work_cond);
+        MUTEX_UNLOCK(httpd->work_mutex);
+        for (i = 0; i < httpd->num_workers; i++) {
+            THREAD_JOIN(httpd->workers[i]);
         }
     }
 
     /* Remove all connections that are still connected */
+    MUTEX_LOCK(httpd->conn_mutex);
+    if (httpd->workers_running) {
+        httpd->workers_running = false;
+        /* connections released (by another thread) after the last worker had exited */
+        while (httpd->jobs_head) {
+            httpd_job_t *job = httpd->jobs_head;
+            httpd->jobs_head = job->next;
+            assert(!job->request);
+            httpd->connections[job->index].destroy_pending = true;
+            httpd->destroy_pending = true;
+            free(job);
+        }
+        httpd->jobs_tail = NULL;
+    }
+    httpd_complete_jobs(httpd, false);
     for (i=0; i<httpd->max_connections; i++) {
         http_connection_t *connection = &httpd->connections[i];
 
-        if (!connection->connected) {
+        if (!connection->connected || connection->closing) {
             continue;
         }
         logger_log(httpd->logger, LOGGER_INFO, "Removing connection for socket %d", connection->socket_fd);
         httpd_remove_connection(httpd, connection);
     }
+    httpd_destroy_pending(httpd);
+    MUTEX_UNLOCK(httpd->conn_mutex);
+
+#ifdef HTTPD_USE_EPOLL
+    if (httpd->epoll_fd != -1) {
+        close(httpd->epoll_fd);
+        httpd->epoll_fd = -1;
+    }
+#endif
 
     /* Close server sockets since they are not used any more */
     if (httpd->server_fd4 != -1) {
@@ -640,11 +1442,25 @@ httpd_start(httpd_t *httpd, unsigned short *port)
         MUTEX_UNLOCK(httpd->run_mutex);
         return -2;
     }
+    /* connection attempts are accepted until accept() would block */
+    if ((httpd->server_fd4 != -1 && httpd_set_nonblocking(httpd->server_fd4) == -1) ||
+        (httpd->server_fd6 != -1 && httpd_set_nonblocking(httpd->server_fd6) == -1)) {
+        logger_log(httpd->logger, LOGGER_ERR, "Error making server socket(s) non-blocking");
+        closesocket(httpd->server_fd4);
+        closesocket(httpd->server_fd6);
+        MUTEX_UNLOCK(httpd->run_mutex);
+        return -2;
+    }
     logger_log(httpd->logger, LOGGER_INFO, "Initialized server socket(s)");
 
     /* Set values correctly and create new thread */
     httpd->running = 1;
     httpd->joined = 0;
+#ifdef HTTPD_USE_EPOLL
+    /* clear any stop request left over from a previous run */
+    eventfd_t value;
+    eventfd_read(httpd->wake_fd, &value);
+#endif
     THREAD_CREATE(httpd->thread, httpd_thread, httpd);
     MUTEX_UNLOCK(httpd->run_mutex);
 
@@ -677,6 +1493,10 @@ httpd_stop(httpd_t *httpd)
     }
     httpd->running = 0;
     MUTEX_UNLOCK(httpd->run_mutex);
+#ifdef HTTPD_USE_EPOLL
+    /* wake the thread */
+    eventfd_write(httpd->wake_fd, 1);
+#endif
 
     THREAD_JOIN(httpd->thread);
 
@@ -47,7 +47,10 @@ int httpd_get_connection_socket (httpd_t *httpd, void *user_data);
 int httpd_get_connection_socket_by_type (httpd_t *httpd, connection_type_t type, int instance);
 const char *httpd_get_connection_typename (connection_type_t type);
 void *httpd_get_connection_by_type (httpd_t *httpd, connection_type_t type, int instance);
+int httpd_send_by_type (httpd_t *httpd, connection_type_t type, int instance, http_response_t *request);
 httpd_t *httpd_init(logger_t *logger, httpd_callbacks_t *callbacks, int  nohold);
+int httpd_set_max_connections(httpd_t *httpd, int max_connections);
+int httpd_set_workers(httpd_t *httpd, int num_workers);
 
 int httpd_is_running(httpd_t *httpd);
 
@@ -19,13 +19,18 @@
 #define MIRROR_BUFFER_H
 
 #include <stdint.h>
+#include <stdbool.h>
 #include "logger.h"
+#include "stream.h"
 
-typedef struct mirror_buffer_s mirror_buffer_t;
+#define MAX_DECRYPT_THREADS 8
 
+typedef struct mirror_buffer_s mirror_buffer_t;
 
 mirror_buffer_t *mirror_buffer_init( logger_t *logger, const unsigned char *aeskey);
-void mirror_buffer_init_aes(mirror_buffer_t *mirror_buffer, const uint64_t *streamConnectionID);
-void mirror_buffer_decrypt(mirror_buffer_t *raop_mirror, unsigned char* input, unsigned char* output, int datalen);
+void mirror_buffer_init_aes(mirror_buffer_t *mirror_buffer, const uint64_t *streamConnectionID,
+                            int decrypt_threads);
+bool mirror_buffer_decrypt_nal_units(mirror_buffer_t *mirror_buffer, unsigned char *data, int len, bool is_h265,
+                                     video_nal_unit_t *nal_units, int max_nal_units, int *nal_count);
 void mirror_buffer_destroy(mirror_buffer_t *mirror_buffer);
 #endif //MIRROR_BUFFER_H
@@ -31,7 +31,20 @@
 #include "logger.h"
 #include "compat.h"
 #include "raop_rtp_mirror.h"
+#include "mirror_buffer.h"
+#include "raop_buffer.h"
 #include "raop_ntp.h"
+#include "threads.h"
+
+/* handler latency histogram bins: < 100 usecs, < 200 usecs, ... < 25.6 ms, >= 25.6 ms */
+#define RAOP_ROUTE_LATENCY_BINS 10
+
+typedef struct raop_route_stats_s {
+    uint64_t requests;
+    uint64_t total_latency;    /* nsecs */
+    uint64_t max_latency;
+    uint64_t latency_hist[RAOP_ROUTE_LATENCY_BINS];
+} raop_route_stats_t;
 
 struct raop_s {
     /* Callbacks for audio and video */
@@ -40,6 +53,9 @@ struct raop_s {
     /* Logger instance */
     logger_t *logger;
 
+    /* client time to presentation time mapping, shared by the audio and video streams */
+    av_sync_t *av_sync;
+
     /* Pairing, HTTP daemon and RSA key */
     pairing_t *pairing;
     httpd_t *httpd;
@@ -65,6 +81,18 @@ struct raop_s {
 
     int audio_delay_micros;
 
+    /* number of threads used to decrypt large video frames (1 = no parallel decryption) */
+    int video_decrypt_threads;
+
+    /* number of audio packets held in the (power of 2 length) audio packet buffer */
+    int audio_buffer_depth;
+
+    /* adaptive audio playout delay: reduce by up to adaptive_delay_min, or increase by up to *
+     * adaptive_delay_max (microseconds)                                                     */
+    bool adaptive_delay;
+    int adaptive_delay_min;
+    int adaptive_delay_max;
+
      /* for temporary storage of pin during pair-pin start */
     unsigned short pin;
     bool use_pin;
@@ -82,6 +110,28 @@ struct raop_s {
     char *nonce;
     char *random_pw;
     unsigned char auth_fail_count;
+
+    /* serialized bodies of the GET /info and GET /server-info responses, built on first use and *
+     * discarded when a value they contain changes (see raop_invalidate_info)                      */
+    mutex_handle_t info_mutex;
+    char *info_data;
+    int info_datalen;
+    char *server_info_data;
+    int server_info_datalen;
+    /* the dnssd TXT record and features used in info_data (they change if dnssd is re-registered) */
+    char *info_airplay_txt;
+    int info_airplay_txt_len;
+    uint64_t info_features;
+
+    /* request counters and handler latency histograms, for each entry of raop_routes *
+     * (followed by HLS requests, and requests without a handler)                    */
+    mutex_handle_t route_stats_mutex;
+    raop_route_stats_t *route_stats;
+
+    /* held by the request handlers (and conn_destroy) that use the state shared by the connections:   *
+     * the fields above without a lock of their own, airplay_video, the other connections' raop_conn_t, *
+     * and the application callbacks.  Handlers of routes marked "parallel" run without it.            */
+    mutex_handle_t handler_mutex;
 };
 
 struct raop_conn_s {
@@ -112,6 +162,150 @@ typedef struct raop_conn_s raop_conn_t;
 #include "raop_handlers.h"
 #include "http_handlers.h"
 
+/* request routing: a route matches requests with its protocol and method, and either the same URL, *
+ * any URL starting with its path if that ends in '?', or any URL if its path is "*".  The table is  *
+ * searched with bsearch(), so it MUST be kept sorted (by strcmp) on protocol, method and path.       *
+ * A parallel handler only uses its own connection's state, and raop state that has its own lock or  *
+ * does not change while httpd is running, so it does not take raop->handler_mutex: the slow pairing *
+ * and FairPlay handshakes, and the keepalive requests, are not held up by other connections.        */
+typedef struct raop_route_s {
+    const char *protocol;
+    const char *method;
+    const char *path;
+    raop_handler_t handler;
+    bool parallel;
+} raop_route_t;
+
+static const raop_route_t raop_routes[] = {
+    { "HTTP/1.1", "GET",           "/playback-info",  &http_handler_playback_info,   false },
+    { "HTTP/1.1", "GET",           "/server-info",    &http_handler_server_info,     false },
+    { "HTTP/1.1", "POST",          "/action",         &http_handler_action,          false },
+    { "HTTP/1.1", "POST",          "/fp-setup2",      &http_handler_fpsetup2,        true  },
+    { "HTTP/1.1", "POST",          "/getProperty?",   &http_handler_get_property,    true  },
+    { "HTTP/1.1", "POST",          "/play",           &http_handler_play,            false },
+    { "HTTP/1.1", "POST",          "/rate?",          &http_handler_rate,            false },
+    { "HTTP/1.1", "POST",          "/reverse",        &http_handler_reverse,         false },
+    { "HTTP/1.1", "POST",          "/scrub?",         &http_handler_scrub,           false },
+    { "HTTP/1.1", "POST",          "/stop",           &http_handler_stop,            false },
+    { "HTTP/1.1", "PUT",           "/setProperty?",   &http_handler_set_property,    false },
+    { "RTSP/1.0", "FLUSH",         "*",               &raop_handler_flush,           false },
+    { "RTSP/1.0", "GET",           "/info",           &raop_handler_info,            true  },
+    { "RTSP/1.0", "GET_PARAMETER", "*",               &raop_handler_get_parameter,   true  },
+    { "RTSP/1.0", "OPTIONS",       "*",               &raop_handler_options,         true  },
+    { "RTSP/1.0", "POST",          "/audioMode",      NULL,                          false },    /* &http_handler_audioMode */
+    { "RTSP/1.0", "POST",          "/feedback",       &raop_handler_feedback,        true  },
+    { "RTSP/1.0", "POST",          "/fp-setup",       &raop_handler_fpsetup,         true  },
+    { "RTSP/1.0", "POST",          "/getProperty",    &http_handler_get_property,    true  },
+    { "RTSP/1.0", "POST",          "/pair-pin-start", &raop_handler_pairpinstart,    false },
+    { "RTSP/1.0", "POST",          "/pair-setup",     &raop_handler_pairsetup,       true  },
+    { "RTSP/1.0", "POST",          "/pair-setup-pin", &raop_handler_pairsetup_pin,   false },
+    { "RTSP/1.0", "POST",          "/pair-verify",    &raop_handler_pairverify,      true  },
+    { "RTSP/1.0", "RECORD",        "*",               &raop_handler_record,          false },
+    { "RTSP/1.0", "SETUP",         "*",               &raop_handler_setup,           false },
+    { "RTSP/1.0", "SET_PARAMETER", "*",               &raop_handler_set_parameter,   false },
+    { "RTSP/1.0", "TEARDOWN",      "*",               &raop_handler_teardown,        false },
+};
+#define RAOP_ROUTES (int) (sizeof(raop_routes) / sizeof(raop_routes[0]))
+/* route_stats slots after those of raop_routes */
+#define RAOP_ROUTE_HLS RAOP_ROUTES
+#define RAOP_ROUTE_NONE (RAOP_ROUTES + 1)
+
+/* a NULL path in the key matches any path (to find if the method is known) */
+static int
+raop_route_compare(const void *key, const void *member) {
+    const raop_route_t *a = key;
+    const raop_route_t *b = member;
+    int ret = strcmp(a->protocol, b->protocol);
+    if (!ret) {
+        ret = strcmp(a->method, b->method);
+    }
+    if (!ret && a->path) {
+        ret = strcmp(a->path, b->path);
+    }
+    return ret;
+}
+
+static const raop_route_t *
+raop_route_search(const char *protocol, const char *method, const char *path) {
+    raop_route_t key = { protocol, method, path, NULL, false };
+    return bsearch(&key, raop_routes, RAOP_ROUTES, sizeof(raop_route_t), &raop_route_compare);
+}
+
+/* returns the route for the request, or NULL; *known_method is set if any route has its method */
+static const raop_route_t *
+raop_route_find(const char *protocol, const char *method, const char *url, bool *known_method) {
+    const raop_route_t *route = raop_route_search(protocol, method, url);
+    if (!route) {
+        const char *query = strchr(url, '?');
+        char prefix[32];
+        if (query && query - url + 1 < (int) sizeof(prefix)) {
+            int len = (int) (query - url) + 1;
+            memcpy(prefix, url, len);
+            prefix[len] = '\0';
+            route = raop_route_search(protocol, method, prefix);
+        }
+    }
+    if (!route) {
+        route = raop_route_search(protocol, method, "*");
+    }
+    *known_method = (route || raop_route_search(protocol, method, NULL));
+    return route;
+}
+
+static void
+raop_route_record(raop_t *raop, int index, uint64_t latency) {
+    /* bin i counts latencies < (100 << i) usecs, the last bin the rest */
+    uint64_t usecs = latency / 1000;
+    int bin = 0;
+    while (bin < RAOP_ROUTE_LATENCY_BINS - 1 && usecs >= ((uint64_t) 100 << bin)) {
+        bin++;
+    }
+    MUTEX_LOCK(raop->route_stats_mutex);
+    raop_route_stats_t *stats = &raop->route_stats[index];
+    stats->requests++;
+    stats->total_latency += latency;
+    if (latency > stats->max_latency) {
+        stats->max_latency = latency;
+    }
+    stats->latency_hist[bin]++;
+    MUTEX_UNLOCK(raop->route_stats_mutex);
+}
+
+static void
+raop_log_route_stats(raop_t *raop, int level) {
+    if (logger_get_level(raop->logger) < level) {
+        return;
+    }
+    MUTEX_LOCK(raop->route_stats_mutex);
+    for (int i = 0; i <= RAOP_ROUTE_NONE; i++) {
+        raop_route_stats_t *stats = &raop->route_stats[i];
+        if (!stats->requests) {
+            continue;
+        }
+        char route[64];
+        if (i < RAOP_ROUTES) {
+            snprintf(route, sizeof(route), "%s %s %s", raop_routes[i].protocol, raop_routes[i].method, raop_routes[i].path);
+        } else {
+            snprintf(route, sizeof(route), "%s", (i == RAOP_ROUTE_HLS ? "HLS" : "(no handler)"));
+        }
+        char hist[RAOP_ROUTE_LATENCY_BINS * 32] = "";
+        int len = 0;
+        for (int j = 0; j < RAOP_ROUTE_LATENCY_BINS; j++) {
+            if (j < RAOP_ROUTE_LATENCY_BINS - 1) {
+                len += snprintf(hist + len, sizeof(hist) - len, " <%dus:%llu", 100 << j,
+                                (unsigned long long) stats->latency_hist[j]);
+            } else {
+                len += snprintf(hist + len, sizeof(hist) - len, " >=%dus:%llu", 100 << (j - 1),
+                                (unsigned long long) stats->latency_hist[j]);
+            }
+        }
+        logger_log(raop->logger, level, "request stats: %s: %llu requests, mean %.3f ms, max %.3f ms; latency%s",
+                   route, (unsigned long long) stats->requests,
+                   (double) stats->total_latency / stats->requests / 1000000, (double) stats->max_latency / 1000000, hist);
+    }
+    MUTEX_UNLOCK(raop->route_stats_mutex);
+}
+
 static void *
 conn_init(void *opaque, unsigned char *local, int locallen, unsigned char *remote, int remotelen, unsigned int zone_id) {
     raop_t *raop = opaque;
@@ -205,18 +399,20 @@ conn_request(void *ptr, http_request_t *request, http_response_t **response) {
     }
 
 /* this rejects messages from _airplay._tcp for video streaming protocol unless bool raop->hls_support is true*/
-    const char *cseq = http_request_get_header(request, "CSeq");
+    const char *cseq = http_request_get_known_header(request, HTTP_HEADER_CSEQ);
     const char *protocol = http_request_get_protocol(request);
     if (!cseq && !conn->raop->hls_support) {
         logger_log(conn->raop->logger, LOGGER_INFO, "ignoring AirPlay video streaming request (use option -hls to activate HLS support)");
         return;
     }
 
-    const char *client_session_id = http_request_get_header(request, "X-Apple-Session-ID");
+    const char *client_session_id = http_request_get_known_header(request, HTTP_HEADER_APPLE_SESSION_ID);
     const char *host = http_request_get_header(request, "Host");
     hls_request =  (host && !cseq && !client_session_id);
 
     if (conn->connection_type == CONNECTION_TYPE_UNKNOWN) {
+        /* this may stop the services of other connections */
+        MUTEX_LOCK(conn->raop->handler_mutex);
         if (cseq) {
             if (httpd_count_connection_type(conn->raop->httpd, CONNECTION_TYPE_RAOP)) {
                 char ipaddr[40];
@@ -229,6 +425,7 @@ conn_request(void *ptr, http_request_t *request, http_response_t **response) {
 		    httpd_remove_known_connections(conn->raop->httpd);
                 } else {
                     logger_log(conn->raop->logger, LOGGER_WARNING, "rejecting new connection request from %s", ipaddr);
+                    MUTEX_UNLOCK(conn->raop->handler_mutex);
                     *response = http_response_create();
                     http_response_init(*response, protocol, 409, "Conflict: Server is connected to another client");
                     goto finish;
@@ -275,6 +472,7 @@ conn_request(void *ptr, http_request_t *request, http_response_t **response) {
         } else {
 	  logger_log(conn->raop->logger, LOGGER_WARNING, "connection from unknown connection type");
         }	  
+        MUTEX_UNLOCK(conn->raop->handler_mutex);
     }
 
     /* this response code and message  will be modified by the handler if necessary */
@@ -287,12 +485,14 @@ conn_request(void *ptr, http_request_t *request, http_response_t **response) {
     }
 
     if (!conn->have_active_remote) {
-        const char *active_remote = http_request_get_header(request, "Active-Remote");
+        const char *active_remote = http_request_get_known_header(request, HTTP_HEADER_ACTIVE_REMOTE);
         if (active_remote) {
             conn->have_active_remote = true;
             if (conn->raop->callbacks.export_dacp) {
-                const char *dacp_id = http_request_get_header(request, "DACP-ID");
+                const char *dacp_id = http_request_get_known_header(request, HTTP_HEADER_DACP_ID);
+                MUTEX_LOCK(conn->raop->handler_mutex);
                 conn->raop->callbacks.export_dacp(conn->raop->callbacks.cls, active_remote, dacp_id);
+                MUTEX_UNLOCK(conn->raop->handler_mutex);
             }
         }
     }
@@ -349,86 +549,37 @@ conn_request(void *ptr, http_request_t *request, http_response_t **response) {
 
     logger_log(conn->raop->logger, LOGGER_DEBUG, "Handling request %s with URL %s", method, url);
     raop_handler_t handler = NULL;
-    if (!hls_request && !strcmp(protocol, "RTSP/1.0")) {
-        if (!strcmp(method, "POST")) {
-            if (!strcmp(url, "/feedback")) {
-                handler = &raop_handler_feedback;
-	    } else if (!strcmp(url, "/pair-pin-start")) {
-                handler = &raop_handler_pairpinstart;
-            } else if (!strcmp(url, "/pair-setup-pin")) {
-                handler = &raop_handler_pairsetup_pin;
-            } else if (!strcmp(url, "/pair-setup")) {
-                handler = &raop_handler_pairsetup;
-            } else if (!strcmp(url, "/pair-verify")) {
-                handler = &raop_handler_pairverify;
-            } else if (!strcmp(url, "/fp-setup")) {
-                handler = &raop_handler_fpsetup;
-            } else if (!strcmp(url, "/getProperty")) {
-                handler = &http_handler_get_property;
-            } else if (!strcmp(url, "/audioMode")) {
-                //handler = &http_handler_audioMode;
-            }
-        } else if (!strcmp(method, "GET")) {
-            if (!strcmp(url, "/info")) {
-                handler = &raop_handler_info;
-            }
-        } else if (!strcmp(method, "OPTIONS")) {
-            handler = &raop_handler_options;
-        } else if (!strcmp(method, "SETUP")) {
-            handler = &raop_handler_setup;
-        } else if (!strcmp(method, "GET_PARAMETER")) {
-            handler = &raop_handler_get_parameter;
-        } else if (!strcmp(method, "SET_PARAMETER")) {
-            handler = &raop_handler_set_parameter;
-        } else if (!strcmp(method, "RECORD")) {
-            handler = &raop_handler_record;
-        } else if (!strcmp(method, "FLUSH")) {
-            handler = &raop_handler_flush;
-        } else if (!strcmp(method, "TEARDOWN")) {
-            handler = &raop_handler_teardown;
-        } else {
+    bool parallel = false;
+    int route_index = RAOP_ROUTE_NONE;
+    if (hls_request) {
+        handler = &http_handler_hls;
+        route_index = RAOP_ROUTE_HLS;
+    } else {
+        bool known_method = false;
+        const raop_route_t *route = raop_route_find(protocol, method, url, &known_method);
+        if (route && route->handler) {
+            handler = route->handler;
+            parallel = route->parallel;
+            route_index = (int) (route - raop_routes);
+        } else if (!known_method && !strcmp(protocol, "RTSP/1.0")) {
             http_response_init(*response, protocol, 501, "Not Implemented");
-	}
-    } else if (!hls_request && !strcmp(protocol, "HTTP/1.1")) {
-        if (!strcmp(method, "POST")) {
-            if (!strcmp(url, "/reverse")) {
-                handler = &http_handler_reverse;
-            } else if (!strcmp(url, "/play")) {
-                handler = &http_handler_play;
-            } else if (!strncmp (url, "/getProperty?", strlen("/getProperty?"))) {
-                handler = &http_handler_get_property;
-            } else if (!strncmp(url, "/scrub?", strlen("/scrub?"))) {
-                handler = &http_handler_scrub;
-            } else if (!strncmp(url, "/rate?", strlen("/rate?"))) {
-                handler = &http_handler_rate;
-            } else if (!strcmp(url, "/stop")) {
-                handler = &http_handler_stop;
-            } else if (!strcmp(url, "/action")) {
-                handler = &http_handler_action;
-            } else if (!strcmp(url, "/fp-setup2")) {
-                handler = &http_handler_fpsetup2;
-            }
-        } else if (!strcmp(method, "GET")) {
-            if (!strcmp(url, "/server-info")) {
-                handler = &http_handler_server_info;
-            } else if (!strcmp(url, "/playback-info")) {
-                handler = &http_handler_playback_info;
-            }
-        } else if (!strcmp(method, "PUT")) {
-	  if (!strncmp (url, "/setProperty?", strlen("/setProperty?"))) {
-                handler = &http_handler_set_property;
-	  }
         }
-    } else if (hls_request) {
-        handler = &http_handler_hls;
     }
 
+    uint64_t handler_start = raop_ntp_get_local_time();
     if (handler != NULL) {
+        if (!parallel) {
+            MUTEX_LOCK(conn->raop->handler_mutex);
+        }
         handler(conn, request, *response, &response_data, &response_datalen);
+        if (!parallel) {
+            MUTEX_UNLOCK(conn->raop->handler_mutex);
+        }
     } else {
       logger_log(conn->raop->logger, LOGGER_INFO,
 		 "Unhandled Client Request: %s %s %s", method, url, protocol);
     }
+    raop_route_record(conn->raop, route_index, raop_ntp_get_local_time() - handler_start);
 
     finish:;
     if (!hls_request) {
@@ -497,7 +648,9 @@ conn_destroy(void *ptr) {
     raop_conn_t *conn = ptr;
 
     logger_log(conn->raop->logger, LOGGER_DEBUG, "Destroying connection");
+    raop_log_route_stats(conn->raop, LOGGER_DEBUG);
 
+    MUTEX_LOCK(conn->raop->handler_mutex);
     if (conn->raop->callbacks.conn_destroy) {
         conn->raop->callbacks.conn_destroy(conn->raop->callbacks.cls);
     }
@@ -517,6 +670,7 @@ conn_destroy(void *ptr) {
     if (conn->raop->callbacks.video_flush) {
         conn->raop->callbacks.video_flush(conn->raop->callbacks.cls);
     }
+    MUTEX_UNLOCK(conn->raop->handler_mutex);
 
     free(conn->local);
     free(conn->remote);
@@ -558,6 +712,31 @@ raop_init(raop_callbacks_t *callbacks) {
     /* Initialize the logger */
     raop->logger = logger_init();
 
+    /* the client time to presentation time mapping shared by audio and video */
+    raop->av_sync = av_sync_init(raop->logger);
+    if (!raop->av_sync) {
+        logger_destroy(raop->logger);
+        free(raop);
+        return NULL;
+    }
+
+    MUTEX_CREATE(raop->info_mutex);
+
+    /* raop_route_find needs a sorted routing table */
+    for (int i = 1; i < RAOP_ROUTES; i++) {
+        assert(raop_route_compare(&raop_routes[i - 1], &raop_routes[i]) < 0);
+    }
+    raop->route_stats = calloc(RAOP_ROUTE_NONE + 1, sizeof(raop_route_stats_t));
+    if (!raop->route_stats) {
+        MUTEX_DESTROY(raop->info_mutex);
+        av_sync_destroy(raop->av_sync);
+        logger_destroy(raop->logger);
+        free(raop);
+        return NULL;
+    }
+    MUTEX_CREATE(raop->route_stats_mutex);
+    MUTEX_CREATE(raop->handler_mutex);
+
     /* Copy callbacks structure */
     memcpy(&raop->callbacks, callbacks, sizeof(raop_callbacks_t));
 
@@ -584,6 +763,14 @@ raop_init(raop_callbacks_t *callbacks) {
 
     raop->audio_delay_micros = 250000;
 
+    raop->video_decrypt_threads = 1;
+
+    raop->audio_buffer_depth = RAOP_BUFFER_DEFAULT_DEPTH;
+
+    raop->adaptive_delay = false;
+    raop->adaptive_delay_min = 0;
+    raop->adaptive_delay_max = 0;
+
     raop->hls_support = false;
 
     raop->nonce = NULL;
@@ -617,6 +804,7 @@ raop_init2(raop_t *raop, int nohold, const char *device_id, const char *keyfile)
     if (new_key) {
         logger_log(raop->logger, LOGGER_INFO,"*** A new Public Key has been created and stored in %s", keyfile);
     }
+    raop_invalidate_info(raop);
 
     /* Set HTTP callbacks to our handlers */
     memset(&httpd_cbs, 0, sizeof(httpd_cbs));
@@ -645,6 +833,12 @@ raop_destroy(raop_t *raop) {
         raop_stop_httpd(raop);
         pairing_destroy(raop->pairing);
         httpd_destroy(raop->httpd);
+        av_sync_destroy(raop->av_sync);
+        raop_invalidate_info(raop);
+        MUTEX_DESTROY(raop->info_mutex);
+        MUTEX_DESTROY(raop->route_stats_mutex);
+        MUTEX_DESTROY(raop->handler_mutex);
+        free(raop->route_stats);
         logger_destroy(raop->logger);
 	if (raop->nonce) {
             free(raop->nonce);
@@ -676,22 +870,27 @@ raop_set_log_level(raop_t *raop, int level) {
 
 int raop_set_plist(raop_t *raop, const char *plist_item, const int value) {
     int retval = 0;
+    bool info_changed = false;   /* a value in the cached GET /info response was changed */
     assert(raop);
     assert(plist_item);
-    
     if (strcmp(plist_item, "width") == 0) {
+        info_changed = (raop->width != (uint16_t) value);
         raop->width = (uint16_t) value;
         if ((int) raop->width != value) retval = 1;
     } else if (strcmp(plist_item, "height") == 0) {
+        info_changed = (raop->height != (uint16_t) value);
         raop->height = (uint16_t) value;
         if ((int) raop->height != value) retval = 1;
     } else if (strcmp(plist_item, "refreshRate") == 0) {
+        info_changed = (raop->refreshRate != (uint8_t) value);
         raop->refreshRate = (uint8_t) value;
         if ((int) raop->refreshRate != value) retval = 1;
     } else if (strcmp(plist_item, "maxFPS") == 0) {
+        info_changed = (raop->maxFPS != (uint8_t) value);
         raop->maxFPS = (uint8_t) value;
         if ((int) raop->maxFPS != value) retval = 1;
     } else if (strcmp(plist_item, "overscanned") == 0) {
+        info_changed = (raop->overscanned != (uint8_t) (value ? 1 : 0));
         raop->overscanned = (uint8_t) (value ? 1 : 0);
         if ((int) raop->overscanned  != value) retval = 1;
     } else if (strcmp(plist_item, "clientFPSdata") == 0) {
@@ -702,14 +901,59 @@ int raop_set_plist(raop_t *raop, const char *plist_item, const int value) {
             raop->audio_delay_micros = value;
         }
         if (raop->audio_delay_micros != value) retval = 1;
+    } else if (strcmp(plist_item, "video_decrypt_threads") == 0) {
+        if (value >= 1 && value <= MAX_DECRYPT_THREADS) {
+            raop->video_decrypt_threads = value;
+        }
+        if (raop->video_decrypt_threads != value) retval = 1;
+    } else if (strcmp(plist_item, "audio_buffer_depth") == 0) {
+        /* the depth is rounded up to a power of 2 */
+        if (value >= RAOP_BUFFER_MIN_DEPTH && value <= RAOP_BUFFER_MAX_DEPTH) {
+            int depth = RAOP_BUFFER_MIN_DEPTH;
+            while (depth < value) {
+                depth *= 2;
+            }
+            raop->audio_buffer_depth = depth;
+        }
+        if (raop->audio_buffer_depth != value) retval = 1;
+    } else if (strcmp(plist_item, "adaptive_delay_min_micros") == 0) {
+        if (value >= 0 && value <= 2 * SECOND_IN_USECS) {
+            raop->adaptive_delay_min = value;
+            raop->adaptive_delay = true;
+        }
+        if (raop->adaptive_delay_min != value) retval = 1;
+    } else if (strcmp(plist_item, "adaptive_delay_max_micros") == 0) {
+        if (value >= 0 && value <= 2 * SECOND_IN_USECS) {
+            raop->adaptive_delay_max = value;
+            raop->adaptive_delay = true;
+        }
+        if (raop->adaptive_delay_max != value) retval = 1;
+    } else if (strcmp(plist_item, "local_clock") == 0) {
+        /* value is a clockid_t; this applies to all connections (and must match the renderers' clock) */
+        struct timespec time;
+        if (clock_gettime((clockid_t) value, &time) == 0) {
+            raop_ntp_set_local_clock((clockid_t) value);
+        } else {
+            retval = 1;
+        }
     } else if (strcmp(plist_item, "pin") == 0) {
         raop->pin = value;
         raop->use_pin = true;
     } else if (strcmp(plist_item, "hls") == 0) {
         raop->hls_support = (value > 0 ? true : false);
+    } else if (strcmp(plist_item, "max_connections") == 0) {
+        /* must be set before raop_start_httpd */
+        if (httpd_set_max_connections(raop->httpd, value)) retval = 1;
+    } else if (strcmp(plist_item, "request_threads") == 0) {
+        /* must be set before raop_start_httpd */
+        if (httpd_set_workers(raop->httpd, value)) retval = 1;
     } else {
         retval = -1;
     }	  
+    /* the display items are part of the GET /info response */
+    if (info_changed) {
+        raop_invalidate_info(raop);
+    }
     return retval;
 }
 
@@ -734,6 +978,12 @@ raop_set_tcp_ports(raop_t *raop, unsigned short tcp[2]) {
     raop->port = tcp[1];
 }
 
+av_sync_t *
+raop_get_av_sync(raop_t *raop) {
+    assert(raop);
+    return raop->av_sync;
+}
+
 unsigned short
 raop_get_port(raop_t *raop) {
     assert(raop);
@@ -758,6 +1008,7 @@ raop_set_dnssd(raop_t *raop, dnssd_t *dnssd) {
     assert(dnssd);
     dnssd_set_pk(dnssd, raop->pk_str);
     raop->dnssd = dnssd;
+    raop_invalidate_info(raop);
 }
 
 
@@ -772,6 +1023,7 @@ void
 raop_stop_httpd(raop_t *raop) {
     assert(raop);
     httpd_stop(raop->httpd);
+    raop_log_route_stats(raop, LOGGER_INFO);
 }
 
 void raop_remove_known_connections(raop_t * raop) {
@@ -22,6 +22,7 @@
 #include "stream.h"
 #include "raop_ntp.h"
 #include "airplay_video.h"
+#include "av_sync.h"
 
 #if defined (WIN32) && defined(DLL_EXPORT)
 # define RAOP_API __declspec(dllexport)
@@ -60,6 +61,9 @@ typedef enum video_codec_e {
     VIDEO_CODEC_H265
 } video_codec_t;
 
+/* with request threads (raop_set_plist "request_threads"), the callbacks are made one at a time,  *
+ * except conn_init, conn_feedback and audio_set_client_volume, which may be called at the same time *
+ * as the others (as may the callbacks made by the audio and video threads)                         */
 struct raop_callbacks_s {
     void* cls;
 
@@ -85,6 +89,7 @@ struct raop_callbacks_s {
     void  (*audio_stop_coverart_rendering) (void* cls);
     void  (*audio_remote_control_id)(void *cls, const char *dacp_id, const char *active_remote_header);
     void  (*audio_set_progress)(void *cls, unsigned int start, unsigned int curr, unsigned int end);
+    void  (*audio_report_stats)(void *cls, audio_rtp_stats_t *stats);
     void  (*audio_get_format)(void *cls, unsigned char *ct, unsigned short *spf, bool *usingScreen, bool *isMedia, uint64_t *audioFormat);
     void  (*video_report_size)(void *cls, float *width_source, float *height_source, float *width, float *height);
     void  (*report_client_request) (void *cls, char *deviceid, char *model, char *name, bool *admit);
@@ -131,6 +136,7 @@ RAOP_API void raop_set_dnssd(raop_t *raop, dnssd_t *dnssd);
 RAOP_API void raop_destroy(raop_t *raop);
 RAOP_API void raop_remove_known_connections(raop_t * raop);
 RAOP_API void raop_destroy_airplay_video(raop_t *raop);
+RAOP_API av_sync_t *raop_get_av_sync(raop_t *raop);
 
 #ifdef __cplusplus
 }
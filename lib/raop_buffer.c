@@ -22,6 +22,7 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stddef.h>
 
 #include "raop_buffer.h"
 #include "raop_rtp.h"
@@ -33,21 +34,36 @@
 #include "utils.h"
 #include "byteutils.h"
 
-#define RAOP_BUFFER_LENGTH 32
+/* resend scheduling (times in nsecs) */
+#define RESEND_MIN_INTERVAL (20 * (uint64_t) 1000000)
+#define RESEND_MAX_ATTEMPTS 4
+#define RESEND_ABANDONED (-1)
+#define RESEND_COALESCE_GAP 2
+
+/* slots hold the payload (after the 12-byte RTP header) of an audio packet: this is at most 1412  *
+ * bytes (an uncompressed 352-sample ALAC frame); AAC-ELD frames are much smaller                */
+#define RAOP_BUFFER_SLOT_SIZE 2048
 
 typedef struct {
     /* Data available */
     int filled;
+    /* Payload handed out by raop_buffer_dequeue, not yet returned with raop_buffer_release */
+    int borrowed;
 
+    /* local wall-clock time (nsecs) at which the packet was received */
     uint64_t packet_arrival_time;
+    /* resend scheduling of a missing packet (with the seqnum of the missing packet) */
+    uint64_t resend_request_time;   /* time of the latest resend request, 0 if not requested */
+    uint64_t resend_next_time;      /* time at which the next request is due */
+    int resend_attempts;            /* requests made, or RESEND_ABANDONED */
 
     /* RTP header */
     unsigned short seqnum;
     uint32_t rtp_timestamp;
 
-    /* Payload data */
+    /* Payload data, decrypted directly into the slot */
     unsigned int payload_size;
-    void *payload_data;
+    unsigned char payload_data[RAOP_BUFFER_SLOT_SIZE];
 } raop_buffer_entry_t;
 
 struct raop_buffer_s {
@@ -60,14 +76,29 @@ struct raop_buffer_s {
     unsigned short first_seqnum;
     unsigned short last_seqnum;
 
-    /* RTP buffer entries */
-    raop_buffer_entry_t entries[RAOP_BUFFER_LENGTH];
+    /* RTP buffer entries: a ring of "length" slots (a power of 2, so  *
+     * that slot positions are consistent when the seqnum wraps around) */
+    unsigned short length;
+    raop_buffer_entry_t *entries;
+
+    /* packet counters (the jitter is computed by raop_rtp) */
+    audio_rtp_stats_t stats;
+    /* smoothed resend round-trip latency (nsecs) */
+    double resend_latency;
+
+    /* seqnum and rtp timestamp of the last packet dequeued, and the rtp timestamp increment *
+     * between packets, for estimating the rtp timestamps of missing packets                 */
+    bool have_ref;
+    unsigned short ref_seqnum;
+    uint32_t ref_rtp_timestamp;
+    int32_t rtp_per_packet;
 };
 
 raop_buffer_t *
 raop_buffer_init(logger_t *logger,
                  const unsigned char *aeskey,
-                 const unsigned char *aesiv)
+                 const unsigned char *aesiv,
+                 int depth)
 {
     raop_buffer_t *raop_buffer;
     assert(aeskey);
@@ -77,14 +108,21 @@ raop_buffer_init(logger_t *logger,
         return NULL;
     }
     raop_buffer->logger = logger;
-    // Need to be initialized internally
-    raop_buffer->aes_ctx = aes_cbc_init(aeskey, aesiv, AES_DECRYPT);
 
-    for (int i = 0; i < RAOP_BUFFER_LENGTH; i++) {
-        raop_buffer_entry_t *entry = &raop_buffer->entries[i];
-        entry->payload_data = NULL;
-        entry->payload_size = 0;
+    /* round depth up to a power of 2 in the allowed range */
+    raop_buffer->length = RAOP_BUFFER_MIN_DEPTH;
+    while (raop_buffer->length < depth && raop_buffer->length < RAOP_BUFFER_MAX_DEPTH) {
+        raop_buffer->length *= 2;
+    }
+    raop_buffer->entries = calloc(raop_buffer->length, sizeof(raop_buffer_entry_t));
+    if (!raop_buffer->entries) {
+        free(raop_buffer);
+        return NULL;
     }
+    logger_log(logger, LOGGER_DEBUG, "raop_buffer: audio packet buffer depth %u", raop_buffer->length);
+
+    // Need to be initialized internally
+    raop_buffer->aes_ctx = aes_cbc_init(aeskey, aesiv, AES_DECRYPT);
 
     raop_buffer->is_empty = 1;
 
@@ -94,15 +132,9 @@ raop_buffer_init(logger_t *logger,
 void
 raop_buffer_destroy(raop_buffer_t *raop_buffer)
 {
-    for (int i = 0; i < RAOP_BUFFER_LENGTH; i++) {
-        raop_buffer_entry_t *entry = &raop_buffer->entries[i];
-        if (entry->payload_data != NULL) {
-            free(entry->payload_data);
-        }
-    }
-
     if (raop_buffer) {
         aes_cbc_destroy(raop_buffer->aes_ctx);
+        free(raop_buffer->entries);
         free(raop_buffer);
     }
 
@@ -166,7 +198,8 @@ raop_buffer_decrypt(raop_buffer_t *raop_buffer, unsigned char *data, unsigned ch
 }
 
 int
-raop_buffer_enqueue(raop_buffer_t *raop_buffer, unsigned char *data, unsigned short datalen, int use_seqnum) {
+raop_buffer_enqueue(raop_buffer_t *raop_buffer, unsigned char *data, unsigned short datalen, uint64_t arrival_time,
+                    int use_seqnum) {
     unsigned char empty_packet_marker[] = { 0x00, 0x68, 0x34, 0x00 };
     assert(raop_buffer);
 
@@ -179,6 +212,12 @@ raop_buffer_enqueue(raop_buffer_t *raop_buffer, unsigned char *data, unsigned sh
         return 0;
     }
     int payload_size = datalen - 12;
+    if (payload_size > RAOP_BUFFER_SLOT_SIZE) {
+        /* not a valid audio frame: drop it (it will be counted as lost) */
+        logger_log(raop_buffer->logger, LOGGER_WARNING, "raop_buffer: dropped audio packet with %d byte payload (max %d)",
+                   payload_size, RAOP_BUFFER_SLOT_SIZE);
+        return 0;
+    }
 
     /* Get correct seqnum for the packet */
     unsigned short seqnum;
@@ -190,27 +229,56 @@ raop_buffer_enqueue(raop_buffer_t *raop_buffer, unsigned char *data, unsigned sh
 
     /* If this packet is too late, just skip it */
     if (!raop_buffer->is_empty && seqnum_cmp(seqnum, raop_buffer->first_seqnum) < 0) {
+        raop_buffer->stats.packets_late++;
         return 0;
     }
 
     /* Check that there is always space in the buffer, otherwise flush */
-    if (seqnum_cmp(seqnum, raop_buffer->first_seqnum + RAOP_BUFFER_LENGTH) >= 0) {
+    if (seqnum_cmp(seqnum, raop_buffer->first_seqnum + raop_buffer->length) >= 0) {
+        if (!raop_buffer->is_empty && seqnum_cmp(seqnum, raop_buffer->last_seqnum) > 1) {
+            /* packets between last_seqnum and seqnum are skipped */
+            raop_buffer->stats.packets_lost += seqnum_cmp(seqnum, raop_buffer->last_seqnum) - 1;
+        }
         raop_buffer_flush(raop_buffer, seqnum);
     }
 
     /* Get entry corresponding our seqnum */
-    raop_buffer_entry_t *entry = &raop_buffer->entries[seqnum % RAOP_BUFFER_LENGTH];
+    raop_buffer_entry_t *entry = &raop_buffer->entries[seqnum % raop_buffer->length];
     if (entry->filled && seqnum_cmp(entry->seqnum, seqnum) == 0) {
         /* Packet resend, we can safely ignore */
+        raop_buffer->stats.packets_duplicate++;
         return 0;
     }
+    /* the payload of a dequeued entry must be released before the slot is reused */
+    assert(!entry->borrowed);
+
+    raop_buffer->stats.packets_received++;
+    if (entry->resend_attempts > 0 && entry->seqnum == seqnum) {
+        /* a requested resend has arrived */
+        uint64_t latency_msecs = (arrival_time > entry->resend_request_time ?
+                                  (arrival_time - entry->resend_request_time) / 1000000 : 0);
+        int bin = 0;
+        while (bin < AUDIO_RESEND_LATENCY_BINS - 1 && latency_msecs >= (10 << bin)) {
+            bin++;
+        }
+        raop_buffer->stats.resend_latency_hist[bin]++;
+        raop_buffer->stats.resends_satisfied++;
+        raop_buffer->resend_latency += ((double) (latency_msecs * 1000000) - raop_buffer->resend_latency) / 8.0;
+    }
+    entry->resend_request_time = 0;
+    entry->resend_attempts = 0;
 
     /* Update the raop_buffer entry header */
     entry->seqnum = seqnum;
     entry->rtp_timestamp = byteutils_get_int_be(data, 4);
+    entry->packet_arrival_time = arrival_time;
     entry->filled = 1;
 
-    entry->payload_data = malloc(payload_size);
+    raop_buffer_entry_t *prev = &raop_buffer->entries[(unsigned short) (seqnum - 1) % raop_buffer->length];
+    if (prev->filled && prev->seqnum == (unsigned short) (seqnum - 1)) {
+        raop_buffer->rtp_per_packet = (int32_t) (entry->rtp_timestamp - prev->rtp_timestamp);
+    }
+
     int decrypt_ret = raop_buffer_decrypt(raop_buffer, data, entry->payload_data, payload_size, &entry->payload_size);
     assert(decrypt_ret >= 0);
     assert(entry->payload_size <= payload_size);
@@ -227,8 +295,11 @@ raop_buffer_enqueue(raop_buffer_t *raop_buffer, unsigned char *data, unsigned sh
     return 1;
 }
 
-void *
-raop_buffer_dequeue(raop_buffer_t *raop_buffer, unsigned int *length, uint32_t *rtp_timestamp, unsigned short *seqnum, int no_resend) {
+/* The returned payload is borrowed from the buffer, and must be returned with raop_buffer_release() *
+ * (before the next raop_buffer_enqueue) when the caller has finished with it.                       */
+unsigned char *
+raop_buffer_dequeue(raop_buffer_t *raop_buffer, unsigned int *length, uint32_t *rtp_timestamp, unsigned short *seqnum,
+                    uint64_t *arrival_time, int no_resend) {
     assert(raop_buffer);
 
     /* Calculate number of entries in the current buffer */
@@ -240,12 +311,14 @@ raop_buffer_dequeue(raop_buffer_t *raop_buffer, unsigned int *length, uint32_t *
     }
 
     /* Get the first buffer entry for inspection */
-    raop_buffer_entry_t *entry = &raop_buffer->entries[raop_buffer->first_seqnum % RAOP_BUFFER_LENGTH];
+    raop_buffer_entry_t *entry = &raop_buffer->entries[raop_buffer->first_seqnum % raop_buffer->length];
     if (no_resend) {
         /* If we do no resends, always return the first entry */
     } else if (!entry->filled) {
-        /* Check how much we have space left in the buffer */
-        if (entry_count < RAOP_BUFFER_LENGTH) {
+        /* Check how much we have space left in the buffer (there is no point waiting for a *
+         * packet whose resend was abandoned as it could not arrive in time)                */
+        bool abandoned = (entry->seqnum == raop_buffer->first_seqnum && entry->resend_attempts == RESEND_ABANDONED);
+        if (entry_count < raop_buffer->length && !abandoned) {
             /* Return nothing and hope resend gets on time */
             return NULL;
         }
@@ -254,53 +327,135 @@ raop_buffer_dequeue(raop_buffer_t *raop_buffer, unsigned int *length, uint32_t *
 
     /* Update buffer and validate entry */
     raop_buffer->first_seqnum += 1;
+    entry->resend_request_time = 0;
+    entry->resend_attempts = 0;
     if (!entry->filled) {
+        raop_buffer->stats.packets_lost++;
         return NULL;
     }
+    raop_buffer->have_ref = true;
+    raop_buffer->ref_seqnum = entry->seqnum;
+    raop_buffer->ref_rtp_timestamp = entry->rtp_timestamp;
     entry->filled = 0;
+    entry->borrowed = 1;
 
     /* Return entry payload buffer */
     *rtp_timestamp = entry->rtp_timestamp;
     *seqnum = entry->seqnum;
+    if (arrival_time) {
+        *arrival_time = entry->packet_arrival_time;
+    }
     *length = entry->payload_size;
+    return entry->payload_data;
+}
+
+void
+raop_buffer_release(raop_buffer_t *raop_buffer, unsigned char *payload) {
+    assert(raop_buffer);
+    assert(payload);
+    raop_buffer_entry_t *entry = (raop_buffer_entry_t *) (payload - offsetof(raop_buffer_entry_t, payload_data));
+    assert(entry >= raop_buffer->entries && entry < raop_buffer->entries + raop_buffer->length);
+    entry->borrowed = 0;
     entry->payload_size = 0;
-    void* data = entry->payload_data;
-    entry->payload_data = NULL;
-    return data;
 }
 
-void raop_buffer_handle_resends(raop_buffer_t *raop_buffer, raop_resend_cb_t resend_cb, void *opaque) {
+/* Resend scheduling: every missing packet between first_seqnum and last_seqnum is requested,    *
+ * then requested again with exponential backoff (starting at twice the resend latency), up to   *
+ * RESEND_MAX_ATTEMPTS times.  Requests for nearby packets are coalesced into one seqnum range.  *
+ * A packet is no longer requested when a resend could not arrive before its playout time, which *
+ * is estimated from the rtp timestamp of the last packet received before it.                    */
+void raop_buffer_handle_resends(raop_buffer_t *raop_buffer, raop_resend_cb_t resend_cb,
+                                raop_playout_time_cb_t playout_time_cb, void *opaque, uint64_t now) {
+    unsigned short range_start = 0, range_count = 0;
     assert(raop_buffer);
     assert(resend_cb);
 
-    if (seqnum_cmp(raop_buffer->first_seqnum, raop_buffer->last_seqnum) < 0) {
-        unsigned short seqnum, count = 0;
-        logger_log(raop_buffer->logger, LOGGER_DEBUG, "raop_buffer_handle_resends first_seqnum=%u last seqnum=%u",
-                   raop_buffer->first_seqnum, raop_buffer->last_seqnum);
-        for (seqnum = raop_buffer->first_seqnum; seqnum_cmp(seqnum, raop_buffer->last_seqnum) < 0; seqnum++) {
-            raop_buffer_entry_t *entry = &raop_buffer->entries[seqnum % RAOP_BUFFER_LENGTH];
-            if (entry->filled) {
-                break;
-            }
-	    count++;
+    if (raop_buffer->is_empty || seqnum_cmp(raop_buffer->first_seqnum, raop_buffer->last_seqnum) >= 0) {
+        return;
+    }
+
+    uint64_t latency = (uint64_t) raop_buffer->resend_latency;
+    uint64_t interval = (2 * latency > RESEND_MIN_INTERVAL ? 2 * latency : RESEND_MIN_INTERVAL);
+    bool have_ref = raop_buffer->have_ref;
+    unsigned short ref_seqnum = raop_buffer->ref_seqnum;
+    uint32_t ref_rtp_timestamp = raop_buffer->ref_rtp_timestamp;
+
+    for (unsigned short seqnum = raop_buffer->first_seqnum; seqnum_cmp(seqnum, raop_buffer->last_seqnum) < 0; seqnum++) {
+        raop_buffer_entry_t *entry = &raop_buffer->entries[seqnum % raop_buffer->length];
+        if (entry->filled) {
+            have_ref = true;
+            ref_seqnum = entry->seqnum;
+            ref_rtp_timestamp = entry->rtp_timestamp;
+            continue;
+        }
+        if (entry->seqnum != seqnum || entry->resend_attempts == 0) {
+            /* newly missing packet */
+            entry->seqnum = seqnum;
+            entry->resend_attempts = 0;
+            entry->resend_request_time = 0;
+            entry->resend_next_time = now;
         }
-        if (count){
-            resend_cb(opaque, raop_buffer->first_seqnum, count);
+        if (entry->resend_attempts < 0 || now < entry->resend_next_time) {
+            continue;
+        }
+        uint64_t playout_time = 0;
+        if (playout_time_cb && have_ref && raop_buffer->rtp_per_packet) {
+            uint32_t rtp_timestamp = ref_rtp_timestamp + (uint32_t) (seqnum_cmp(seqnum, ref_seqnum) * raop_buffer->rtp_per_packet);
+            playout_time = playout_time_cb(opaque, rtp_timestamp);
+        }
+        if (entry->resend_attempts >= RESEND_MAX_ATTEMPTS || (playout_time && now + latency >= playout_time)) {
+            /* no answer to the last request, or too late for a resend to arrive in time */
+            entry->resend_attempts = RESEND_ABANDONED;
+            raop_buffer->stats.resends_abandoned++;
+            continue;
+        }
+        if (entry->resend_attempts == 0) {
+            raop_buffer->stats.resend_packets++;
+        }
+        entry->resend_request_time = now;
+        entry->resend_next_time = now + (interval << entry->resend_attempts);
+        entry->resend_attempts++;
+
+        if (range_count && seqnum_cmp(seqnum, range_start + range_count) <= RESEND_COALESCE_GAP) {
+            /* extend the current range (re-requesting up to RESEND_COALESCE_GAP received packets) */
+            range_count = seqnum_cmp(seqnum, range_start) + 1;
+        } else {
+            if (range_count) {
+                raop_buffer->stats.resend_requests++;
+                resend_cb(opaque, range_start, range_count);
+            }
+            range_start = seqnum;
+            range_count = 1;
         }
     }
+    if (range_count) {
+        raop_buffer->stats.resend_requests++;
+        resend_cb(opaque, range_start, range_count);
+    }
+}
+
+void
+raop_buffer_get_stats(raop_buffer_t *raop_buffer, audio_rtp_stats_t *stats) {
+    assert(raop_buffer);
+    memcpy(stats, &raop_buffer->stats, sizeof(audio_rtp_stats_t));
+}
+
+uint64_t
+raop_buffer_get_resend_latency(raop_buffer_t *raop_buffer) {
+    assert(raop_buffer);
+    return (uint64_t) raop_buffer->resend_latency;
 }
 
 void raop_buffer_flush(raop_buffer_t *raop_buffer, int next_seq) {
     assert(raop_buffer);
 
-    for (int i = 0; i < RAOP_BUFFER_LENGTH; i++) {
-        if (raop_buffer->entries[i].payload_data) {
-            free(raop_buffer->entries[i].payload_data);
-            raop_buffer->entries[i].payload_data = NULL;   
-            raop_buffer->entries[i].payload_size = 0;
-        }
+    for (int i = 0; i < raop_buffer->length; i++) {
+        raop_buffer->entries[i].payload_size = 0;
+        raop_buffer->entries[i].resend_request_time = 0;
+        raop_buffer->entries[i].resend_attempts = 0;
         raop_buffer->entries[i].filled = 0;
     }
+    raop_buffer->have_ref = false;
     if (next_seq < 0 || next_seq > 0xffff) {
         raop_buffer->is_empty = 1;
     } else {
@@ -20,17 +20,32 @@
 
 #include "logger.h"
 #include "raop_rtp.h"
+#include "stream.h"
+
+/* range of the (power of 2) number of packets held in the buffer */
+#define RAOP_BUFFER_MIN_DEPTH 16
+#define RAOP_BUFFER_MAX_DEPTH 1024
+#define RAOP_BUFFER_DEFAULT_DEPTH 32
 
 typedef struct raop_buffer_s raop_buffer_t;
 
 typedef int (*raop_resend_cb_t)(void *opaque, unsigned short seqno, unsigned short count);
+/* returns the local playout time (nsecs) of a packet with the given rtp timestamp, or 0 if unknown */
+typedef uint64_t (*raop_playout_time_cb_t)(void *opaque, uint32_t rtp_timestamp);
 
 raop_buffer_t *raop_buffer_init(logger_t *logger,
                                 const unsigned char *aeskey,
-                                const unsigned char *aesiv);
-int raop_buffer_enqueue(raop_buffer_t *raop_buffer, unsigned char *data, unsigned short datalen, int use_seqnum);
-void *raop_buffer_dequeue(raop_buffer_t *raop_buffer, unsigned int *length, uint32_t *rtp_timestamp, unsigned short *seqnum, int no_resend);
-void raop_buffer_handle_resends(raop_buffer_t *raop_buffer, raop_resend_cb_t resend_cb, void *opaque);
+                                const unsigned char *aesiv,
+                                int depth);
+int raop_buffer_enqueue(raop_buffer_t *raop_buffer, unsigned char *data, unsigned short datalen, uint64_t arrival_time,
+                        int use_seqnum);
+unsigned char *raop_buffer_dequeue(raop_buffer_t *raop_buffer, unsigned int *length, uint32_t *rtp_timestamp,
+                                   unsigned short *seqnum, uint64_t *arrival_time, int no_resend);
+void raop_buffer_release(raop_buffer_t *raop_buffer, unsigned char *payload);
+void raop_buffer_handle_resends(raop_buffer_t *raop_buffer, raop_resend_cb_t resend_cb,
+                                raop_playout_time_cb_t playout_time_cb, void *opaque, uint64_t now);
+void raop_buffer_get_stats(raop_buffer_t *raop_buffer, audio_rtp_stats_t *stats);
+uint64_t raop_buffer_get_resend_latency(raop_buffer_t *raop_buffer);
 void raop_buffer_flush(raop_buffer_t *raop_buffer, int next_seq);
 
 int raop_buffer_decrypt(raop_buffer_t *raop_buffer, unsigned char *data, unsigned char* output,
@@ -31,45 +31,32 @@
 typedef void (*raop_handler_t)(raop_conn_t *, http_request_t *,
                                http_response_t *, char **, int *);
 
+/* discard the cached GET /info and GET /server-info responses */
 static void
-raop_handler_info(raop_conn_t *conn,
-                  http_request_t *request, http_response_t *response,
-                  char **response_data, int *response_datalen)
+raop_invalidate_info(raop_t *raop)
 {
-    assert(conn->raop->dnssd);
+    MUTEX_LOCK(raop->info_mutex);
+    free(raop->info_data);
+    raop->info_data = NULL;
+    raop->info_datalen = 0;
+    free(raop->info_airplay_txt);
+    raop->info_airplay_txt = NULL;
+    raop->info_airplay_txt_len = 0;
+    free(raop->server_info_data);
+    raop->server_info_data = NULL;
+    raop->server_info_datalen = 0;
+    MUTEX_UNLOCK(raop->info_mutex);
+}
 
-#if 0
-    /* initial GET/info request sends plist with string "txtAirPlay" */
-    bool txtAirPlay = false;
-    const char* content_type =  NULL;
-    content_type = http_request_get_header(request, "Content-Type");
-    if (content_type && strstr(content_type, "application/x-apple-binary-plist")) {
-        char *qualifier_string = NULL;
-        const char *data = NULL;
-        int data_len = 0;
-        data = http_request_get_data(request, &data_len);
-        //parsing bplist
-        plist_t req_root_node = NULL;
-        plist_from_bin(data, data_len, &req_root_node);
-        plist_t req_qualifier_node = plist_dict_get_item(req_root_node, "qualifier");
-        if (PLIST_IS_ARRAY(req_qualifier_node)) {
-            plist_t req_string_node = plist_array_get_item(req_qualifier_node, 0);
-            plist_get_string_val(req_string_node, &qualifier_string);
-        }
-        if (qualifier_string && !strcmp(qualifier_string, "txtAirPlay")) {
-	    printf("qualifier: %s\n", qualifier_string);
-	    txtAirPlay = true;
-        }
-	if (qualifier_string) {
-            free(qualifier_string);
-	}
-    }
-#endif
+/* the binary plist sent in response to GET /info */
+static void
+raop_info_build(raop_t *raop, char **data, int *datalen)
+{
     plist_t res_node = plist_new_dict();
 
     /* deviceID is the physical hardware address, and will not change */
     int hw_addr_raw_len = 0;
-    const char *hw_addr_raw = dnssd_get_hw_addr(conn->raop->dnssd, &hw_addr_raw_len);
+    const char *hw_addr_raw = dnssd_get_hw_addr(raop->dnssd, &hw_addr_raw_len);
     char *hw_addr = calloc(1, 3 * hw_addr_raw_len);
     //int hw_addr_len =
     utils_hwaddr_airplay(hw_addr, 3 * hw_addr_raw_len, hw_addr_raw, hw_addr_raw_len);
@@ -78,22 +65,22 @@ raop_handler_info(raop_conn_t *conn,
 
     /* Persistent Public Key */
     int pk_len = 0;
-    char *pk = utils_parse_hex(conn->raop->pk_str, strlen(conn->raop->pk_str), &pk_len);
+    char *pk = utils_parse_hex(raop->pk_str, strlen(raop->pk_str), &pk_len);
     plist_t pk_node = plist_new_data(pk, pk_len);
     plist_dict_set_item(res_node, "pk", pk_node);
 
     /* airplay_txt is from the _airplay._tcp  dnssd announuncement, may not be necessary */
     int airplay_txt_len = 0;
-    const char *airplay_txt = dnssd_get_airplay_txt(conn->raop->dnssd, &airplay_txt_len);
+    const char *airplay_txt = dnssd_get_airplay_txt(raop->dnssd, &airplay_txt_len);
     plist_t txt_airplay_node = plist_new_data(airplay_txt, airplay_txt_len);
     plist_dict_set_item(res_node, "txtAirPlay", txt_airplay_node);
 
-    uint64_t features = dnssd_get_airplay_features(conn->raop->dnssd);
+    uint64_t features = dnssd_get_airplay_features(raop->dnssd);
     plist_t features_node = plist_new_uint(features);
     plist_dict_set_item(res_node, "features", features_node);
 
     int name_len = 0;
-    const char *name = dnssd_get_name(conn->raop->dnssd, &name_len);
+    const char *name = dnssd_get_name(raop->dnssd, &name_len);
     plist_t name_node = plist_new_string(name);
     plist_dict_set_item(res_node, "name", name_node);
 
@@ -170,14 +157,14 @@ raop_handler_info(raop_conn_t *conn,
     plist_t displays_0_width_physical_node = plist_new_uint(0);
     plist_t displays_0_height_physical_node = plist_new_uint(0);
     plist_t displays_0_uuid_node = plist_new_string("e0ff8a27-6738-3d56-8a16-cc53aacee925");
-    plist_t displays_0_width_node = plist_new_uint(conn->raop->width);
-    plist_t displays_0_height_node = plist_new_uint(conn->raop->height);
-    plist_t displays_0_width_pixels_node = plist_new_uint(conn->raop->width);
-    plist_t displays_0_height_pixels_node = plist_new_uint(conn->raop->height);
+    plist_t displays_0_width_node = plist_new_uint(raop->width);
+    plist_t displays_0_height_node = plist_new_uint(raop->height);
+    plist_t displays_0_width_pixels_node = plist_new_uint(raop->width);
+    plist_t displays_0_height_pixels_node = plist_new_uint(raop->height);
     plist_t displays_0_rotation_node = plist_new_bool(0); /* set to true in AppleTV gen 3 (which has features bit 8  set */
-    plist_t displays_0_refresh_rate_node = plist_new_real((double) 1.0 / conn->raop->refreshRate);  /* set as real 0.166666  = 60hz in AppleTV gen 3 */
-    plist_t displays_0_max_fps_node = plist_new_uint(conn->raop->maxFPS);
-    plist_t displays_0_overscanned_node = plist_new_bool(conn->raop->overscanned);
+    plist_t displays_0_refresh_rate_node = plist_new_real((double) 1.0 / raop->refreshRate);  /* set as real 0.166666  = 60hz in AppleTV gen 3 */
+    plist_t displays_0_max_fps_node = plist_new_uint(raop->maxFPS);
+    plist_t displays_0_overscanned_node = plist_new_bool(raop->overscanned);
     plist_t displays_0_features = plist_new_uint(14);
 
     plist_dict_set_item(displays_0_node, "uuid", displays_0_uuid_node);
@@ -195,13 +182,81 @@ raop_handler_info(raop_conn_t *conn,
     plist_array_append_item(displays_node, displays_0_node);
     plist_dict_set_item(res_node, "displays", displays_node);
 
-    plist_to_bin(res_node, response_data, (uint32_t *) response_datalen);
+    plist_to_bin(res_node, data, (uint32_t *) datalen);
     plist_free(res_node);
-    http_response_add_header(response, "Content-Type", "application/x-apple-binary-plist");
     free(pk);
     free(hw_addr);
 }
 
+static void
+raop_handler_info(raop_conn_t *conn,
+                  http_request_t *request, http_response_t *response,
+                  char **response_data, int *response_datalen)
+{
+    raop_t *raop = conn->raop;
+    assert(raop->dnssd);
+
+#if 0
+    /* initial GET/info request sends plist with string "txtAirPlay" */
+    bool txtAirPlay = false;
+    const char* content_type =  NULL;
+    content_type = http_request_get_known_header(request, HTTP_HEADER_CONTENT_TYPE);
+    if (content_type && strstr(content_type, "application/x-apple-binary-plist")) {
+        char *qualifier_string = NULL;
+        const char *data = NULL;
+        int data_len = 0;
+        data = http_request_get_data(request, &data_len);
+        //parsing bplist
+        plist_t req_root_node = NULL;
+        plist_from_bin(data, data_len, &req_root_node);
+        plist_t req_qualifier_node = plist_dict_get_item(req_root_node, "qualifier");
+        if (PLIST_IS_ARRAY(req_qualifier_node)) {
+            plist_t req_string_node = plist_array_get_item(req_qualifier_node, 0);
+            plist_get_string_val(req_string_node, &qualifier_string);
+        }
+        if (qualifier_string && !strcmp(qualifier_string, "txtAirPlay")) {
+	    printf("qualifier: %s\n", qualifier_string);
+	    txtAirPlay = true;
+        }
+	if (qualifier_string) {
+            free(qualifier_string);
+	}
+    }
+#endif
+    int airplay_txt_len = 0;
+    const char *airplay_txt = dnssd_get_airplay_txt(raop->dnssd, &airplay_txt_len);
+    uint64_t features = dnssd_get_airplay_features(raop->dnssd);
+
+    MUTEX_LOCK(raop->info_mutex);
+    if (raop->info_data && (features != raop->info_features || airplay_txt_len != raop->info_airplay_txt_len ||
+                            (airplay_txt_len && memcmp(airplay_txt, raop->info_airplay_txt, airplay_txt_len)))) {
+        free(raop->info_data);
+        raop->info_data = NULL;
+        free(raop->info_airplay_txt);
+        raop->info_airplay_txt = NULL;
+    }
+    if (!raop->info_data) {
+        raop_info_build(raop, &raop->info_data, &raop->info_datalen);
+        raop->info_airplay_txt = malloc(airplay_txt_len ? airplay_txt_len : 1);
+        assert(raop->info_airplay_txt);
+        if (airplay_txt_len) {
+            memcpy(raop->info_airplay_txt, airplay_txt, airplay_txt_len);
+        }
+        raop->info_airplay_txt_len = airplay_txt_len;
+        raop->info_features = features;
+    }
+    *response_data = NULL;
+    *response_datalen = 0;
+    if (raop->info_data) {
+        *response_data = malloc(raop->info_datalen);
+        assert(*response_data);
+        memcpy(*response_data, raop->info_data, raop->info_datalen);
+        *response_datalen = raop->info_datalen;
+    }
+    MUTEX_UNLOCK(raop->info_mutex);
+    http_response_add_header(response, "Content-Type", "application/x-apple-binary-plist");
+}
+
 static void
 raop_handler_pairpinstart(raop_conn_t *conn,
                           http_request_t *request, http_response_t *response,
@@ -460,7 +515,10 @@ raop_handler_pairverify(raop_conn_t *conn,
 		    const unsigned char *pk = data + 4 + X25519_KEY_SIZE;
 		    char *pk64;
 		    ed25519_pk_to_base64(pk, &pk64);
+                    /* pair-verify is a parallel route */
+                    MUTEX_LOCK(conn->raop->handler_mutex);
                     registered_client = conn->raop->callbacks.check_register(conn->raop->callbacks.cls, pk64);
+                    MUTEX_UNLOCK(conn->raop->handler_mutex);
 		    free (pk64);
                 }
 
@@ -554,8 +612,8 @@ raop_handler_setup(raop_conn_t *conn,
     int data_len = 0;
     data = http_request_get_data(request, &data_len);
 
-    dacp_id = http_request_get_header(request, "DACP-ID");
-    active_remote_header = http_request_get_header(request, "Active-Remote");
+    dacp_id = http_request_get_known_header(request, HTTP_HEADER_DACP_ID);
+    active_remote_header = http_request_get_known_header(request, HTTP_HEADER_ACTIVE_REMOTE);
 
     if (dacp_id && active_remote_header) {
         logger_log(conn->raop->logger, LOGGER_DEBUG, "DACP-ID: %s", dacp_id);
@@ -630,7 +688,7 @@ raop_handler_setup(raop_conn_t *conn,
                 char nonce_string[33] = { '\0' };
                 //bool stale = false;  //not implemented
                 const char *authorization = NULL;
-                authorization = http_request_get_header(request, "Authorization");
+                authorization = http_request_get_known_header(request, HTTP_HEADER_AUTHORIZATION);
                 if (authorization) {
                     char *ptr = strstr(authorization, "nonce=\"") +  strlen("nonce=\"");
                     strncpy(nonce_string, ptr, 32);
@@ -863,7 +921,11 @@ raop_handler_setup(raop_conn_t *conn,
                                        conn->remotelen, (unsigned short) timing_rport, &time_protocol);
         raop_ntp_start(conn->raop_ntp, &timing_lport);
         conn->raop_rtp = raop_rtp_init(conn->raop->logger, &conn->raop->callbacks, conn->raop_ntp,
-                                       remote, conn->remotelen, aeskey, aesiv);
+                                       remote, conn->remotelen, aeskey, aesiv, conn->raop->audio_buffer_depth);
+        if (conn->raop_rtp && conn->raop->adaptive_delay) {
+            raop_rtp_set_adaptive_delay(conn->raop_rtp, -1000 * (int64_t) conn->raop->adaptive_delay_min,
+                                        1000 * (int64_t) conn->raop->adaptive_delay_max);
+        }
         conn->raop_rtp_mirror = raop_rtp_mirror_init(conn->raop->logger, &conn->raop->callbacks,
                                                      conn->raop_ntp, remote, conn->remotelen, aeskey);
 
@@ -901,7 +963,8 @@ raop_handler_setup(raop_conn_t *conn,
                                " key and iv): %llu", stream_connection_id);
 
                     if (conn->raop_rtp_mirror) {
-                        raop_rtp_mirror_init_aes(conn->raop_rtp_mirror, &stream_connection_id);
+                        raop_rtp_mirror_init_aes(conn->raop_rtp_mirror, &stream_connection_id,
+                                                 conn->raop->video_decrypt_threads);
                         raop_rtp_mirror_start(conn->raop_rtp_mirror, &dport, conn->raop->clientFPSdata);
                         logger_log(conn->raop->logger, LOGGER_DEBUG, "Mirroring initialized successfully");
                     } else {
@@ -1012,7 +1075,7 @@ raop_handler_get_parameter(raop_conn_t *conn,
     const char *data;
     int datalen;
 
-    content_type = http_request_get_header(request, "Content-Type");
+    content_type = http_request_get_known_header(request, HTTP_HEADER_CONTENT_TYPE);
     if (!content_type) {
         http_response_init(response, "RTSP/1.0", 451, "Parameter not understood");
         return;
@@ -1065,7 +1128,7 @@ raop_handler_set_parameter(raop_conn_t *conn,
     const char *data;
     int datalen;
 
-    content_type = http_request_get_header(request, "Content-Type");
+    content_type = http_request_get_known_header(request, HTTP_HEADER_CONTENT_TYPE);
     if (!content_type) {
         http_response_init(response, "RTSP/1.0", 451, "Parameter not understood");
         return;
@@ -24,6 +24,7 @@
 #include <string.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <stdatomic.h>
 #ifdef _WIN32
 #define CAST (char *)
 #else
@@ -47,6 +48,29 @@
 
 #define RAOP_NTP_CLOCK_BASE (2208988800ull << 32)
 
+/* Timing requests are sent every RAOP_NTP_INTERVAL_SECS, except during a burst of      *
+ * RAOP_NTP_BURST_COUNT rapid exchanges (which fills the filter of RAOP_NTP_DATA_COUNT   *
+ * samples) at the start of a session, and after a step in the clock offset is detected */
+#define RAOP_NTP_INTERVAL_SECS 3
+#define RAOP_NTP_BURST_COUNT RAOP_NTP_DATA_COUNT
+#define RAOP_NTP_BURST_INTERVAL_MSECS 50
+/* a sample with a round trip delay below the threshold whose offset differs from the *
+ * current offset by more than the threshold is taken as a step in the clock offset   */
+#define RAOP_NTP_STEP_THRESHOLD (20 * (int64_t) 1000000)
+
+/* The drift (frequency offset) of the remote clock is the least-squares slope of up to     *
+ * RAOP_NTP_DRIFT_COUNT offset samples, using those with a round trip delay close to the    *
+ * best one in the filter.  Offset corrections are slewed at up to RAOP_NTP_MAX_SLEW_PPM   */
+#define RAOP_NTP_DRIFT_COUNT 32
+#define RAOP_NTP_DRIFT_MIN_COUNT 4
+#define RAOP_NTP_DRIFT_MIN_SPAN (10 * (int64_t) SECOND_IN_NSECS)
+#define RAOP_NTP_DRIFT_DELAY_TOLERANCE (1 * (int64_t) 1000000)
+#define RAOP_NTP_MAX_SKEW 500.0e-6
+#define RAOP_NTP_MAX_SLEW_PPM 500
+
+/* The clock used for all local times (see raop_ntp_set_local_clock) */
+static clockid_t local_clock_id = CLOCK_REALTIME;
+
 typedef struct raop_ntp_data_s {
     uint64_t time; // The local wall clock time at time of ntp packet arrival
     uint64_t dispersion;
@@ -54,6 +78,26 @@ typedef struct raop_ntp_data_s {
     int64_t offset; // The difference between remote and local wall clock time
 } raop_ntp_data_t;
 
+typedef struct raop_ntp_drift_s {
+    uint64_t time; // The local wall clock time at the midpoint of the exchange
+    int64_t offset;
+} raop_ntp_drift_t;
+
+/* The clock model: (remote - local wall clock time) at local time t is offset + skew * (t - ref_time),   *
+ * plus a correction slew that is applied linearly over the slew_time nanoseconds following ref_time      */
+typedef struct raop_ntp_sync_params_s {
+    uint64_t ref_time;
+    int64_t offset;
+    double skew; // The frequency offset of the remote clock (1.0e-6 is 1 ppm)
+    int64_t slew;
+    int64_t slew_time;
+    int64_t dispersion;
+    int64_t delay;
+} raop_ntp_sync_params_t;
+
+#define RAOP_NTP_SYNC_WORDS (sizeof(raop_ntp_sync_params_t) / sizeof(uint32_t))
+_Static_assert(sizeof(raop_ntp_sync_params_t) % sizeof(uint32_t) == 0, "sync params must be a whole number of words");
+
 struct raop_ntp_s {
     logger_t *logger;
     raop_callbacks_t callbacks;
@@ -66,12 +110,18 @@ struct raop_ntp_s {
 
     raop_ntp_data_t data[RAOP_NTP_DATA_COUNT];
     int data_index;
+    int burst_remaining;
+
+    raop_ntp_drift_t drift[RAOP_NTP_DRIFT_COUNT];
+    int drift_index;
+    int drift_count;
 
-    // The clock sync params are periodically updated to the AirPlay client's NTP clock
-    mutex_handle_t sync_params_mutex;
-    int64_t sync_offset;
-    int64_t sync_dispersion;
-    int64_t sync_delay;
+    // The clock sync params are periodically updated to the AirPlay client's NTP clock.
+    // They are only written by raop_ntp_thread, which publishes copies of them to other
+    // threads through a seqlock: sync_seq is odd while sync_words are being updated
+    raop_ntp_sync_params_t sync;
+    atomic_uint sync_seq;
+    atomic_uint sync_words[RAOP_NTP_SYNC_WORDS];
 
     // Socket address of the AirPlay client
     struct sockaddr_storage remote_saddr;
@@ -147,6 +197,121 @@ raop_ntp_parse_remote(raop_ntp_t *raop_ntp, const char *remote, int remote_addr_
     return 0;
 }
 
+/* (remote - local wall clock time) at local time "time", according to the clock model */
+static int64_t
+raop_ntp_sync_offset(const raop_ntp_sync_params_t *sync, uint64_t time)
+{
+    int64_t dt = (int64_t) (time - sync->ref_time);
+    int64_t offset = sync->offset + (int64_t) (sync->skew * (double) dt);
+    if (dt >= sync->slew_time) {
+        offset += sync->slew;
+    } else if (dt > 0) {
+        offset += (int64_t) ((double) sync->slew * (double) dt / (double) sync->slew_time);
+    }
+    return offset;
+}
+
+/* seqlock writer (raop_ntp_thread only) */
+static void
+raop_ntp_publish_sync(raop_ntp_t *raop_ntp)
+{
+    uint32_t words[RAOP_NTP_SYNC_WORDS];
+    memcpy(words, &raop_ntp->sync, sizeof(words));
+    unsigned int seq = atomic_load_explicit(&raop_ntp->sync_seq, memory_order_relaxed);
+    atomic_store_explicit(&raop_ntp->sync_seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    for (unsigned int i = 0; i < RAOP_NTP_SYNC_WORDS; i++) {
+        atomic_store_explicit(&raop_ntp->sync_words[i], words[i], memory_order_relaxed);
+    }
+    atomic_store_explicit(&raop_ntp->sync_seq, seq + 2, memory_order_release);
+}
+
+/* seqlock reader: never blocks, but retries if raop_ntp_thread published an update during the copy */
+static void
+raop_ntp_read_sync(raop_ntp_t *raop_ntp, raop_ntp_sync_params_t *sync)
+{
+    uint32_t words[RAOP_NTP_SYNC_WORDS];
+    unsigned int seq0, seq1;
+    do {
+        seq0 = atomic_load_explicit(&raop_ntp->sync_seq, memory_order_acquire);
+        for (unsigned int i = 0; i < RAOP_NTP_SYNC_WORDS; i++) {
+            words[i] = atomic_load_explicit(&raop_ntp->sync_words[i], memory_order_relaxed);
+        }
+        atomic_thread_fence(memory_order_acquire);
+        seq1 = atomic_load_explicit(&raop_ntp->sync_seq, memory_order_relaxed);
+    } while ((seq0 & 1) || seq0 != seq1);
+    memcpy(sync, words, sizeof(words));
+}
+
+static void
+raop_ntp_add_drift_sample(raop_ntp_t *raop_ntp, uint64_t time, int64_t offset)
+{
+    if (raop_ntp->drift_count) {
+        raop_ntp->drift_index = (raop_ntp->drift_index + 1) % RAOP_NTP_DRIFT_COUNT;
+    }
+    if (raop_ntp->drift_count < RAOP_NTP_DRIFT_COUNT) {
+        raop_ntp->drift_count++;
+    }
+    raop_ntp->drift[raop_ntp->drift_index].time = time;
+    raop_ntp->drift[raop_ntp->drift_index].offset = offset;
+}
+
+/* least-squares fit of the drift samples: returns false if there are not yet enough of them,  *
+ * otherwise the fitted offset at local time "now" and the skew (clamped to RAOP_NTP_MAX_SKEW) */
+static bool
+raop_ntp_fit_drift(raop_ntp_t *raop_ntp, uint64_t now, int64_t *offset, double *skew)
+{
+    if (raop_ntp->drift_count < RAOP_NTP_DRIFT_MIN_COUNT) {
+        return false;
+    }
+    // Use times in seconds relative to now and offsets relative to the newest sample, to keep the precision of doubles
+    int64_t offset_ref = raop_ntp->drift[raop_ntp->drift_index].offset;
+    int64_t span = 0;
+    double sx = 0.0, sy = 0.0, sxx = 0.0, sxy = 0.0;
+    for (int i = 0; i < raop_ntp->drift_count; i++) {
+        int64_t dt = (int64_t) (raop_ntp->drift[i].time - now);
+        double x = (double) dt / SECOND_IN_NSECS;
+        double y = (double) (raop_ntp->drift[i].offset - offset_ref);
+        sx += x;
+        sy += y;
+        sxx += x * x;
+        sxy += x * y;
+        if (-dt > span) {
+            span = -dt;
+        }
+    }
+    double n = (double) raop_ntp->drift_count;
+    double denom = n * sxx - sx * sx;
+    if (span < RAOP_NTP_DRIFT_MIN_SPAN || denom <= 0.0) {
+        return false;
+    }
+    double slope = (n * sxy - sx * sy) / denom;  // nanoseconds per second
+    if (slope > RAOP_NTP_MAX_SKEW * SECOND_IN_NSECS) {
+        slope = RAOP_NTP_MAX_SKEW * SECOND_IN_NSECS;
+    } else if (slope < -RAOP_NTP_MAX_SKEW * SECOND_IN_NSECS) {
+        slope = -RAOP_NTP_MAX_SKEW * SECOND_IN_NSECS;
+    }
+    *skew = slope / SECOND_IN_NSECS;
+    *offset = offset_ref + (int64_t) ((sy - slope * sx) / n);
+    return true;
+}
+
+/* empty the filter of timing samples and the drift estimator */
+static void
+raop_ntp_reset_data(raop_ntp_t *raop_ntp)
+{
+    uint64_t time = raop_ntp_get_local_time();
+    raop_ntp->drift_index = 0;
+    raop_ntp->drift_count = 0;
+
+    for (int i = 0; i < RAOP_NTP_DATA_COUNT; ++i) {
+        raop_ntp->data[i].offset     = 0ll;
+        raop_ntp->data[i].delay      = RAOP_NTP_MAX_DISP;
+        raop_ntp->data[i].dispersion = RAOP_NTP_MAX_DISP;
+        raop_ntp->data[i].time      = time;
+    }
+}
+
 raop_ntp_t *raop_ntp_init(logger_t *logger, raop_callbacks_t *callbacks, const char *remote,
                           int remote_addr_len, unsigned short timing_rport, timing_protocol_t *time_protocol) {
     raop_ntp_t *raop_ntp;
@@ -177,23 +342,15 @@ raop_ntp_t *raop_ntp_init(logger_t *logger, raop_callbacks_t *callbacks, const c
     raop_ntp->running = 0;
     raop_ntp->joined = 1;
 
-    uint64_t time = raop_ntp_get_local_time();
-
-    for (int i = 0; i < RAOP_NTP_DATA_COUNT; ++i) {
-        raop_ntp->data[i].offset     = 0ll;
-        raop_ntp->data[i].delay      = RAOP_NTP_MAX_DISP;
-        raop_ntp->data[i].dispersion = RAOP_NTP_MAX_DISP;
-        raop_ntp->data[i].time      = time;
-    }
-
-    raop_ntp->sync_delay = 0;
-    raop_ntp->sync_dispersion = 0;
-    raop_ntp->sync_offset = 0;
+    raop_ntp_reset_data(raop_ntp);
 
     MUTEX_CREATE(raop_ntp->run_mutex);
     MUTEX_CREATE(raop_ntp->wait_mutex);
     COND_CREATE(raop_ntp->wait_cond);
-    MUTEX_CREATE(raop_ntp->sync_params_mutex);
+    atomic_init(&raop_ntp->sync_seq, 0);
+    for (unsigned int i = 0; i < RAOP_NTP_SYNC_WORDS; i++) {
+        atomic_init(&raop_ntp->sync_words[i], 0);
+    }
     return raop_ntp;
 }
 
@@ -205,7 +362,6 @@ raop_ntp_destroy(raop_ntp_t *raop_ntp)
         MUTEX_DESTROY(raop_ntp->run_mutex);
         MUTEX_DESTROY(raop_ntp->wait_mutex);
         COND_DESTROY(raop_ntp->wait_cond);
-        MUTEX_DESTROY(raop_ntp->sync_params_mutex);
         free(raop_ntp);
     }
 }
@@ -288,7 +444,9 @@ raop_ntp_thread(void *arg)
     const unsigned  two_pow_n[RAOP_NTP_DATA_COUNT] = {2, 4, 8, 16, 32, 64, 128, 256};
     bool logger_debug = (logger_get_level(raop_ntp->logger) >= LOGGER_DEBUG);
     uint64_t recv_time = 0, client_ref_time = 0;
+    bool synced = false;
 
+    raop_ntp->burst_remaining = RAOP_NTP_BURST_COUNT;
     while (1) {
         MUTEX_LOCK(raop_ntp->run_mutex);
         if (!raop_ntp->running) {
@@ -300,12 +458,13 @@ raop_ntp_thread(void *arg)
         // Flush the socket in case a super delayed response arrived or something
         raop_ntp_flush_socket(raop_ntp->tsock);
 
-        // Send request
+        // Send request (timestamps on the wire are always Unix time)
+        int64_t realtime_offset = raop_ntp_get_realtime_offset();
         uint64_t send_time = raop_ntp_get_local_time();
-        byteutils_put_ntp_timestamp(request, 24, send_time);
+        byteutils_put_ntp_timestamp(request, 24, send_time + realtime_offset);
         if (recv_time) {
             byteutils_put_long_be(request, 8, client_ref_time);
-            byteutils_put_ntp_timestamp(request, 16, recv_time);
+            byteutils_put_ntp_timestamp(request, 16, recv_time + realtime_offset);
         }
         int send_len = sendto(raop_ntp->tsock, (char *)request, sizeof(request), 0,
                               (struct sockaddr *) &raop_ntp->remote_saddr, raop_ntp->remote_saddr_len);
@@ -336,7 +495,7 @@ raop_ntp_thread(void *arg)
                 int64_t t3 = (int64_t) recv_time;
 
                 // Local time of the server when the NTP request packet leaves the server
-                int64_t t0 = (int64_t) byteutils_get_ntp_timestamp(response, 8);
+                int64_t t0 = (int64_t) byteutils_get_ntp_timestamp(response, 8) - realtime_offset;
 
                 // Local time of the client when the NTP request packet arrives at the client
                 int64_t t1 = (int64_t) raop_remote_timestamp_to_nano_seconds(raop_ntp, byteutils_get_long_be(response, 16));
@@ -356,10 +515,21 @@ raop_ntp_thread(void *arg)
                 // For a little bonus confusion, they add SECONDS_FROM_1900_TO_1970.
                 // This means we have to expect some rather huge offset, but its growth or shrink over time should be small.
 
+                int64_t sample_offset = ((t1 - t0) + (t2 - t3)) / 2;
+                int64_t sample_delay = ((t3 - t0) - (t2 - t1));
+                int64_t sample_step = sample_offset - raop_ntp_sync_offset(&raop_ntp->sync, (uint64_t) t3);
+                if (synced && sample_delay < RAOP_NTP_STEP_THRESHOLD && llabs(sample_step) > RAOP_NTP_STEP_THRESHOLD) {
+                    // The older samples no longer describe the clock offset: discard them and resync in a burst
+                    logger_log(raop_ntp->logger, LOGGER_INFO, "raop_ntp detected a step of %8.6f secs in the clock offset",
+                               (double) sample_step / SECOND_IN_NSECS);
+                    raop_ntp_reset_data(raop_ntp);
+                    raop_ntp->burst_remaining = RAOP_NTP_BURST_COUNT;
+                }
+
                 raop_ntp->data_index = (raop_ntp->data_index + 1) % RAOP_NTP_DATA_COUNT;
                 raop_ntp->data[raop_ntp->data_index].time = t3;
-                raop_ntp->data[raop_ntp->data_index].offset     = ((t1 - t0) + (t2 - t3)) / 2;
-                raop_ntp->data[raop_ntp->data_index].delay      = ((t3 - t0) - (t2 - t1));
+                raop_ntp->data[raop_ntp->data_index].offset     = sample_offset;
+                raop_ntp->data[raop_ntp->data_index].delay      = sample_delay;
                 raop_ntp->data[raop_ntp->data_index].dispersion = RAOP_NTP_R_RHO + RAOP_NTP_S_RHO +  (t3 - t0) * RAOP_NTP_PHI_PPM / SECOND_IN_NSECS;
 
                 // Sort by delay
@@ -376,23 +546,56 @@ raop_ntp_thread(void *arg)
                     dispersion += disp / two_pow_n[i];
                 }
 
-                MUTEX_LOCK(raop_ntp->sync_params_mutex);
-
-                int64_t correction = offset - raop_ntp->sync_offset;
-                raop_ntp->sync_offset = offset;
-                raop_ntp->sync_dispersion = dispersion;
-                raop_ntp->sync_delay = delay;
-                MUTEX_UNLOCK(raop_ntp->sync_params_mutex);
+                // Exchanges with a round trip delay close to the best one in the filter are used to estimate the drift
+                if (sample_delay <= data_sorted[0].delay + RAOP_NTP_DRIFT_DELAY_TOLERANCE) {
+                    raop_ntp_add_drift_sample(raop_ntp, (uint64_t) (t0 + (t3 - t0) / 2), sample_offset);
+                }
+                double skew = raop_ntp->sync.skew;
+                if (!raop_ntp_fit_drift(raop_ntp, (uint64_t) t3, &offset, &skew)) {
+                    // Bring the best sample of the filter up to date with the current drift estimate
+                    offset += (int64_t) (skew * (double) (t3 - (int64_t) data_sorted[0].time));
+                }
 
-                logger_log(raop_ntp->logger, LOGGER_DEBUG, "raop_ntp sync correction = %lld", correction);
+                int64_t correction = offset - raop_ntp_sync_offset(&raop_ntp->sync, (uint64_t) t3);
+                if (synced && raop_ntp->burst_remaining == 0 && llabs(correction) <= RAOP_NTP_STEP_THRESHOLD) {
+                    // Slew: continue from the current model value, and apply the correction gradually
+                    raop_ntp->sync.offset = offset - correction;
+                    raop_ntp->sync.slew = correction;
+                    raop_ntp->sync.slew_time = llabs(correction) * (1000000 / RAOP_NTP_MAX_SLEW_PPM);
+                    if (raop_ntp->sync.slew_time < RAOP_NTP_INTERVAL_SECS * (int64_t) SECOND_IN_NSECS) {
+                        raop_ntp->sync.slew_time = RAOP_NTP_INTERVAL_SECS * (int64_t) SECOND_IN_NSECS;
+                    }
+                } else {
+                    // Step, while the filter is being filled
+                    raop_ntp->sync.offset = offset;
+                    raop_ntp->sync.slew = 0;
+                    raop_ntp->sync.slew_time = 0;
+                }
+                raop_ntp->sync.ref_time = (uint64_t) t3;
+                raop_ntp->sync.skew = skew;
+                raop_ntp->sync.dispersion = dispersion;
+                raop_ntp->sync.delay = delay;
+                raop_ntp_publish_sync(raop_ntp);
+                synced = true;
+
+                logger_log(raop_ntp->logger, LOGGER_DEBUG, "raop_ntp sync correction = %lld, drift = %.3f ppm",
+                           correction, skew * 1.0e6);
             }
         }
 
-        // Sleep for 3 seconds
+        // Sleep until the next request: a short interval during a burst, otherwise 3 seconds
         struct timespec wait_time;
         MUTEX_LOCK(raop_ntp->wait_mutex);
         clock_gettime(CLOCK_REALTIME, &wait_time);
-        wait_time.tv_sec += 3;
+        if (raop_ntp->burst_remaining > 0 && --raop_ntp->burst_remaining > 0) {
+            wait_time.tv_nsec += RAOP_NTP_BURST_INTERVAL_MSECS * 1000000L;
+            if (wait_time.tv_nsec >= (long) SECOND_IN_NSECS) {
+                wait_time.tv_nsec -= (long) SECOND_IN_NSECS;
+                wait_time.tv_sec++;
+            }
+        } else {
+            wait_time.tv_sec += RAOP_NTP_INTERVAL_SECS;
+        }
         pthread_cond_timedwait(&raop_ntp->wait_cond, &raop_ntp->wait_mutex, &wait_time);
         MUTEX_UNLOCK(raop_ntp->wait_mutex);
     }
@@ -498,16 +701,41 @@ uint64_t raop_remote_timestamp_to_nano_seconds(raop_ntp_t *raop_ntp, uint64_t ti
     uint64_t fraction = (timestamp & 0xffffffff);
     return (seconds * SECOND_IN_NSECS) + ((fraction * SECOND_IN_NSECS) >> 32);
 }
+/**
+ * Selects the clock used as the local wall clock: CLOCK_REALTIME (the default), or a clock
+ * that is not stepped when the system time is changed, such as CLOCK_MONOTONIC or CLOCK_TAI.
+ * It must be called before any connection is made, and match the clock used by the renderers.
+ */
+void raop_ntp_set_local_clock(clockid_t clock_id) {
+    local_clock_id = clock_id;
+}
+
 /**
  * Returns the current time in nano seconds according to the local wall clock.
- * The system Unix time is used as the local wall clock.
+ * The system Unix time is used as the local wall clock, unless another clock was selected.
  */
 uint64_t raop_ntp_get_local_time() {
     struct timespec time;
-    clock_gettime(CLOCK_REALTIME, &time);
+    clock_gettime(local_clock_id, &time);
     return ((uint64_t) time.tv_nsec) + (uint64_t) time.tv_sec * SECOND_IN_NSECS;
 }
 
+/**
+ * Returns the current difference (Unix time - local wall clock time) in nano seconds, which is
+ * used to convert local times to and from the Unix times used in protocol packets and by the kernel.
+ */
+int64_t raop_ntp_get_realtime_offset() {
+    if (local_clock_id == CLOCK_REALTIME) {
+        return 0;
+    }
+    struct timespec time;
+    uint64_t local_before = raop_ntp_get_local_time();
+    clock_gettime(CLOCK_REALTIME, &time);
+    uint64_t local_after = raop_ntp_get_local_time();
+    uint64_t realtime = ((uint64_t) time.tv_nsec) + (uint64_t) time.tv_sec * SECOND_IN_NSECS;
+    return (int64_t) (realtime - (local_before + (local_after - local_before) / 2));
+}
+
 /**
  * Returns the current time in nano seconds according to the remote wall clock.
  */
@@ -515,10 +743,11 @@ uint64_t raop_ntp_get_remote_time(raop_ntp_t *raop_ntp) {
     if  (!raop_ntp->client_time_received) {
         return 0;
     }
-    MUTEX_LOCK(raop_ntp->sync_params_mutex);
-    int64_t offset = raop_ntp->sync_offset;
-    MUTEX_UNLOCK(raop_ntp->sync_params_mutex);
-    return (uint64_t) ((int64_t) raop_ntp_get_local_time() + offset);
+    uint64_t local_time = raop_ntp_get_local_time();
+    raop_ntp_sync_params_t sync;
+    raop_ntp_read_sync(raop_ntp, &sync);
+    int64_t offset = raop_ntp_sync_offset(&sync, local_time);
+    return (uint64_t) ((int64_t) local_time + offset);
 }
 
 /**
@@ -528,9 +757,10 @@ uint64_t raop_ntp_convert_remote_time(raop_ntp_t *raop_ntp, uint64_t remote_time
     if  (!raop_ntp->client_time_received) {
         return 0;
     }
-    MUTEX_LOCK(raop_ntp->sync_params_mutex);
-    int64_t offset = raop_ntp->sync_offset;
-    MUTEX_UNLOCK(raop_ntp->sync_params_mutex);
+    raop_ntp_sync_params_t sync;
+    raop_ntp_read_sync(raop_ntp, &sync);
+    // the model is evaluated at an estimate of the local time, which only differs from it by a drift correction
+    int64_t offset = raop_ntp_sync_offset(&sync, (uint64_t) ((int64_t) remote_time - sync.offset));
     return (uint64_t) ((int64_t) remote_time - offset);
 }
 
@@ -541,8 +771,17 @@ uint64_t raop_ntp_convert_local_time(raop_ntp_t *raop_ntp, uint64_t local_time)
     if  (!raop_ntp->client_time_received) {
         return 0;
     }
-    MUTEX_LOCK(raop_ntp->sync_params_mutex);
-    int64_t offset = raop_ntp->sync_offset;
-    MUTEX_UNLOCK(raop_ntp->sync_params_mutex);
+    raop_ntp_sync_params_t sync;
+    raop_ntp_read_sync(raop_ntp, &sync);
+    int64_t offset = raop_ntp_sync_offset(&sync, local_time);
     return (uint64_t) ((int64_t) local_time + offset);
 }
+
+/**
+ * Returns the estimated drift of the remote clock relative to the local wall clock, in ppm
+ */
+double raop_ntp_get_drift_ppm(raop_ntp_t *raop_ntp) {
+    raop_ntp_sync_params_t sync;
+    raop_ntp_read_sync(raop_ntp, &sync);
+    return sync.skew * 1.0e6;
+}
@@ -21,6 +21,7 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <time.h>
 #include "logger.h"
 
 typedef struct raop_ntp_s raop_ntp_t;
@@ -38,10 +39,13 @@ void raop_ntp_destroy(raop_ntp_t *raop_rtp);
 uint64_t raop_ntp_timestamp_to_nano_seconds(uint64_t ntp_timestamp, bool account_for_epoch_diff);
 uint64_t raop_remote_timestamp_to_nano_seconds(raop_ntp_t *raop_ntp, uint64_t timestamp);
 
+void raop_ntp_set_local_clock(clockid_t clock_id);
 uint64_t raop_ntp_get_local_time();
+int64_t raop_ntp_get_realtime_offset();
 uint64_t raop_ntp_get_remote_time(raop_ntp_t *raop_ntp);
 uint64_t raop_ntp_convert_remote_time(raop_ntp_t *raop_ntp, uint64_t remote_time);
 uint64_t raop_ntp_convert_local_time(raop_ntp_t *raop_ntp, uint64_t local_time);
+double raop_ntp_get_drift_ppm(raop_ntp_t *raop_ntp);
 
 void  raop_ntp_set_video_arrival_offset(raop_ntp_t* raop_ntp, const uint64_t *offset);
 uint64_t raop_ntp_get_video_arrival_offset(raop_ntp_t* raop_ntp);
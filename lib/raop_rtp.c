@@ -15,6 +15,11 @@
  * modified by fduncanh 2021-2023
  */
 
+/* recvmmsg() is a GNU extension */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -22,6 +27,28 @@
 #include <errno.h>
 #include <stdbool.h>
 
+/* On Linux, all packets waiting on a socket are received by recvmmsg() in batches, with   *
+ * their kernel arrival timestamps (SO_TIMESTAMPNS).  Elsewhere, one packet is received     *
+ * per socket per select() wakeup, and timestamped when recvfrom() returns.                */
+#ifdef __linux__
+#define RTP_USE_RECVMMSG
+#define RAOP_RTP_RECV_BATCH 16
+/* a full batch means more packets may be waiting (recvmmsg does not block) */
+#define RAOP_RTP_RECV_MORE(batch) ((batch)->count == RAOP_RTP_RECV_BATCH)
+#else
+#define RAOP_RTP_RECV_BATCH 1
+/* recvfrom() on the blocking socket: only read again after select() */
+#define RAOP_RTP_RECV_MORE(batch) false
+#endif
+
+/* On Linux, the thread blocks in select() with no timeout, and is woken through an eventfd *
+ * when a control change (volume, flush, metadata, ...) or a stop request is posted.        *
+ * Elsewhere it polls with a 5 msec select() timeout, checking for changes each time.       */
+#ifdef __linux__
+#define RTP_USE_EVENTFD
+#include <sys/eventfd.h>
+#endif
+
 #include "raop_rtp.h"
 #include "raop.h"
 #include "raop_buffer.h"
@@ -38,6 +65,25 @@
 #define SECOND_IN_NSECS 1000000000
 #define SEC SECOND_IN_NSECS
 
+/* interval between audio_report_stats callbacks while streaming */
+#define RAOP_RTP_STATS_INTERVAL (10 * (uint64_t) SEC)
+
+/* the adaptive playout delay target is updated from the packets received in each window */
+#define PLAYOUT_WINDOW (2 * (uint64_t) SEC)
+#define PLAYOUT_GUARD (5 * (int64_t) 1000000)   /* 5 msecs */
+
+/* packet-loss concealment */
+#define SPF_AAC_ELD 480
+#define SPF_ALAC 352
+#define CONCEAL_MAX_GAP 32
+#define CONCEAL_MAX_REPEATS 2
+/* an uncompressed stereo 16-bit ALAC frame of SPF_ALAC zero samples: a 23-bit header, the samples, *
+ * and the 3-bit END tag                                                                           */
+#define ALAC_SILENCE_BITS (23 + SPF_ALAC * 2 * 16 + 3)
+#define ALAC_SILENCE_LEN ((ALAC_SILENCE_BITS + 7) / 8)
+/* room for ALAC silence or a copy of a (smaller) AAC-ELD frame */
+#define CONCEAL_FRAME_LEN 2048
+
 #define DELAY_AAC  0.20 //empirical, matches audio latency of about -0.25 sec after first clock sync event
 
 /* note: it is unclear what will happen in the unlikely event that this code is running at the time of the unix-time 
@@ -65,13 +111,33 @@ struct raop_rtp_s {
     uint64_t client_ntp_sync;
     bool initial_sync;
 
-    // Transmission Stats, could be used if a playout buffer is needed
-    // float interarrival_jitter; // As defined by RTP RFC 3550, Section 6.4.1
-    // unsigned int last_packet_transit_time;
-    //int transit = (packet_receive_time - packet_send_time);
-    // int d = transit - last_packet_transit_time;
-    // if (d < 0) d = -d;
-    // interarrival_jitter = (1.f / 16.f) * ((double) d - interarrival_jitter);
+    // Transmission Stats: interarrival jitter (nsecs) as defined by RTP RFC 3550, Section 6.4.1
+    double interarrival_jitter;
+    bool have_transit;
+    uint64_t last_arrival_time;
+    uint32_t last_rtp_timestamp;
+    uint64_t last_stats_report;
+
+    /* Adaptive playout delay: a shift (nsecs) added to audio timestamps, kept in [min, max]  *
+     * so that packets still arrive (or are resent) with a safety margin before being played */
+    bool adaptive_delay;
+    int64_t playout_shift_min;
+    int64_t playout_shift_max;
+    int64_t playout_shift;
+    int64_t playout_shift_target;
+    int64_t headroom_min;             /* least (playout time - arrival time) in the current window */
+    uint64_t headroom_window_start;
+    bool playout_resync;              /* apply the target shift at once, at the next packet */
+
+    /* Packet-loss concealment: the last rendered packet, and the frame used to replace lost packets *
+     * (a silent frame for ALAC, a copy of the last AAC-ELD frame, which is repeated at most        *
+     * CONCEAL_MAX_REPEATS times in a row)                                                          */
+    bool have_rendered;
+    unsigned short rendered_seqnum;
+    uint32_t rendered_rtp_timestamp;
+    unsigned char conceal_frame[CONCEAL_FRAME_LEN];
+    unsigned int conceal_frame_len;
+    uint64_t packets_concealed;
 
     /* Buffer to handle all resends */
     raop_buffer_t *buffer;
@@ -103,6 +169,9 @@ struct raop_rtp_s {
     mutex_handle_t run_mutex;
     /* MUTEX LOCKED VARIABLES END */
 
+    /* eventfd used to wake the thread when there are changes to process (-1 if not used) */
+    int event_fd;
+
     /* Remote control and timing ports */
     unsigned short control_rport;
 
@@ -148,7 +217,7 @@ raop_rtp_parse_remote(raop_rtp_t *raop_rtp, const char *remote, int remotelen)
 
 raop_rtp_t *
 raop_rtp_init(logger_t *logger, raop_callbacks_t *callbacks, raop_ntp_t *ntp, const char *remote, 
-              int remotelen, const unsigned char *aeskey, const unsigned char *aesiv)
+              int remotelen, const unsigned char *aeskey, const unsigned char *aesiv, int buffer_depth)
 {
     raop_rtp_t *raop_rtp;
 
@@ -177,7 +246,7 @@ raop_rtp_init(logger_t *logger, raop_callbacks_t *callbacks, raop_ntp_t *ntp, co
     raop_rtp->coverart = NULL;
 
     memcpy(&raop_rtp->callbacks, callbacks, sizeof(raop_callbacks_t));
-    raop_rtp->buffer = raop_buffer_init(logger, aeskey, aesiv);
+    raop_rtp->buffer = raop_buffer_init(logger, aeskey, aesiv, buffer_depth);
     if (!raop_rtp->buffer) {
         free(raop_rtp);
         return NULL;
@@ -190,6 +259,18 @@ raop_rtp_init(logger_t *logger, raop_callbacks_t *callbacks, raop_ntp_t *ntp, co
     raop_rtp->running = 0;
     raop_rtp->joined = 1;
     raop_rtp->flush = NO_FLUSH;
+    raop_rtp->event_fd = -1;
+#ifdef RTP_USE_EVENTFD
+    raop_rtp->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (raop_rtp->event_fd == -1) {
+        int sock_err = SOCKET_GET_ERROR();
+        logger_log(raop_rtp->logger, LOGGER_ERR, "raop_rtp could not create eventfd %d %s",
+                   sock_err, SOCKET_ERROR_STRING(sock_err));
+        raop_buffer_destroy(raop_rtp->buffer);
+        free(raop_rtp);
+        return NULL;
+    }
+#endif
 
     MUTEX_CREATE(raop_rtp->run_mutex);
     return raop_rtp;
@@ -207,10 +288,24 @@ raop_rtp_destroy(raop_rtp_t *raop_rtp)
         free(raop_rtp->coverart);
         free(raop_rtp->dacp_id);
         free(raop_rtp->active_remote_header);
+#ifdef RTP_USE_EVENTFD
+        close(raop_rtp->event_fd);
+#endif
         free(raop_rtp);
     }
 }
 
+/* wake the thread to process a change posted under run_mutex */
+static void
+raop_rtp_wake(raop_rtp_t *raop_rtp)
+{
+#ifdef RTP_USE_EVENTFD
+    eventfd_write(raop_rtp->event_fd, 1);
+#else
+    (void) raop_rtp;
+#endif
+}
+
 static int
 raop_rtp_resend_callback(void *opaque, unsigned short seqnum, unsigned short count)
 {
@@ -259,6 +354,17 @@ raop_rtp_init_sockets(raop_rtp_t *raop_rtp, int use_ipv6)
         goto sockets_cleanup;
     }
 
+#ifdef RTP_USE_RECVMMSG
+    /* ask the kernel to timestamp packet arrival (always CLOCK_REALTIME, see raop_ntp_get_realtime_offset()) */
+    int on = 1;
+    if (setsockopt(csock, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) == -1 ||
+        setsockopt(dsock, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) == -1) {
+        int sock_err = SOCKET_GET_ERROR();
+        logger_log(raop_rtp->logger, LOGGER_DEBUG, "raop_rtp could not set SO_TIMESTAMPNS %d %s",
+                   sock_err, SOCKET_ERROR_STRING(sock_err));
+    }
+#endif
+
     /* Set socket descriptors */
     raop_rtp->csock = csock;
     raop_rtp->dsock = dsock;
@@ -347,6 +453,9 @@ raop_rtp_process_events(raop_rtp_t *raop_rtp, void *cb_data)
 
     /* Handle flush if requested */
     if (flush != NO_FLUSH) {
+        /* playback restarts after a flush, so the playout delay can change without a glitch */
+        raop_rtp->playout_resync = true;
+        raop_rtp->have_rendered = false;
         if (raop_rtp->callbacks.audio_flush) {
             raop_rtp->callbacks.audio_flush(raop_rtp->callbacks.cls);
         }
@@ -405,23 +514,485 @@ static uint64_t rtp_time_to_client_ntp(raop_rtp_t *raop_rtp,  uint32_t rtp32) {
     }
 }
 
+/* packets received from one socket in one batch */
+typedef struct raop_rtp_recv_batch_s {
+    int count;
+    unsigned int len[RAOP_RTP_RECV_BATCH];
+    uint64_t arrival_time[RAOP_RTP_RECV_BATCH];
+    struct sockaddr_storage saddr[RAOP_RTP_RECV_BATCH];
+    socklen_t saddrlen[RAOP_RTP_RECV_BATCH];
+#ifdef RTP_USE_RECVMMSG
+    struct mmsghdr msgs[RAOP_RTP_RECV_BATCH];
+    struct iovec iov[RAOP_RTP_RECV_BATCH];
+    char cmsg[RAOP_RTP_RECV_BATCH][CMSG_SPACE(sizeof(struct timespec))];
+#endif
+    unsigned char packet[RAOP_RTP_RECV_BATCH][RAOP_PACKET_LEN];
+} raop_rtp_recv_batch_t;
+
+/* receives up to RAOP_RTP_RECV_BATCH packets waiting on sock, without blocking;  *
+ * returns the number of packets received, or -1 on a socket error                */
+static int
+raop_rtp_recv_batch(raop_rtp_t *raop_rtp, int sock, raop_rtp_recv_batch_t *batch)
+{
+    batch->count = 0;
+#ifdef RTP_USE_RECVMMSG
+    for (int i = 0; i < RAOP_RTP_RECV_BATCH; i++) {
+        batch->iov[i].iov_base = batch->packet[i];
+        batch->iov[i].iov_len = RAOP_PACKET_LEN;
+        memset(&batch->msgs[i], 0, sizeof(struct mmsghdr));
+        batch->msgs[i].msg_hdr.msg_name = &batch->saddr[i];
+        batch->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+        batch->msgs[i].msg_hdr.msg_iov = &batch->iov[i];
+        batch->msgs[i].msg_hdr.msg_iovlen = 1;
+        batch->msgs[i].msg_hdr.msg_control = batch->cmsg[i];
+        batch->msgs[i].msg_hdr.msg_controllen = sizeof(batch->cmsg[i]);
+    }
+    int ret = recvmmsg(sock, batch->msgs, RAOP_RTP_RECV_BATCH, MSG_DONTWAIT, NULL);
+    if (ret == -1) {
+        int sock_err = SOCKET_GET_ERROR();
+        if (sock_err == EAGAIN || sock_err == EWOULDBLOCK || sock_err == EINTR) {
+            return 0;
+        }
+        logger_log(raop_rtp->logger, LOGGER_ERR, "raop_rtp error in recvmmsg %d %s", sock_err, SOCKET_ERROR_STRING(sock_err));
+        return -1;
+    }
+    uint64_t now = raop_ntp_get_local_time();
+    int64_t realtime_offset = raop_ntp_get_realtime_offset();
+    for (int i = 0; i < ret; i++) {
+        struct msghdr *hdr = &batch->msgs[i].msg_hdr;
+        batch->len[i] = batch->msgs[i].msg_len;
+        batch->saddrlen[i] = hdr->msg_namelen;
+        batch->arrival_time[i] = now;
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr); cmsg; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+                struct timespec ts;
+                memcpy(&ts, CMSG_DATA(cmsg), sizeof(struct timespec));
+                batch->arrival_time[i] = ((uint64_t) ts.tv_nsec) + (uint64_t) ts.tv_sec * SECOND_IN_NSECS - realtime_offset;
+            }
+        }
+    }
+    batch->count = ret;
+#else
+    batch->saddrlen[0] = sizeof(struct sockaddr_storage);
+    int ret = recvfrom(sock, (char *) batch->packet[0], RAOP_PACKET_LEN, 0,
+                       (struct sockaddr *) &batch->saddr[0], &batch->saddrlen[0]);
+    if (ret == -1) {
+        int sock_err = SOCKET_GET_ERROR();
+        logger_log(raop_rtp->logger, LOGGER_ERR, "raop_rtp error in recvfrom %d %s", sock_err, SOCKET_ERROR_STRING(sock_err));
+        return -1;
+    }
+    batch->len[0] = ret;
+    batch->arrival_time[0] = raop_ntp_get_local_time();
+    batch->count = 1;
+#endif
+    return batch->count;
+}
+
+static void
+raop_rtp_process_control_packet(raop_rtp_t *raop_rtp, unsigned char *packet, unsigned int packetlen,
+                                uint64_t arrival_time)
+{
+    bool logger_debug = (logger_get_level(raop_rtp->logger) >= LOGGER_DEBUG);
+    int type_c = packet[1] & ~0x80;
+    logger_log(raop_rtp->logger, LOGGER_DEBUG, "\nraop_rtp type_c 0x%02x, packetlen = %d", type_c, packetlen);
+
+    if (type_c == 0x56 && packetlen >= 8) {
+        /* Handle resent data packet, which begins at offset 4 of these packets */
+        unsigned char *resent_packet =  &packet[4];
+        unsigned int resent_packetlen = packetlen - 4;
+        unsigned short seqnum = byteutils_get_short_be(resent_packet, 2);
+        if (resent_packetlen >= 12) {
+            logger_log(raop_rtp->logger, LOGGER_DEBUG, "raop_rtp resent audio packet: seqnum=%u", seqnum);
+            int result = raop_buffer_enqueue(raop_rtp->buffer, resent_packet, resent_packetlen, arrival_time, 1);
+            assert(result >= 0);
+        } else if (logger_debug) {
+            /* type_c = 0x56 packets  with length 8 have been reported */
+            char *str = utils_data_to_string(packet, packetlen, 16);
+            logger_log(raop_rtp->logger, LOGGER_DEBUG, "Received empty resent audio packet length %d, seqnum=%u:\n%s",
+                       packetlen, seqnum, str);
+            free (str);
+        }
+    } else if (type_c == 0x54 && packetlen >= 20) {
+        /* packet[0] = 0x90 (first sync ?) or 0x80 (subsequent ones)
+         * packet[1] = 0xd4,  (0xd4 && ~0x80 = type 0x54)
+         * packet[2:3] = 0x00 0x04
+         * packet[4:7] : sync_rtp (big-endian uint32_t)
+         * packet[8:15]: remote ntp timestamp (big-endian uint64_t)  
+         * packet[16:20]: next_rtp (big-endian uint32_t)
+         * next_rtp = sync_rtp + 7497 =  441 *  17 (0.17 sec) for AAC-ELD
+         * next_rtp = sync_rtp + 77175  = 441 * 175 (1.75 sec) for ALAC */
+
+        // The unit for the rtp clock is 1 / sample rate = 1 / 44100
+        uint64_t client_ntp_sync_prev = 0;
+        uint64_t rtp_sync_prev = 0;
+        if (!raop_rtp->initial_sync) {
+            logger_log(raop_rtp->logger, LOGGER_DEBUG, "first audio rtp sync");
+            raop_rtp->initial_sync = true;
+        } else {
+           client_ntp_sync_prev = raop_rtp->client_ntp_sync;
+           rtp_sync_prev = raop_rtp->rtp_sync;
+        }
+        raop_rtp->rtp_sync = byteutils_get_int_be(packet, 4);
+        uint64_t sync_ntp_raw = byteutils_get_long_be(packet, 8);
+        raop_rtp->client_ntp_sync = raop_remote_timestamp_to_nano_seconds(raop_rtp->ntp, sync_ntp_raw);
+ 
+        if (logger_debug) {
+            double offset_change = ((double) raop_rtp->client_ntp_sync) - raop_rtp->rtp_clock_rate * raop_rtp->rtp_sync;
+            offset_change -= ((double) client_ntp_sync_prev) - raop_rtp->rtp_clock_rate * rtp_sync_prev;
+            uint64_t sync_ntp_local = raop_ntp_convert_remote_time(raop_rtp->ntp,  raop_rtp->rtp_sync);
+            char *str = utils_data_to_string(packet, packetlen, 20);
+            logger_log(raop_rtp->logger, LOGGER_DEBUG,
+                       "raop_rtp sync: ntp = %8.6f, ntp_start_time %8.6f\nts_client = %8.6f sync_rtp=%u offset change = %8.6f\n%s",
+                       (double) sync_ntp_local / SEC, (double) raop_rtp->ntp_start_time / SEC,
+                       (double) raop_rtp->client_ntp_sync / SEC, raop_rtp->rtp_sync, offset_change / SEC, str);
+            free(str);
+        }
+    } else if (logger_debug) {
+        char *str = utils_data_to_string(packet, packetlen, 16);
+        logger_log(raop_rtp->logger, LOGGER_DEBUG, "raop_rtp unknown udp control packet\n%s", str);
+        free(str);
+    }
+}
+
+/* rtp audio data packets:
+ * packet[0] 0x80
+ * packet[1] 0x60 = 96
+ * packet[2:3] seqnum (big-endian unsigned short)
+ * packet[4:7] rtp timestamp (big-endian unsigned int)
+ * packet[8:11] 0x00 0x00 0x00 0x00
+ * packet[12:packetlen - 1] encrypted audio payload
+ * For (AAC-ELD only), the payload of initial packets at the start of
+ * the stream may be replaced by a 4-byte "no_data_marker" 0x00 0x68 0x34 0x00 */
+
+/* consecutive AAC-ELD rtp timestamps differ by spf = 480
+ * consecutive ALAC rtp timestamps differ by spf = 352
+ * both have PCM uncompressed sampling rate = 441000 Hz */
+
+/* clock time in microseconds advances at (rtp_timestamp * 1000000)/44100 between frames */
+
+/* every AAC-ELD packet is sent three times:  0  0 1  0 1 2  1 2 3  2 3 4 ... 
+ * (after decoding AAC-ELD into PCM, the sound frame is three times bigger)
+ * ALAC packets are sent once only  0 1 2 3 4 5  ...  */
+
+/* When the AAC-ELD audio stream starts, the initial packets are length-16 packets with
+ * a four-byte "no_data_marker" 0x00 0x68 0x34 0x00 replacing the payload.
+ * The 12-byte packetheader contains  a secnum and rtp_timestamp, and each  packets is sent
+ * three times; the secnum and rtp_timestamp increment according to the same pattern as 
+ * AAC-ELD packets with audio content.*/
+
+/* When the ALAC audio stream starts, the initial packets are length-44 packets with 
+ * the same 32-byte encrypted payload which after decryption is the beginning of a
+ * 32-byte ALAC packet, presumably with format information, but not actual audio data.
+ * The secnum and rtp_timestamp in the packet header increment according to the same
+ * pattern as ALAC packets with audio content */
+
+/* The first ALAC packet with data seems to be decoded just before the first sync event
+ * so its dequeuing should be delayed until the first rtp sync has occurred */
+
+/* RFC 3550 interarrival jitter: D is the change in transit time (arrival time - rtp time) *
+ * between consecutive packets, and J += (|D| - J)/16; only packets sent once are used   */
+static void
+raop_rtp_update_jitter(raop_rtp_t *raop_rtp, uint32_t rtp_timestamp, uint64_t arrival_time)
+{
+    if (raop_rtp->have_transit) {
+        int32_t rtp_change = (int32_t) (rtp_timestamp - raop_rtp->last_rtp_timestamp);
+        double d = (double) ((int64_t) (arrival_time - raop_rtp->last_arrival_time));
+        d -= raop_rtp->rtp_clock_rate * (double) rtp_change;
+        if (d < 0) {
+            d = -d;
+        }
+        raop_rtp->interarrival_jitter += (d - raop_rtp->interarrival_jitter) / 16.0;
+    }
+    raop_rtp->have_transit = true;
+    raop_rtp->last_arrival_time = arrival_time;
+    raop_rtp->last_rtp_timestamp = rtp_timestamp;
+}
+
+static void
+raop_rtp_report_stats(raop_rtp_t *raop_rtp, bool session_end)
+{
+    audio_rtp_stats_t stats;
+    raop_rtp->last_stats_report = raop_ntp_get_local_time();
+    raop_buffer_get_stats(raop_rtp->buffer, &stats);
+    stats.jitter = raop_rtp->interarrival_jitter / SEC;
+    stats.playout_shift = (double) raop_rtp->playout_shift / SEC;
+    stats.clock_drift_ppm = raop_ntp_get_drift_ppm(raop_rtp->ntp);
+    stats.packets_concealed = raop_rtp->packets_concealed;
+    stats.session_end = session_end;
+    if (session_end && stats.packets_received == 0) {
+        return;
+    }
+    logger_log(raop_rtp->logger, LOGGER_DEBUG, "raop_rtp stats: received %llu, duplicate %llu, late %llu, lost %llu,"
+               " resends requested %llu (satisfied %llu), jitter %8.6f",
+               (unsigned long long) stats.packets_received, (unsigned long long) stats.packets_duplicate,
+               (unsigned long long) stats.packets_late, (unsigned long long) stats.packets_lost,
+               (unsigned long long) stats.resend_packets, (unsigned long long) stats.resends_satisfied, stats.jitter);
+    if (raop_rtp->callbacks.audio_report_stats) {
+        raop_rtp->callbacks.audio_report_stats(raop_rtp->callbacks.cls, &stats);
+    }
+}
+
+/* returns true if the packet was added to the audio packet buffer */
+static bool
+raop_rtp_process_data_packet(raop_rtp_t *raop_rtp, unsigned char *packet, unsigned int packetlen,
+                             uint64_t arrival_time, uint64_t *video_arrival_offset)
+{
+    /* initial audio stream has no data */
+    unsigned char no_data_marker[] = {0x00, 0x68, 0x34, 0x00 };
+
+    if (!raop_rtp->initial_sync && !*video_arrival_offset) {
+        *video_arrival_offset = raop_ntp_get_video_arrival_offset(raop_rtp->ntp);
+    }
+    // rtp payload type
+    //int type_d = packet[1] & ~0x80;
+    //logger_log(raop_rtp->logger, LOGGER_DEBUG, "raop_rtp_thread_udp type_d 0x%02x, packetlen = %d", type_d, packetlen);
+
+    if (packetlen < 12)  {
+        if (logger_get_level(raop_rtp->logger) >= LOGGER_DEBUG) {
+            char *str = utils_data_to_string(packet, packetlen, 16);
+            logger_log(raop_rtp->logger, LOGGER_DEBUG, "Received short type_d = 0x%2x  packet with length %d:\n%s",
+                       packet[1] & ~0x80, packetlen, str);
+            free (str);
+        }
+        return false;
+    }
+
+    if (!raop_rtp->initial_sync &&  raop_rtp->ct == 8 && *video_arrival_offset) {
+        /* estimate a fake initial remote timestamp for video  synchronization  with AAC audio before the first rtp sync */
+        uint64_t ts = arrival_time - *video_arrival_offset;
+        double delay = DELAY_AAC;
+        ts += (uint64_t) (delay * SEC);
+        raop_rtp->client_ntp_sync = ts;
+        raop_rtp->rtp_sync = byteutils_get_int_be(packet, 4);
+        raop_rtp->initial_sync = true;
+    }
+
+    if (packetlen == 16 && memcmp(packet + 12, no_data_marker, 4) == 0) {
+        /* this is a "no data" packet */
+        /* the first such packet could be used to provide the initial rtptime and seqnum formerly given in the RECORD request */
+        return false;
+    }
+
+    if (raop_rtp->ct == 2 && packetlen == 44) {
+        /* ignore the ALAC packets with format information only. */
+        return false;
+    }
+
+    int result = raop_buffer_enqueue(raop_rtp->buffer, packet, packetlen, arrival_time, 1);
+    assert(result >= 0);
+    if (result == 1) {
+        raop_rtp_update_jitter(raop_rtp, byteutils_get_int_be(packet, 4), arrival_time);
+    }
+    return true;
+}
+
+/* local time at which audio with this rtp timestamp will be played, 0 if not yet known */
+static uint64_t
+raop_rtp_playout_time_callback(void *opaque, uint32_t rtp_timestamp)
+{
+    raop_rtp_t *raop_rtp = opaque;
+    uint64_t ntp_time_remote = rtp_time_to_client_ntp(raop_rtp, rtp_timestamp);
+    if (!ntp_time_remote) {
+        return 0;
+    }
+    uint64_t ntp_time_local = raop_ntp_convert_remote_time(raop_rtp->ntp, ntp_time_remote);
+    if (!ntp_time_local) {
+        return 0;
+    }
+    return (uint64_t) ((int64_t) ntp_time_local + raop_rtp->playout_shift);
+}
+
+static int64_t
+raop_rtp_clamp_playout_shift(raop_rtp_t *raop_rtp, int64_t shift)
+{
+    if (shift < raop_rtp->playout_shift_min) {
+        return raop_rtp->playout_shift_min;
+    } else if (shift > raop_rtp->playout_shift_max) {
+        return raop_rtp->playout_shift_max;
+    }
+    return shift;
+}
+
+/* Adaptive playout delay: the "headroom" of a packet is the time between its arrival and its   *
+ * (unshifted) local playout time.  The shift is chosen so that the least headroom seen in each *
+ * window, plus the shift, covers a margin of 3 x jitter + the resend latency.  Changes are     *
+ * slewed by at most one sample per packet, except after a flush (playback restarts anyway) or  *
+ * when a packet would be played late, when the delay is raised at once.                        */
+static int64_t
+raop_rtp_update_playout_shift(raop_rtp_t *raop_rtp, uint64_t playout_time, uint64_t arrival_time)
+{
+    int64_t headroom = (int64_t) (playout_time - arrival_time);
+    int64_t margin = (int64_t) (3.0 * raop_rtp->interarrival_jitter) + PLAYOUT_GUARD;
+    margin += (int64_t) raop_buffer_get_resend_latency(raop_rtp->buffer);
+
+    if (headroom < raop_rtp->headroom_min) {
+        raop_rtp->headroom_min = headroom;
+    }
+    if (headroom + raop_rtp->playout_shift < 0) {
+        raop_rtp->playout_shift_target = raop_rtp_clamp_playout_shift(raop_rtp, margin - headroom);
+        raop_rtp->playout_resync = true;
+        logger_log(raop_rtp->logger, LOGGER_DEBUG, "raop_rtp late audio packet (headroom %8.6f): playout shift now %8.6f",
+                   (double) headroom / SEC, (double) raop_rtp->playout_shift_target / SEC);
+    } else if (arrival_time - raop_rtp->headroom_window_start >= PLAYOUT_WINDOW) {
+        raop_rtp->playout_shift_target = raop_rtp_clamp_playout_shift(raop_rtp, margin - raop_rtp->headroom_min);
+        raop_rtp->headroom_min = INT64_MAX;
+        raop_rtp->headroom_window_start = arrival_time;
+    }
+
+    if (raop_rtp->playout_resync) {
+        raop_rtp->playout_shift = raop_rtp->playout_shift_target;
+        raop_rtp->playout_resync = false;
+    } else {
+        /* sample-accurate slewing: at most one sample per packet */
+        int64_t step = (int64_t) raop_rtp->rtp_clock_rate;
+        int64_t change = raop_rtp->playout_shift_target - raop_rtp->playout_shift;
+        if (change > step) {
+            change = step;
+        } else if (change < -step) {
+            change = -step;
+        }
+        raop_rtp->playout_shift += change;
+    }
+    return raop_rtp->playout_shift;
+}
+
+static void
+raop_rtp_audio_times(raop_rtp_t *raop_rtp, audio_decode_struct *audio_data, uint64_t arrival_time)
+{
+    audio_data->ntp_time_remote = rtp_time_to_client_ntp(raop_rtp, (uint32_t) audio_data->rtp_time);
+    audio_data->ntp_time_local  = raop_ntp_convert_remote_time(raop_rtp->ntp, audio_data->ntp_time_remote);
+    if (raop_rtp->adaptive_delay && audio_data->ntp_time_local) {
+        /* concealed frames (arrival_time = 0) use the current shift */
+        int64_t shift = (arrival_time ? raop_rtp_update_playout_shift(raop_rtp, audio_data->ntp_time_local, arrival_time)
+                         : raop_rtp->playout_shift);
+        audio_data->ntp_time_remote = (uint64_t) ((int64_t) audio_data->ntp_time_remote + shift);
+        audio_data->ntp_time_local = (uint64_t) ((int64_t) audio_data->ntp_time_local + shift);
+    }
+}
+
+/* Packet-loss concealment: when packets between the last rendered packet and the next one were *
+ * lost, a frame with the right timestamp is rendered for each of them, so the audio decoder    *
+ * timeline stays continuous, instead of the pipeline having to resync after a timestamp gap.   *
+ * (A repeated compressed frame cannot be faded, so AAC-ELD frames are only repeated for short  *
+ * gaps.)                                                                                       */
+static void
+raop_rtp_conceal_loss(raop_rtp_t *raop_rtp, unsigned short seqnum, uint32_t rtp_timestamp)
+{
+    if (!raop_rtp->have_rendered) {
+        return;
+    }
+    unsigned short gap = seqnum - raop_rtp->rendered_seqnum - 1;
+    uint32_t spf = (raop_rtp->ct == 2 ? SPF_ALAC : SPF_AAC_ELD);
+    if (gap == 0 || gap > CONCEAL_MAX_GAP || rtp_timestamp - raop_rtp->rendered_rtp_timestamp != (gap + 1) * spf) {
+        /* no loss, or a discontinuity in the stream */
+        return;
+    }
+    if (raop_rtp->ct != 2 && gap > CONCEAL_MAX_REPEATS) {
+        gap = CONCEAL_MAX_REPEATS;
+    }
+    if (!raop_rtp->conceal_frame_len) {
+        return;
+    }
+    for (unsigned short i = 1; i <= gap; i++) {
+        audio_decode_struct audio_data;
+        audio_data.rtp_time = raop_rtp->rendered_rtp_timestamp + i * spf;
+        audio_data.seqnum = raop_rtp->rendered_seqnum + i;
+        audio_data.data_len = raop_rtp->conceal_frame_len;
+        audio_data.data = raop_rtp->conceal_frame;
+        audio_data.ct = raop_rtp->ct;
+        audio_data.concealed = true;
+        raop_rtp_audio_times(raop_rtp, &audio_data, 0);
+        logger_log(raop_rtp->logger, LOGGER_DEBUG, "raop_rtp concealed lost audio packet seqnum=%u", audio_data.seqnum);
+        raop_rtp->callbacks.audio_process(raop_rtp->callbacks.cls, raop_rtp->ntp, &audio_data);
+        raop_rtp->packets_concealed++;
+    }
+}
+
+static void
+raop_rtp_set_rendered(raop_rtp_t *raop_rtp, unsigned short seqnum, uint32_t rtp_timestamp,
+                         unsigned char *payload, unsigned int payload_size)
+{
+    raop_rtp->have_rendered = true;
+    raop_rtp->rendered_seqnum = seqnum;
+    raop_rtp->rendered_rtp_timestamp = rtp_timestamp;
+    if (raop_rtp->ct == 2) {
+        if (raop_rtp->conceal_frame_len != ALAC_SILENCE_LEN) {
+            memset(raop_rtp->conceal_frame, 0, ALAC_SILENCE_LEN);
+            raop_rtp->conceal_frame[0] = 0x20;    /* stereo element (ID_CPE) */
+            raop_rtp->conceal_frame[2] = 0x02;    /* escape flag: uncompressed samples follow */
+            /* END tag (111) at bits ALAC_SILENCE_BITS - 3 to ALAC_SILENCE_BITS - 1 */
+            for (int bit = ALAC_SILENCE_BITS - 3; bit < ALAC_SILENCE_BITS; bit++) {
+                raop_rtp->conceal_frame[bit / 8] |= 0x80 >> (bit % 8);
+            }
+            raop_rtp->conceal_frame_len = ALAC_SILENCE_LEN;
+        }
+    } else if (payload_size <= sizeof(raop_rtp->conceal_frame)) {
+        memcpy(raop_rtp->conceal_frame, payload, payload_size);
+        raop_rtp->conceal_frame_len = payload_size;
+    }
+}
+
+/* Render continuous buffer entries.  As when packets were enqueued one at a time, there is  *
+ * one dequeuing pass per newly-enqueued packet, because each pass stops at a missing packet *
+ * (which is skipped if no resend is expected).                                              */
+static void
+raop_rtp_render_buffer(raop_rtp_t *raop_rtp, int passes, int no_resend)
+{
+    bool logger_debug_data = (logger_get_level(raop_rtp->logger) >= LOGGER_DEBUG_DATA);
+    unsigned char *payload = NULL;
+    unsigned int payload_size;
+    unsigned short seqnum;
+    uint32_t rtp_timestamp;
+    uint64_t arrival_time;
+
+    for (int pass = 0; pass < passes; pass++) {
+        while ((payload = raop_buffer_dequeue(raop_rtp->buffer, &payload_size, &rtp_timestamp, &seqnum,
+                                              &arrival_time, no_resend))) {
+            raop_rtp_conceal_loss(raop_rtp, seqnum, rtp_timestamp);
+
+            audio_decode_struct audio_data; 
+            audio_data.rtp_time = rtp_timestamp;
+            audio_data.seqnum = seqnum;
+            audio_data.data_len = payload_size;
+            audio_data.data = payload;
+            audio_data.ct = raop_rtp->ct;
+            audio_data.concealed = false;
+            raop_rtp_audio_times(raop_rtp, &audio_data, arrival_time);
+
+            if (logger_debug_data) {
+                uint64_t ntp_now = raop_ntp_get_local_time();
+                int64_t latency = (audio_data.ntp_time_local ? ((int64_t) ntp_now) - ((int64_t) audio_data.ntp_time_local) : 0); 
+                logger_log(raop_rtp->logger, LOGGER_DEBUG,
+                           "raop_rtp audio: now = %8.6f, ntp = %8.6f, latency = %9.6f, ts = %8.6f, rtp_time=%u seqnum = %u"
+                           " buffered = %8.6f",
+                           (double) ntp_now / SEC, (double) audio_data.ntp_time_local / SEC, (double) latency / SEC,
+                           (double) audio_data.ntp_time_remote /SEC, rtp_timestamp, seqnum,
+                           (double) ((int64_t) ntp_now - (int64_t) arrival_time) / SEC);
+            }
+
+            raop_rtp->callbacks.audio_process(raop_rtp->callbacks.cls, raop_rtp->ntp, &audio_data);
+            raop_rtp_set_rendered(raop_rtp, seqnum, rtp_timestamp, payload, payload_size);
+            /* audio_process has copied the data, return the slot to the buffer */
+            raop_buffer_release(raop_rtp->buffer, payload);
+        }
+    }
+
+    /* Handle possible resend requests */
+    if (!no_resend) {
+        raop_buffer_handle_resends(raop_rtp->buffer, raop_rtp_resend_callback, raop_rtp_playout_time_callback,
+                                   raop_rtp, raop_ntp_get_local_time());
+    }
+}
+
 static THREAD_RETVAL
 raop_rtp_thread_udp(void *arg)
 {
     raop_rtp_t *raop_rtp = arg;
-    unsigned char packet[RAOP_PACKET_LEN];
-    unsigned int packetlen;
-    struct sockaddr_storage saddr;
-    socklen_t saddrlen;
+    raop_rtp_recv_batch_t *batch;
     bool got_remote_control_saddr = false;
     uint64_t video_arrival_offset = 0;
 
-    /* initial audio stream has no data */    
-    unsigned char no_data_marker[] = {0x00, 0x68, 0x34, 0x00 };
-
     assert(raop_rtp);
-    bool logger_debug = (logger_get_level(raop_rtp->logger) >= LOGGER_DEBUG);
-    bool logger_debug_data = (logger_get_level(raop_rtp->logger) >= LOGGER_DEBUG_DATA);
     raop_rtp->ntp_start_time = raop_ntp_get_local_time();
     raop_rtp->rtp_clock_started = false;
 
@@ -429,19 +1000,35 @@ raop_rtp_thread_udp(void *arg)
 
     logger_log(raop_rtp->logger, LOGGER_DEBUG, "raop_rtp start_time = %8.6f (raop_rtp audio)",
                ((double) raop_rtp->ntp_start_time) / SEC);
+    raop_rtp->last_stats_report = raop_rtp->ntp_start_time;
+
+    batch = (raop_rtp_recv_batch_t *) malloc(sizeof(raop_rtp_recv_batch_t));
+    if (!batch) {
+        logger_log(raop_rtp->logger, LOGGER_ERR, "raop_rtp failed to allocate receive buffers");
+    }
 
-    while(1) {
+    /* process any changes posted before the thread started */
+    bool events_pending = true;
+    while(batch) {
         fd_set rfds;
-        struct timeval tv;
+        struct timeval *timeout;
         int nfds, ret;	
         /* Check if we are still running and process callbacks */
-        if (raop_rtp_process_events(raop_rtp, NULL)) {
+        if (events_pending && raop_rtp_process_events(raop_rtp, NULL)) {
             break;
         }
 
+#ifdef RTP_USE_EVENTFD
+        /* No timeout: changes and stop requests arrive through event_fd */
+        timeout = NULL;
+        events_pending = false;
+#else
         /* Set timeout value to 5ms */
+        struct timeval tv;
         tv.tv_sec = 0;
         tv.tv_usec = 5000;
+        timeout = &tv;
+#endif
 
         /* Get the correct nfds value */
         nfds = raop_rtp->csock+1;
@@ -452,211 +1039,78 @@ raop_rtp_thread_udp(void *arg)
         FD_ZERO(&rfds);
         FD_SET(raop_rtp->csock, &rfds);
         FD_SET(raop_rtp->dsock, &rfds);
+#ifdef RTP_USE_EVENTFD
+        FD_SET(raop_rtp->event_fd, &rfds);
+        if (raop_rtp->event_fd >= nfds)
+            nfds = raop_rtp->event_fd+1;
+#endif
+
+        if (raop_ntp_get_local_time() - raop_rtp->last_stats_report >= RAOP_RTP_STATS_INTERVAL) {
+            raop_rtp_report_stats(raop_rtp, false);
+        }
 
-        ret = select(nfds, &rfds, NULL, NULL, &tv);
+        ret = select(nfds, &rfds, NULL, NULL, timeout);
         if (ret == 0) {
             /* Timeout happened */
             continue;
         } else if (ret == -1) {
             int sock_err = SOCKET_GET_ERROR();
+            if (sock_err == EINTR) {
+                events_pending = true;
+                continue;
+            }
             logger_log(raop_rtp->logger, LOGGER_ERR,
                        "raop_rtp error in select %d %s", sock_err, SOCKET_ERROR_STRING(sock_err));
             break;
         }
 
+#ifdef RTP_USE_EVENTFD
+        if (FD_ISSET(raop_rtp->event_fd, &rfds)) {
+            eventfd_t value;
+            eventfd_read(raop_rtp->event_fd, &value);
+            events_pending = true;
+        }
+#endif
+
+        /* drain all waiting control packets (syncs and resent data), then all waiting data packets */
         if (FD_ISSET(raop_rtp->csock, &rfds)) {
-            if (got_remote_control_saddr== false) {
-                saddrlen = sizeof(saddr);
-                packetlen = recvfrom(raop_rtp->csock, (char *)packet, sizeof(packet), 0,
-                                     (struct sockaddr *)&saddr, &saddrlen);
-                if (packetlen > 0) {
-                    memcpy(&raop_rtp->control_saddr, &saddr, saddrlen);
-                    raop_rtp->control_saddr_len = saddrlen;
-                    got_remote_control_saddr = true;
-                }
-	    } else {
-                packetlen = recvfrom(raop_rtp->csock, (char *)packet, sizeof(packet), 0, NULL, NULL);
-            }
-            int type_c = packet[1] & ~0x80;
-            logger_log(raop_rtp->logger, LOGGER_DEBUG, "\nraop_rtp type_c 0x%02x, packetlen = %d", type_c, packetlen);
-
-            if (type_c == 0x56 && packetlen >= 8) {
-	        /* Handle resent data packet, which begins at offset 4 of these packets */
-                unsigned char *resent_packet =  &packet[4];
-                unsigned int resent_packetlen = packetlen - 4;
-                unsigned short seqnum = byteutils_get_short_be(resent_packet, 2);
-                if (resent_packetlen >= 12) {
-                    logger_log(raop_rtp->logger, LOGGER_DEBUG, "raop_rtp resent audio packet: seqnum=%u", seqnum);
-                    int result = raop_buffer_enqueue(raop_rtp->buffer, resent_packet, resent_packetlen, 1);
-                    assert(result >= 0);
-                } else if (logger_debug) {
-                    /* type_c = 0x56 packets  with length 8 have been reported */
-                    char *str = utils_data_to_string(packet, packetlen, 16);
-                    logger_log(raop_rtp->logger, LOGGER_DEBUG, "Received empty resent audio packet length %d, seqnum=%u:\n%s",
-                               packetlen, seqnum, str);
-                    free (str);
+            do {
+                if (raop_rtp_recv_batch(raop_rtp, raop_rtp->csock, batch) <= 0) {
+                    break;
                 }
-            } else if (type_c == 0x54 && packetlen >= 20) {
-                /* packet[0] = 0x90 (first sync ?) or 0x80 (subsequent ones)
-                 * packet[1] = 0xd4,  (0xd4 && ~0x80 = type 0x54)
-                 * packet[2:3] = 0x00 0x04
-                 * packet[4:7] : sync_rtp (big-endian uint32_t)
-                 * packet[8:15]: remote ntp timestamp (big-endian uint64_t)  
-                 * packet[16:20]: next_rtp (big-endian uint32_t)
-                 * next_rtp = sync_rtp + 7497 =  441 *  17 (0.17 sec) for AAC-ELD
-                 * next_rtp = sync_rtp + 77175  = 441 * 175 (1.75 sec) for ALAC */
-
-                // The unit for the rtp clock is 1 / sample rate = 1 / 44100
-                uint64_t client_ntp_sync_prev = 0;
-                uint64_t rtp_sync_prev = 0;
-                if (!raop_rtp->initial_sync) {
-                    logger_log(raop_rtp->logger, LOGGER_DEBUG, "first audio rtp sync");
-                    raop_rtp->initial_sync = true;
-                } else {
-                   client_ntp_sync_prev = raop_rtp->client_ntp_sync;
-                   rtp_sync_prev = raop_rtp->rtp_sync;
-		}
-                raop_rtp->rtp_sync = byteutils_get_int_be(packet, 4);
-                uint64_t sync_ntp_raw = byteutils_get_long_be(packet, 8);
-                raop_rtp->client_ntp_sync = raop_remote_timestamp_to_nano_seconds(raop_rtp->ntp, sync_ntp_raw);
- 
-                if (logger_debug) {
-                    double offset_change = ((double) raop_rtp->client_ntp_sync) - raop_rtp->rtp_clock_rate * raop_rtp->rtp_sync;
-                    offset_change -= ((double) client_ntp_sync_prev) - raop_rtp->rtp_clock_rate * rtp_sync_prev;
-                    uint64_t sync_ntp_local = raop_ntp_convert_remote_time(raop_rtp->ntp,  raop_rtp->rtp_sync);
-                    char *str = utils_data_to_string(packet, packetlen, 20);
-                    logger_log(raop_rtp->logger, LOGGER_DEBUG,
-                               "raop_rtp sync: ntp = %8.6f, ntp_start_time %8.6f\nts_client = %8.6f sync_rtp=%u offset change = %8.6f\n%s",
-                               (double) sync_ntp_local / SEC, (double) raop_rtp->ntp_start_time / SEC,
-                               (double) raop_rtp->client_ntp_sync / SEC, raop_rtp->rtp_sync, offset_change / SEC, str);
-                    free(str);
+                for (int i = 0; i < batch->count; i++) {
+                    if (got_remote_control_saddr == false && batch->len[i] > 0) {
+                        memcpy(&raop_rtp->control_saddr, &batch->saddr[i], batch->saddrlen[i]);
+                        raop_rtp->control_saddr_len = batch->saddrlen[i];
+                        got_remote_control_saddr = true;
+                    }
+                    raop_rtp_process_control_packet(raop_rtp, batch->packet[i], batch->len[i], batch->arrival_time[i]);
                 }
-            } else if (logger_debug) {
-                char *str = utils_data_to_string(packet, packetlen, 16);
-                logger_log(raop_rtp->logger, LOGGER_DEBUG, "raop_rtp unknown udp control packet\n%s", str);
-                free(str);
-            }
+            } while (RAOP_RTP_RECV_MORE(batch));
         }
 
-        /* rtp audio data packets:
-         * packet[0] 0x80
-         * packet[1] 0x60 = 96
-         * packet[2:3] seqnum (big-endian unsigned short)
-         * packet[4:7] rtp timestamp (big-endian unsigned int)
-         * packet[8:11] 0x00 0x00 0x00 0x00
-         * packet[12:packetlen - 1] encrypted audio payload
-         * For (AAC-ELD only), the payload of initial packets at the start of
-         * the stream may be replaced by a 4-byte "no_data_marker" 0x00 0x68 0x34 0x00 */
-	
-        /* consecutive AAC-ELD rtp timestamps differ by spf = 480
-         * consecutive ALAC rtp timestamps differ by spf = 352
-         * both have PCM uncompressed sampling rate = 441000 Hz */
-
-        /* clock time in microseconds advances at (rtp_timestamp * 1000000)/44100 between frames */
-
-        /* every AAC-ELD packet is sent three times:  0  0 1  0 1 2  1 2 3  2 3 4 ... 
-         * (after decoding AAC-ELD into PCM, the sound frame is three times bigger)
-         * ALAC packets are sent once only  0 1 2 3 4 5  ...  */
-
-        /* When the AAC-ELD audio stream starts, the initial packets are length-16 packets with
-         * a four-byte "no_data_marker" 0x00 0x68 0x34 0x00 replacing the payload.
-         * The 12-byte packetheader contains  a secnum and rtp_timestamp, and each  packets is sent
-         * three times; the secnum and rtp_timestamp increment according to the same pattern as 
-         * AAC-ELD packets with audio content.*/
-
-	 /* When the ALAC audio stream starts, the initial packets are length-44 packets with 
-	  * the same 32-byte encrypted payload which after decryption is the beginning of a
-          * 32-byte ALAC packet, presumably with format information, but not actual audio data.
-          * The secnum and rtp_timestamp in the packet header increment according to the same
-          * pattern as ALAC packets with audio content */	
-
-         /* The first ALAC packet with data seems to be decoded just before the first sync event
-          * so its dequeuing should be delayed until the first rtp sync has occurred */
-
-
-	if (FD_ISSET(raop_rtp->dsock, &rfds)) {
-	    if (!raop_rtp->initial_sync && !video_arrival_offset) {
-                video_arrival_offset = raop_ntp_get_video_arrival_offset(raop_rtp->ntp);
-	    }
-            //logger_log(raop_rtp->logger, LOGGER_INFO, "Would have data packet in queue");
-            // Receiving audio data here
-            saddrlen = sizeof(saddr);
-            packetlen = recvfrom(raop_rtp->dsock, (char *)packet, sizeof(packet), 0, NULL, NULL);
-            // rtp payload type
-            //int type_d = packet[1] & ~0x80;
-            //logger_log(raop_rtp->logger, LOGGER_DEBUG, "raop_rtp_thread_udp type_d 0x%02x, packetlen = %d", type_d, packetlen);
-	    
-            if (packetlen < 12)  {
-                if (logger_debug) {
-                    char *str = utils_data_to_string(packet, packetlen, 16);
-                    logger_log(raop_rtp->logger, LOGGER_DEBUG, "Received short type_d = 0x%2x  packet with length %d:\n%s",
-                               packet[1] & ~0x80, packetlen, str);
-                    free (str);
+        int enqueued = 0;
+        if (FD_ISSET(raop_rtp->dsock, &rfds)) {
+            do {
+                if (raop_rtp_recv_batch(raop_rtp, raop_rtp->dsock, batch) <= 0) {
+                    break;
                 }
-                continue;
-	    }
-
-	    if (!raop_rtp->initial_sync &&  raop_rtp->ct == 8 && video_arrival_offset) {
-                /* estimate a fake initial remote timestamp for video  synchronization  with AAC audio before the first rtp sync */
- 	         uint64_t ts = raop_ntp_get_local_time() - video_arrival_offset;
-	         double delay = DELAY_AAC;
-		 ts += (uint64_t) (delay * SEC);
-		 raop_rtp->client_ntp_sync = ts;
-		 raop_rtp->rtp_sync = byteutils_get_int_be(packet, 4);
-		 raop_rtp->initial_sync = true;
-	    }	    
-
-            if (packetlen == 16 && memcmp(packet + 12, no_data_marker, 4) == 0) {
-                /* this is a "no data" packet */
-	        /* the first such packet could be used to provide the initial rtptime and seqnum formerly given in the RECORD request */
-                continue;
-            }
-	    
-	    if (raop_rtp->ct == 2 && packetlen == 44)  continue;   /* ignore the ALAC packets with format information only. */
-
-            int result = raop_buffer_enqueue(raop_rtp->buffer, packet, packetlen, 1);
-            assert(result >= 0);
-
-	    if (!raop_rtp->initial_sync) {
-                /* wait until the first sync before dequeing ALAC */
-                continue;
-            } else {
-            // Render continuous buffer entries
-                void *payload = NULL;
-                unsigned int payload_size;
-                unsigned short seqnum;
-                uint32_t rtp_timestamp;
-
-                while ((payload = raop_buffer_dequeue(raop_rtp->buffer, &payload_size, &rtp_timestamp, &seqnum, no_resend))) {
-                    audio_decode_struct audio_data; 
-                    audio_data.rtp_time = rtp_timestamp;
-                    audio_data.seqnum = seqnum;
-                    audio_data.data_len = payload_size;
-                    audio_data.data = payload;
-                    audio_data.ct = raop_rtp->ct;
-                    audio_data.ntp_time_remote = rtp_time_to_client_ntp(raop_rtp, rtp_timestamp);
-                    audio_data.ntp_time_local  = raop_ntp_convert_remote_time(raop_rtp->ntp, audio_data.ntp_time_remote);
-
-                    if (logger_debug_data) {
-                        uint64_t ntp_now = raop_ntp_get_local_time();
-                        int64_t latency = (audio_data.ntp_time_local ? ((int64_t) ntp_now) - ((int64_t) audio_data.ntp_time_local) : 0); 
-                        logger_log(raop_rtp->logger, LOGGER_DEBUG,
-                                   "raop_rtp audio: now = %8.6f, ntp = %8.6f, latency = %9.6f, ts = %8.6f, rtp_time=%u seqnum = %u",
-                                   (double) ntp_now / SEC, (double) audio_data.ntp_time_local / SEC, (double) latency / SEC,
-                                   (double) audio_data.ntp_time_remote /SEC, rtp_timestamp, seqnum);
+                for (int i = 0; i < batch->count; i++) {
+                    if (raop_rtp_process_data_packet(raop_rtp, batch->packet[i], batch->len[i],
+                                                     batch->arrival_time[i], &video_arrival_offset)) {
+                        enqueued++;
                     }
-
-                    raop_rtp->callbacks.audio_process(raop_rtp->callbacks.cls, raop_rtp->ntp, &audio_data);
-                    free(payload);
                 }
+            } while (RAOP_RTP_RECV_MORE(batch));
+        }
 
-                /* Handle possible resend requests */
-                if (!no_resend) {
-                    raop_buffer_handle_resends(raop_rtp->buffer, raop_rtp_resend_callback, raop_rtp);
-                }
-            }
+        /* wait until the first sync before dequeing ALAC */
+        if (enqueued && raop_rtp->initial_sync) {
+            raop_rtp_render_buffer(raop_rtp, enqueued, no_resend);
         }
     }
+    free(batch);
+    raop_rtp_report_stats(raop_rtp, true);
 
     // Ensure running reflects the actual state
     MUTEX_LOCK(raop_rtp->run_mutex);
@@ -726,6 +1180,7 @@ raop_rtp_set_volume(raop_rtp_t *raop_rtp, float volume)
     raop_rtp->volume = volume;
     raop_rtp->volume_changed = 1;
     MUTEX_UNLOCK(raop_rtp->run_mutex);
+    raop_rtp_wake(raop_rtp);
 }
 
 void
@@ -747,6 +1202,7 @@ raop_rtp_set_metadata(raop_rtp_t *raop_rtp, const char *data, int datalen)
     raop_rtp->metadata = metadata;
     raop_rtp->metadata_len = datalen;
     MUTEX_UNLOCK(raop_rtp->run_mutex);
+    raop_rtp_wake(raop_rtp);
 }
 
 void
@@ -768,6 +1224,7 @@ raop_rtp_set_coverart(raop_rtp_t *raop_rtp, const char *data, int datalen)
     raop_rtp->coverart = coverart;
     raop_rtp->coverart_len = datalen;
     MUTEX_UNLOCK(raop_rtp->run_mutex);
+    raop_rtp_wake(raop_rtp);
 }
 
 void
@@ -790,6 +1247,7 @@ raop_rtp_remote_control_id(raop_rtp_t *raop_rtp, const char *dacp_id, const char
     }
     raop_rtp->active_remote_header = strdup(active_remote_header);
     MUTEX_UNLOCK(raop_rtp->run_mutex);
+    raop_rtp_wake(raop_rtp);
 }
 
 void
@@ -804,6 +1262,24 @@ raop_rtp_set_progress(raop_rtp_t *raop_rtp, unsigned int start, unsigned int cur
     raop_rtp->progress_end = end;
     raop_rtp->progress_changed = 1;
     MUTEX_UNLOCK(raop_rtp->run_mutex);
+    raop_rtp_wake(raop_rtp);
+}
+
+/* enable the adaptive playout delay, with shifts (nsecs) in [min_shift, max_shift]; *
+ * must be called before raop_rtp_start_audio                                       */
+void
+raop_rtp_set_adaptive_delay(raop_rtp_t *raop_rtp, int64_t min_shift, int64_t max_shift)
+{
+    assert(raop_rtp);
+    assert(min_shift <= 0 && max_shift >= 0);
+    raop_rtp->adaptive_delay = true;
+    raop_rtp->playout_shift_min = min_shift;
+    raop_rtp->playout_shift_max = max_shift;
+    raop_rtp->playout_shift = 0;
+    raop_rtp->playout_shift_target = 0;
+    raop_rtp->headroom_min = INT64_MAX;
+    raop_rtp->headroom_window_start = raop_ntp_get_local_time();
+    raop_rtp->playout_resync = false;
 }
 
 void
@@ -815,6 +1291,7 @@ raop_rtp_flush(raop_rtp_t *raop_rtp, int next_seq)
     MUTEX_LOCK(raop_rtp->run_mutex);
     raop_rtp->flush = next_seq;
     MUTEX_UNLOCK(raop_rtp->run_mutex);
+    raop_rtp_wake(raop_rtp);
 }
 
 void
@@ -831,6 +1308,7 @@ raop_rtp_stop(raop_rtp_t *raop_rtp)
     }
     raop_rtp->running = 0;
     MUTEX_UNLOCK(raop_rtp->run_mutex);
+    raop_rtp_wake(raop_rtp);
 
     /* Join the thread */
     THREAD_JOIN(raop_rtp->thread);
@@ -30,7 +30,7 @@
 typedef struct raop_rtp_s raop_rtp_t;
 
 raop_rtp_t *raop_rtp_init(logger_t *logger, raop_callbacks_t *callbacks, raop_ntp_t *ntp, const char *remote, 
-                          int remotelen, const unsigned char *aeskey, const unsigned char *aesiv);
+                          int remotelen, const unsigned char *aeskey, const unsigned char *aesiv, int buffer_depth);
 
 void raop_rtp_start_audio(raop_rtp_t *raop_rtp, unsigned short *control_rport, unsigned short *control_lport,
                           unsigned short *data_lport, unsigned char *ct, unsigned int *sr);
@@ -40,6 +40,7 @@ void raop_rtp_set_metadata(raop_rtp_t *raop_rtp, const char *data, int datalen);
 void raop_rtp_set_coverart(raop_rtp_t *raop_rtp, const char *data, int datalen);
 void raop_rtp_remote_control_id(raop_rtp_t *raop_rtp, const char *dacp_id, const char *active_remote_header);
 void raop_rtp_set_progress(raop_rtp_t *raop_rtp, unsigned int start, unsigned int curr, unsigned int end);
+void raop_rtp_set_adaptive_delay(raop_rtp_t *raop_rtp, int64_t min_shift, int64_t max_shift);
 void raop_rtp_flush(raop_rtp_t *raop_rtp, int next_seq);
 void raop_rtp_stop(raop_rtp_t *raop_rtp);
 int raop_rtp_is_running(raop_rtp_t *raop_rtp);
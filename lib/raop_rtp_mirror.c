@@ -29,12 +29,23 @@
 #include <netinet/tcp.h>
 #endif
 
+/* On Linux, the mirror thread sleeps in epoll_wait() until data arrives on the stream, and is *
+ * woken through an eventfd when it must stop.  Elsewhere it polls with a 5 msec select()      *
+ * timeout, checking raop_rtp_mirror->running each time.                                       */
+#ifdef __linux__
+#define MIRROR_USE_EPOLL
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#endif
+
 #include "raop.h"
 #include "netutils.h"
 #include "compat.h"
 #include "logger.h"
 #include "byteutils.h"
 #include "mirror_buffer.h"
+#include "frame_pool.h"
 #include "stream.h"
 #include "utils.h"
 #include "plist/plist.h"
@@ -54,6 +65,9 @@
 #define SECOND_IN_NSECS 1000000000UL
 #define SEC SECOND_IN_NSECS
 
+/* upper limit on the memory kept by the frame pool for reuse after frames are released */
+#define FRAME_POOL_MAX_CACHED_BYTES (32 * 1024 * 1024)
+
 /* for MacOS, where SOL_TCP and TCP_KEEPIDLE are not defined */
 #if !defined(SOL_TCP) && defined(IPPROTO_TCP)
 #define SOL_TCP IPPROTO_TCP
@@ -89,6 +103,9 @@ struct raop_rtp_mirror_s {
     /* mirror buffer for decryption */
     mirror_buffer_t *buffer;
 
+    /* pool of recycled buffers for received frames (shared with the video renderer) */
+    frame_pool_t *frame_pool;
+
     /* Remote address as sockaddr */
     struct sockaddr_storage remote_saddr;
     socklen_t remote_saddr_len;
@@ -105,6 +122,9 @@ struct raop_rtp_mirror_s {
     /* MUTEX LOCKED VARIABLES END */
     int mirror_data_sock;
 
+    /* eventfd used to wake the mirror thread when it must stop (-1 if not used) */
+    int stop_fd;
+
     unsigned short mirror_data_lport;
 
      /* switch for displaying client FPS data */
@@ -157,24 +177,64 @@ raop_rtp_mirror_t *raop_rtp_mirror_init(logger_t *logger, raop_callbacks_t *call
         free(raop_rtp_mirror);
         return NULL;
     }
+    raop_rtp_mirror->frame_pool = frame_pool_init(logger, FRAME_POOL_MAX_CACHED_BYTES);
+    if (!raop_rtp_mirror->frame_pool) {
+        mirror_buffer_destroy(raop_rtp_mirror->buffer);
+        free(raop_rtp_mirror);
+        return NULL;
+    }
     if (raop_rtp_mirror_parse_remote(raop_rtp_mirror, remote, remotelen) < 0) {
+        frame_pool_destroy(raop_rtp_mirror->frame_pool);
+        mirror_buffer_destroy(raop_rtp_mirror->buffer);
         free(raop_rtp_mirror);
         return NULL;
     }
     raop_rtp_mirror->running = 0;
     raop_rtp_mirror->joined = 1;
     raop_rtp_mirror->flush = NO_FLUSH;
+    raop_rtp_mirror->mirror_data_sock = -1;
+    raop_rtp_mirror->stop_fd = -1;
+#ifdef MIRROR_USE_EPOLL
+    raop_rtp_mirror->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (raop_rtp_mirror->stop_fd == -1) {
+        int sock_err = SOCKET_GET_ERROR();
+        logger_log(raop_rtp_mirror->logger, LOGGER_ERR, "raop_rtp_mirror could not create eventfd %d %s",
+                   sock_err, SOCKET_ERROR_STRING(sock_err));
+        frame_pool_destroy(raop_rtp_mirror->frame_pool);
+        mirror_buffer_destroy(raop_rtp_mirror->buffer);
+        free(raop_rtp_mirror);
+        return NULL;
+    }
+#endif
 
     MUTEX_CREATE(raop_rtp_mirror->run_mutex);
     return raop_rtp_mirror;
 }
 
 void
-raop_rtp_mirror_init_aes(raop_rtp_mirror_t *raop_rtp_mirror, uint64_t *streamConnectionID)
+raop_rtp_mirror_init_aes(raop_rtp_mirror_t *raop_rtp_mirror, uint64_t *streamConnectionID, int decrypt_threads)
 {
-    mirror_buffer_init_aes(raop_rtp_mirror->buffer, streamConnectionID);
+    mirror_buffer_init_aes(raop_rtp_mirror->buffer, streamConnectionID, decrypt_threads);
 }
 
+#ifdef MIRROR_USE_EPOLL
+static int
+raop_rtp_mirror_epoll_ctl(raop_rtp_mirror_t *raop_rtp_mirror, int epoll_fd, int op, int fd)
+{
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if (epoll_ctl(epoll_fd, op, fd, &event) == -1) {
+        int sock_err = SOCKET_GET_ERROR();
+        logger_log(raop_rtp_mirror->logger, LOGGER_ERR, "raop_rtp_mirror error in epoll_ctl %d %s",
+                   sock_err, SOCKET_ERROR_STRING(sock_err));
+        return -1;
+    }
+    return 0;
+}
+#endif
+
 #define RAOP_PACKET_LEN 32768
 /**
  * Mirror
@@ -191,7 +251,11 @@ raop_rtp_mirror_thread(void *arg)
     unsigned char* sps_pps = NULL;
     bool prepend_sps_pps = false;
     int sps_pps_len = 0;
+    video_nal_unit_t sps_pps_nal_units[3];
+    int sps_pps_nal_count = 0;
     unsigned char* payload = NULL;
+    unsigned char* payload_buffer = NULL;
+    int payload_offset = 0;
     unsigned int readstart = 0;
     bool conn_reset = false;
     uint64_t ntp_timestamp_nal = 0;
@@ -208,11 +272,54 @@ raop_rtp_mirror_thread(void *arg)
     bool unsupported_codec = false;
     bool video_stream_suspended = false;
     bool first_packet = true;
-    
+#ifdef MIRROR_USE_EPOLL
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1) {
+        int sock_err = SOCKET_GET_ERROR();
+        logger_log(raop_rtp_mirror->logger, LOGGER_ERR, "raop_rtp_mirror error in epoll_create1 %d %s",
+                   sock_err, SOCKET_ERROR_STRING(sock_err));
+    } else if (raop_rtp_mirror_epoll_ctl(raop_rtp_mirror, epoll_fd, EPOLL_CTL_ADD, raop_rtp_mirror->stop_fd) ||
+               raop_rtp_mirror_epoll_ctl(raop_rtp_mirror, epoll_fd, EPOLL_CTL_ADD, raop_rtp_mirror->mirror_data_sock)) {
+        close(epoll_fd);
+        epoll_fd = -1;
+    }
+#endif
+
     while (1) {
+        bool listen_ready = false;
+        bool stream_ready = false;
+        int ret;
+#ifdef MIRROR_USE_EPOLL
+        /* wait (with no timeout) for data, a new connection, or a stop request */
+        struct epoll_event events[3];
+        bool stop = (epoll_fd == -1);
+        ret = (stop ? 0 : epoll_wait(epoll_fd, events, 3, -1));
+        if (ret == -1) {
+            int sock_err = SOCKET_GET_ERROR();
+            if (sock_err == EINTR) {
+                continue;
+            }
+            logger_log(raop_rtp_mirror->logger, LOGGER_ERR,
+                       "raop_rtp_mirror error in epoll_wait %d %s", sock_err, SOCKET_ERROR_STRING(sock_err));
+            break;
+        }
+        for (int i = 0; i < ret; i++) {
+            if (events[i].data.fd == raop_rtp_mirror->stop_fd) {
+                stop = true;
+            } else if (stream_fd == -1 && events[i].data.fd == raop_rtp_mirror->mirror_data_sock) {
+                listen_ready = true;
+            } else if (stream_fd != -1 && events[i].data.fd == stream_fd) {
+                stream_ready = true;
+            }
+        }
+        if (stop) {
+            logger_log(raop_rtp_mirror->logger, LOGGER_INFO, "raop_rtp_mirror->running is no longer true");
+            break;
+        }
+#else
         fd_set rfds;
         struct timeval tv;
-        int nfds, ret;
+        int nfds;
         MUTEX_LOCK(raop_rtp_mirror->run_mutex);
         if (!raop_rtp_mirror->running) {
             MUTEX_UNLOCK(raop_rtp_mirror->run_mutex);
@@ -244,10 +351,12 @@ raop_rtp_mirror_thread(void *arg)
                        "raop_rtp_mirror error in select %d %s", sock_err, SOCKET_ERROR_STRING(sock_err));
             break;
         }
+        listen_ready = (stream_fd == -1 && raop_rtp_mirror->mirror_data_sock >= 0 &&
+                        FD_ISSET(raop_rtp_mirror->mirror_data_sock, &rfds));
+        stream_ready = (stream_fd != -1 && FD_ISSET(stream_fd, &rfds));
+#endif
 
-        if (stream_fd == -1 &&
-	    (raop_rtp_mirror && raop_rtp_mirror->mirror_data_sock >= 0) &&
-            FD_ISSET(raop_rtp_mirror->mirror_data_sock, &rfds)) {
+        if (listen_ready) {
             struct sockaddr_storage saddr;
             socklen_t saddrlen;
             logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror accepting client");
@@ -260,6 +369,21 @@ raop_rtp_mirror_thread(void *arg)
                 break;
             }
 
+#ifdef MIRROR_USE_EPOLL
+            // recv must never block: a partially-received header or payload is completed when more data arrives
+            int flags = fcntl(stream_fd, F_GETFL, 0);
+            if (flags == -1 || fcntl(stream_fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+                int sock_err = SOCKET_GET_ERROR();
+                logger_log(raop_rtp_mirror->logger, LOGGER_ERR,
+                           "raop_rtp_mirror could not set stream socket non-blocking %d %s", sock_err, SOCKET_ERROR_STRING(sock_err));
+                break;
+            }
+            /* stop listening for new connections while this one is active */
+            if (raop_rtp_mirror_epoll_ctl(raop_rtp_mirror, epoll_fd, EPOLL_CTL_DEL, raop_rtp_mirror->mirror_data_sock) ||
+                raop_rtp_mirror_epoll_ctl(raop_rtp_mirror, epoll_fd, EPOLL_CTL_ADD, stream_fd)) {
+                break;
+            }
+#else
             // We're calling recv for a certain amount of data, so we need a timeout
             struct timeval tv;
             tv.tv_sec = 0;
@@ -270,6 +394,7 @@ raop_rtp_mirror_thread(void *arg)
                            "raop_rtp_mirror could not set stream socket timeout %d %s", sock_err, SOCKET_ERROR_STRING(sock_err));
                 break;
             }
+#endif
 
             int option;
             option = 1;
@@ -302,7 +427,7 @@ raop_rtp_mirror_thread(void *arg)
             readstart = 0;
         }
 
-        if (stream_fd != -1 && FD_ISSET(stream_fd, &rfds)) {
+        if (stream_ready) {
 
             // The first 128 bytes are some kind of header for the payload that follows
             while (payload == NULL && readstart < 128) {
@@ -315,8 +440,14 @@ raop_rtp_mirror_thread(void *arg)
             if (payload == NULL && ret == 0) {
                 logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG,
                            "raop_rtp_mirror tcp socket was closed by client (recv returned 0); got %d bytes of 128 byte header",readstart);
-                FD_CLR(stream_fd, &rfds);
+                closesocket(stream_fd);
                 stream_fd = -1;
+#ifdef MIRROR_USE_EPOLL
+                /* resume listening for a new connection */
+                if (raop_rtp_mirror_epoll_ctl(raop_rtp_mirror, epoll_fd, EPOLL_CTL_ADD, raop_rtp_mirror->mirror_data_sock)) {
+                    break;
+                }
+#endif
                 continue;
             } else if (payload == NULL && ret == -1) {
                 int sock_err = SOCKET_GET_ERROR();
@@ -372,7 +503,24 @@ raop_rtp_mirror_thread(void *arg)
             /* "streaming report" packets have no timestamp in packet[8:15] */
 
             if (payload == NULL) {
-                payload = malloc(payload_size);
+                /* an encrypted VCL NAL payload is received directly into the buffer that is handed to the  *
+                 * video renderer, leaving room in front of it for any SPS+PPS NALs that will be prepended */
+                payload_offset = 0;
+                if (packet[4] == 0x00 && prepend_sps_pps) {
+                    if (ntp_timestamp_raw != ntp_timestamp_nal) {
+                        logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG,
+                                   "raop_rtp_mirror: prepended sps_pps timestamp does not match timestamp of "
+                                   "video payload\n%llu\n%llu , discarding", ntp_timestamp_raw, ntp_timestamp_nal);
+                        frame_pool_release(sps_pps);
+                        sps_pps = NULL;
+                        prepend_sps_pps = false;
+                    } else {
+                        payload_offset = sps_pps_len;
+                    }
+                }
+                payload_buffer = frame_pool_get(raop_rtp_mirror->frame_pool, payload_offset + payload_size);
+                assert(payload_buffer);
+                payload = payload_buffer + payload_offset;
                 readstart = 0;
             }
 
@@ -414,8 +562,8 @@ raop_rtp_mirror_thread(void *arg)
                                (double) ntp_timestamp_remote / SEC, packet_description, h265_video ? h265 : h264);
                 }
 
-                unsigned char* payload_out;
-		unsigned char* payload_decrypted;
+                unsigned char* payload_out = payload_buffer;
+                unsigned char* payload_decrypted = payload;
                 /*
                  * nal_types:1   Coded non-partitioned slice of a non-IDR picture
                  *           5   Coded non-partitioned slice of an IDR picture
@@ -430,133 +578,129 @@ raop_rtp_mirror_thread(void *arg)
                  *
                  * The flag prepend_sps_pps = true will signal that the  previous packet contained a SPS NAL + a PPS NAL, 
                  * that has not yet been sent.   This will trigger prepending it to the current NAL, and the prepend_sps_pps 
-                 * flag will be set to false after it has been prepended.  */
+                 * flag will be set to false after it has been prepended. (Space for it was reserved at the start of
+                 * payload_buffer when the payload was received, after checking that the timestamps match.) */
 
-                if (prepend_sps_pps & (ntp_timestamp_raw != ntp_timestamp_nal)) {
-                        logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG,
-                                   "raop_rtp_mirror: prepended sps_pps timestamp does not match timestamp of "
-                                   "video payload\n%llu\n%llu , discarding", ntp_timestamp_raw, ntp_timestamp_nal);
-                        free (sps_pps);
-		        sps_pps = NULL;
-                        prepend_sps_pps = false;
-                }
-		
                 if (prepend_sps_pps) {
                     assert(sps_pps);
-                    payload_out = (unsigned char*)  malloc(payload_size + sps_pps_len);
-                    payload_decrypted = payload_out + sps_pps_len;
+                    assert(payload_offset == sps_pps_len);
                     memcpy(payload_out, sps_pps, sps_pps_len);
-                    free (sps_pps);
+                    frame_pool_release(sps_pps);
 		    sps_pps = NULL;
-                } else {
-                    payload_out = (unsigned char*)  malloc(payload_size);
-                    payload_decrypted = payload_out;
                 }
-                // Decrypt data
-                mirror_buffer_decrypt(raop_rtp_mirror->buffer, payload, payload_decrypted, payload_size);
-
-                // It seems the AirPlay protocol prepends NALs with their size, which we're replacing with the 4-byte
-                // start code for the NAL Byte-Stream Format.
-                bool valid_data = true;
-                int nalu_size = 0;
+                // Decrypt data (in place).  It seems the AirPlay protocol prepends NALs with their size, which
+                // is replaced with the 4-byte start code for the NAL Byte-Stream Format during decryption.
+                video_decode_struct video_data;
+                int nal_index_start = (prepend_sps_pps ? sps_pps_nal_count : 0);
                 int nalus_count = 0;
-                while (nalu_size < payload_size) {
-                    int nc_len = byteutils_get_int_be(payload_decrypted, nalu_size);
-                    if (nc_len < 0 || nalu_size + 4 > payload_size) {
-                        valid_data = false;
-                        break;
+                bool valid_data = mirror_buffer_decrypt_nal_units(raop_rtp_mirror->buffer, payload_decrypted, payload_size,
+                                                                  h265_video, video_data.nal_units + nal_index_start,
+                                                                  VIDEO_MAX_NAL_UNITS - nal_index_start, &nalus_count);
+                if (nal_index_start) {
+                    memcpy(video_data.nal_units, sps_pps_nal_units, nal_index_start * sizeof(video_nal_unit_t));
+                }
+                int nal_index_end = nal_index_start + nalus_count;
+                if (nal_index_end > VIDEO_MAX_NAL_UNITS) {
+                    nal_index_end = VIDEO_MAX_NAL_UNITS;
+                }
+                video_data.is_keyframe = false;
+                video_data.is_reference = false;
+                for (int i = nal_index_start; i < nal_index_end; i++) {
+                    video_nal_unit_t *nal_unit = &video_data.nal_units[i];
+                    int nalu_size = nal_unit->offset + 4;      /* bytes of payload preceding the NAL unit */
+                    int nc_len = nal_unit->length;
+                    int nalu_type = nal_unit->type;
+                    nal_unit->offset += payload_offset;       /* NAL unit offsets in payload_out */
+                    /* h264 IDR: type 5; h265 IRAP (BLA, IDR, CRA): types 16 - 21 */
+                    if (h265_video ? (nalu_type >= 16 && nalu_type <= 21) : (nalu_type == 5)) {
+                        video_data.is_keyframe = true;
                     }
-                    memcpy(payload_decrypted + nalu_size, nal_start_code, 4);
-                    nalu_size += 4;
-                    nalus_count++;
-                    /* first bit of h264 nalu MUST be 0 ("forbidden_zero_bit") */
-                    if (payload_decrypted[nalu_size] & 0x80) {
-                        valid_data = false;
-                        break;
+                    /* h264 VCL NAL with nal_ref_idc != 0; h265 VCL NAL that is not a sub-layer non-reference type */
+                    if (h265_video ? (nalu_type < 32 && !(nalu_type <= 14 && nalu_type % 2 == 0)) :
+                        ((nalu_type == 1 || nalu_type == 5) && (payload_decrypted[nalu_size] >> 5))) {
+                        video_data.is_reference = true;
                     }
-		    int nalu_type;
-		    if (h265_video) {
-                        nalu_type = payload_decrypted[nalu_size] & 0x7e >> 1;;
+                    if (h265_video) {
                         //logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG," h265 video, NALU type %d, size %d", nalu_type, nc_len);
-		    } else {
-                        nalu_type = payload_decrypted[nalu_size] & 0x1f;
-                        int ref_idc = (payload_decrypted[nalu_size] >> 5);
-                        switch (nalu_type) {
-                        case 14:  /* Prefix NALu , seen before all VCL Nalu's in AirMyPc */
-                        case 5:   /*IDR, slice_layer_without_partitioning */
-                        case 1:   /*non-IDR, slice_layer_without_partitioning */
-                            break;
-	                case 2:   /* slice data partition A */
-                        case 3:   /* slice data partition B */
-                        case 4:   /* slice data partition C */
-                            logger_log(raop_rtp_mirror->logger, LOGGER_INFO,
-                                       "unexpected partitioned VCL NAL unit: nalu_type = %d, ref_idc = %d, nalu_size = %d,"
-                                       "processed bytes %d, payloadsize = %d nalus_count = %d",
-                                       nalu_type, ref_idc, nc_len, nalu_size, payload_size, nalus_count);
-                            break;
-                        case 6:
-                            if (logger_debug) {
-                                char *str = utils_data_to_string(payload_decrypted + nalu_size, nc_len, 16); 
-                                logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror SEI NAL size = %d", nc_len);		
-                                logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG,
-                                           "raop_rtp_mirror h264 Supplemental Enhancement Information:\n%s", str);
-                                free(str);
-                            }
-                            break;
-                        case 7:
-                            if (logger_debug) {
-                                char *str = utils_data_to_string(payload_decrypted + nalu_size, nc_len, 16); 
-                                logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror SPS NAL size = %d", nc_len);		
-                                logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG,
-                                           "raop_rtp_mirror h264 Sequence Parameter Set:\n%s", str);
-                                free(str);
-                            }
-                            break;
-                        case 8:
-                            if (logger_debug) {
-                                char *str = utils_data_to_string(payload_decrypted + nalu_size, nc_len, 16); 
-                                logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror PPS NAL size = %d", nc_len);		
-                                logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG,
-                                           "raop_rtp_mirror h264 Picture Parameter Set :\n%s", str);
-                                free(str);
-                            }
-                            break;
-                        default:
-                            logger_log(raop_rtp_mirror->logger, LOGGER_INFO,
-                                       "unexpected non-VCL NAL unit: nalu_type = %d, ref_idc = %d, nalu_size = %d,"
-                                       "processed bytes %d, payloadsize = %d nalus_count = %d",
-                                       nalu_type, ref_idc, nc_len, nalu_size, payload_size, nalus_count);
-			    break;
-		        }
-		    }
-                    nalu_size += nc_len;
+                        continue;
+                    }
+                    int ref_idc = (payload_decrypted[nalu_size] >> 5);
+                    switch (nalu_type) {
+                    case 14:  /* Prefix NALu , seen before all VCL Nalu's in AirMyPc */
+                    case 5:   /*IDR, slice_layer_without_partitioning */
+                    case 1:   /*non-IDR, slice_layer_without_partitioning */
+                        break;
+                    case 2:   /* slice data partition A */
+                    case 3:   /* slice data partition B */
+                    case 4:   /* slice data partition C */
+                        logger_log(raop_rtp_mirror->logger, LOGGER_INFO,
+                                   "unexpected partitioned VCL NAL unit: nalu_type = %d, ref_idc = %d, nalu_size = %d,"
+                                   "processed bytes %d, payloadsize = %d nalus_count = %d",
+                                   nalu_type, ref_idc, nc_len, nalu_size, payload_size, i - nal_index_start + 1);
+                        break;
+                    case 6:
+                        if (logger_debug) {
+                            char *str = utils_data_to_string(payload_decrypted + nalu_size, nc_len, 16); 
+                            logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror SEI NAL size = %d", nc_len);		
+                            logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG,
+                                       "raop_rtp_mirror h264 Supplemental Enhancement Information:\n%s", str);
+                            free(str);
+                        }
+                        break;
+                    case 7:
+                        if (logger_debug) {
+                            char *str = utils_data_to_string(payload_decrypted + nalu_size, nc_len, 16); 
+                            logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror SPS NAL size = %d", nc_len);		
+                            logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG,
+                                       "raop_rtp_mirror h264 Sequence Parameter Set:\n%s", str);
+                            free(str);
+                        }
+                        break;
+                    case 8:
+                        if (logger_debug) {
+                            char *str = utils_data_to_string(payload_decrypted + nalu_size, nc_len, 16); 
+                            logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror PPS NAL size = %d", nc_len);		
+                            logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG,
+                                       "raop_rtp_mirror h264 Picture Parameter Set :\n%s", str);
+                            free(str);
+                        }
+                        break;
+                    default:
+                        logger_log(raop_rtp_mirror->logger, LOGGER_INFO,
+                                   "unexpected non-VCL NAL unit: nalu_type = %d, ref_idc = %d, nalu_size = %d,"
+                                   "processed bytes %d, payloadsize = %d nalus_count = %d",
+                                   nalu_type, ref_idc, nc_len, nalu_size, payload_size, i - nal_index_start + 1);
+                        break;
+                    }
                 }
-                if (nalu_size != payload_size) valid_data = false;
                 if(!valid_data) {
                     logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "nalu marked as invalid");
+                    video_data.is_keyframe = false;
+                    video_data.is_reference = true;
                     payload_out[0] = 1; /* mark video data as invalid h264 (failed decryption) */
                 }
 
 		
                 payload_decrypted = NULL;
-                video_decode_struct video_data;
 		video_data.is_h265 = h265_video;
                 video_data.ntp_time_local = ntp_timestamp_local;
                 video_data.ntp_time_remote = ntp_timestamp_remote;
                 video_data.nal_count = nalus_count;   /*nal_count will be the number of nal units in the packet */
                 video_data.data_len = payload_size;
                 video_data.data = payload_out;
+                video_data.data_release = frame_pool_release;
                 if (prepend_sps_pps) {
                     video_data.data_len += sps_pps_len;
-                    video_data.nal_count += 2;
-                    if (h265_video) {
-                        video_data.nal_count++;
-                    }
+                    video_data.nal_count += sps_pps_nal_count;
                     prepend_sps_pps =  false;
                 }
 
                 raop_rtp_mirror->callbacks.video_process(raop_rtp_mirror->callbacks.cls, raop_rtp_mirror->ntp, &video_data);
-                free(payload_out);
+                /* video_data.data is set to NULL if the renderer took ownership of payload_buffer */
+                if (video_data.data) {
+                    frame_pool_release(video_data.data);
+                }
+                payload_buffer = NULL;
                 break;
             case 0x01:
                 /* 128-byte observed packet header structure 
@@ -622,7 +766,7 @@ raop_rtp_mirror_thread(void *arg)
                     break;
                 }
                 if (sps_pps) {
-                    free(sps_pps);
+                    frame_pool_release(sps_pps);
                     sps_pps = NULL;
                 }
 		/* test for a H265 VPS/SPS/PPS */
@@ -700,7 +844,7 @@ raop_rtp_mirror_thread(void *arg)
                     }
 
                     sps_pps_len = vps_size + sps_size + pps_size + 12;
-                    sps_pps = (unsigned char*) malloc(sps_pps_len);
+                    sps_pps = frame_pool_get(raop_rtp_mirror->frame_pool, sps_pps_len);
                     assert(sps_pps);
                     ptr = sps_pps;
                     memcpy(ptr, nal_start_code, 4);
@@ -714,6 +858,17 @@ raop_rtp_mirror_thread(void *arg)
                     memcpy(ptr, nal_start_code, 4);
                     ptr += 4;
                     memcpy(ptr, pps, pps_size);
+
+                    sps_pps_nal_count = 3;
+                    sps_pps_nal_units[0].offset = 0;
+                    sps_pps_nal_units[0].length = vps_size;
+                    sps_pps_nal_units[0].type = 32;   /* VPS */
+                    sps_pps_nal_units[1].offset = vps_size + 4;
+                    sps_pps_nal_units[1].length = sps_size;
+                    sps_pps_nal_units[1].type = 33;   /* SPS */
+                    sps_pps_nal_units[2].offset = vps_size + sps_size + 8;
+                    sps_pps_nal_units[2].length = pps_size;
+                    sps_pps_nal_units[2].type = 34;   /* PPS */
                 } else {
                     if (codec == VIDEO_CODEC_UNKNOWN) {
                         codec = VIDEO_CODEC_H264;
@@ -761,12 +916,20 @@ raop_rtp_mirror_thread(void *arg)
 
                     // Copy the sps and pps into a buffer to prepend to the next NAL unit.
                     sps_pps_len = sps_size + pps_size + 8;
-                    sps_pps = (unsigned char*) malloc(sps_pps_len);
+                    sps_pps = frame_pool_get(raop_rtp_mirror->frame_pool, sps_pps_len);
                     assert(sps_pps);
                     memcpy(sps_pps, nal_start_code, 4);
                     memcpy(sps_pps + 4, sequence_parameter_set, sps_size);
                     memcpy(sps_pps + sps_size + 4, nal_start_code, 4); 
                     memcpy(sps_pps + sps_size + 8, payload + sps_size + 11, pps_size);
+
+                    sps_pps_nal_count = 2;
+                    sps_pps_nal_units[0].offset = 0;
+                    sps_pps_nal_units[0].length = sps_size;
+                    sps_pps_nal_units[0].type = 7;    /* SPS */
+                    sps_pps_nal_units[1].offset = sps_size + 4;
+                    sps_pps_nal_units[1].length = pps_size;
+                    sps_pps_nal_units[1].type = 8;    /* PPS */
                 }
                 prepend_sps_pps = true;
                 // h264codec_t h264;
@@ -827,7 +990,10 @@ raop_rtp_mirror_thread(void *arg)
                 break;
             }
 
-            free(payload);
+            if (payload_buffer) {
+                frame_pool_release(payload_buffer);
+                payload_buffer = NULL;
+            }
             payload = NULL;
             memset(packet, 0, 128);
             readstart = 0;
@@ -836,10 +1002,29 @@ raop_rtp_mirror_thread(void *arg)
             }
         }
     }
+    if (payload_buffer) {
+        frame_pool_release(payload_buffer);
+    }
+    if (sps_pps) {
+        frame_pool_release(sps_pps);
+    }
+
+    if (logger_debug) {
+        frame_pool_stats_t stats;
+        frame_pool_get_stats(raop_rtp_mirror->frame_pool, &stats);
+        logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror frame pool: hits %llu misses %llu,"
+                   " bytes in use %zu, cached %zu, peak %zu", (unsigned long long) stats.hits,
+                   (unsigned long long) stats.misses, stats.bytes_in_use, stats.bytes_cached, stats.peak_bytes);
+    }
     /* Close the stream file descriptor */
     if (stream_fd != -1) {
         closesocket(stream_fd);
     }
+#ifdef MIRROR_USE_EPOLL
+    if (epoll_fd != -1) {
+        close(epoll_fd);
+    }
+#endif
 
     // Ensure running reflects the actual state
     MUTEX_LOCK(raop_rtp_mirror->run_mutex);
@@ -923,6 +1108,11 @@ raop_rtp_mirror_start(raop_rtp_mirror_t *raop_rtp_mirror, unsigned short *mirror
     /* Create the thread and initialize running values */
     raop_rtp_mirror->running = 1;
     raop_rtp_mirror->joined = 0;
+#ifdef MIRROR_USE_EPOLL
+    /* clear any stop request left over from a previous run */
+    eventfd_t value;
+    eventfd_read(raop_rtp_mirror->stop_fd, &value);
+#endif
 
     THREAD_CREATE(raop_rtp_mirror->thread_mirror, raop_rtp_mirror_thread, raop_rtp_mirror);
     MUTEX_UNLOCK(raop_rtp_mirror->run_mutex);
@@ -940,6 +1130,10 @@ void raop_rtp_mirror_stop(raop_rtp_mirror_t *raop_rtp_mirror) {
     }
     raop_rtp_mirror->running = 0;
     MUTEX_UNLOCK(raop_rtp_mirror->run_mutex);
+#ifdef MIRROR_USE_EPOLL
+    /* wake the thread */
+    eventfd_write(raop_rtp_mirror->stop_fd, 1);
+#endif
 
     /* Join the thread */
     THREAD_JOIN(raop_rtp_mirror->thread_mirror);
@@ -960,6 +1154,10 @@ void raop_rtp_mirror_destroy(raop_rtp_mirror_t *raop_rtp_mirror) {
         raop_rtp_mirror_stop(raop_rtp_mirror);
         MUTEX_DESTROY(raop_rtp_mirror->run_mutex);
         mirror_buffer_destroy(raop_rtp_mirror->buffer);
+        frame_pool_destroy(raop_rtp_mirror->frame_pool);
+#ifdef MIRROR_USE_EPOLL
+        close(raop_rtp_mirror->stop_fd);
+#endif
 	free(raop_rtp_mirror);
     }
 }
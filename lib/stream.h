@@ -21,13 +21,32 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#define VIDEO_MAX_NAL_UNITS 16
+
+typedef struct {
+    int offset;        /* position in data of the NAL unit's 4-byte start code */
+    int length;        /* length of the NAL unit, not including the start code */
+    int type;          /* nal_unit_type (h264 or h265) */
+} video_nal_unit_t;
+
 typedef struct {
     bool is_h265;
     int nal_count;
+    /* index of the first (up to VIDEO_MAX_NAL_UNITS) NAL units in data */
+    video_nal_unit_t nal_units[VIDEO_MAX_NAL_UNITS];
+    /* data contains an IDR (h264) or IRAP (h265) picture, and does not depend on earlier frames */
+    bool is_keyframe;
+    /* data contains a reference picture (other frames may depend on it) */
+    bool is_reference;
     unsigned char *data;
     int data_len;
     uint64_t ntp_time_local;
     uint64_t ntp_time_remote;
+    /* if data_release is not NULL, the video_process callback can take ownership of data  *
+     * (e.g., to pass it to the renderer without copying) by setting data = NULL; it must  *
+     * then call data_release(data) when finished with it.  Otherwise data is released by *
+     * the caller after video_process returns.                                             */
+    void (*data_release)(void *data);
 } video_decode_struct;
 
 typedef struct {
@@ -39,6 +58,29 @@ typedef struct {
     uint64_t ntp_time_remote;
     uint64_t rtp_time;
     unsigned short seqnum;
+    /* data is a synthesized frame replacing a lost packet (packet-loss concealment) */
+    bool concealed;
 } audio_decode_struct;
 
+/* resend round-trip latency histogram: bin i counts latencies < (10 << i) msecs, the last bin all the rest */
+#define AUDIO_RESEND_LATENCY_BINS 8
+
+/* per-session statistics of the audio RTP stream */
+typedef struct {
+    uint64_t packets_received;       /* audio packets (including resent ones) stored in the buffer */
+    uint64_t packets_duplicate;      /* packets that were already in the buffer (AAC-ELD packets are sent 3 times) */
+    uint64_t packets_late;           /* packets that arrived after their turn to be played */
+    uint64_t packets_lost;           /* packets that never arrived in time to be played */
+    uint64_t resend_requests;        /* resend requests sent to the client */
+    uint64_t resend_packets;         /* packets for which a resend was requested */
+    uint64_t resends_satisfied;      /* requested packets that arrived before their turn to be played */
+    uint64_t resends_abandoned;      /* missing packets given up on (RESEND_MAX_ATTEMPTS unanswered, or too late) */
+    uint64_t packets_concealed;      /* lost packets replaced by synthesized frames */
+    uint64_t resend_latency_hist[AUDIO_RESEND_LATENCY_BINS];
+    double jitter;                   /* RFC 3550 interarrival jitter, in seconds */
+    double playout_shift;            /* current adaptive playout delay shift, in seconds */
+    double clock_drift_ppm;          /* estimated drift of the client clock relative to the local clock */
+    bool session_end;                /* final report for the session */
+} audio_rtp_stats_t;
+
 #endif //AIRPLAYSERVER_STREAM_H
@@ -29,6 +29,7 @@
 #define NFORMATS 2     /* set to 4 to enable AAC_LD and PCM:  allowed, but  never seen in real-world use */
 
 static GstClockTime gst_audio_pipeline_base_time = GST_CLOCK_TIME_NONE;
+static GstClockType pipeline_clock_type = GST_CLOCK_TYPE_REALTIME;
 static logger_t *logger = NULL;
 const char * format[NFORMATS];
 
@@ -125,11 +126,31 @@ bool gstreamer_init(){
     return (bool) check_plugins ();
 }
 
+/* the pipeline clock must be the clock that is used for timestamps by raop_ntp: returns false *
+ * if GStreamer cannot provide it.  (Call this before audio_renderer_init.)                   */
+bool audio_renderer_set_clock(clockid_t clock_id) {
+    switch (clock_id) {
+    case CLOCK_REALTIME:
+        pipeline_clock_type = GST_CLOCK_TYPE_REALTIME;
+        return true;
+    case CLOCK_MONOTONIC:
+        pipeline_clock_type = GST_CLOCK_TYPE_MONOTONIC;
+        return true;
+#if defined(CLOCK_TAI) && GST_CHECK_VERSION(1,18,0)
+    case CLOCK_TAI:
+        pipeline_clock_type = GST_CLOCK_TYPE_TAI;
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
 void audio_renderer_init(logger_t *render_logger, const char* audiosink, const bool* audio_sync, const bool* video_sync) {
     GError *error = NULL;
     GstCaps *caps = NULL;
     GstClock *clock = gst_system_clock_obtain();
-    g_object_set(clock, "clock-type", GST_CLOCK_TYPE_REALTIME, NULL);
+    g_object_set(clock, "clock-type", pipeline_clock_type, NULL);
 
     logger = render_logger;
     
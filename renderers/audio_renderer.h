@@ -30,9 +30,11 @@ extern "C" {
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <time.h>
 #include "../lib/logger.h"
 
 bool gstreamer_init();
+bool audio_renderer_set_clock(clockid_t clock_id);
 void audio_renderer_init(logger_t *logger, const char* audiosink, const bool *audio_sync, const bool *video_sync);
 void audio_renderer_start(unsigned char* compression_type);
 void audio_renderer_stop();
@@ -35,6 +35,7 @@ static unsigned char X11_search_attempts;
 #endif
 
 static GstClockTime gst_video_pipeline_base_time = GST_CLOCK_TIME_NONE;
+static GstClockType pipeline_clock_type = GST_CLOCK_TYPE_REALTIME;
 static logger_t *logger = NULL;
 static unsigned short width, height, width_source, height_source;  /* not currently used */
 static bool first_packet = false;
@@ -55,6 +56,28 @@ static gboolean hls_playing;
 static gboolean hls_buffer_empty;
 static gboolean hls_buffer_full;
 
+/* Bounded ingest queue: frames pushed into appsrc that have not yet left the "queue" element *
+ * in front of the parser and decoder.  If a decoder cannot keep up, this backlog would grow  *
+ * without limit; when any of the (optional) limits on frames, bytes or (stream) time is      *
+ * exceeded, non-reference frames are dropped, and if that is not enough, all frames until    *
+ * the next keyframe are dropped.                                                             */
+#define INGEST_RING_SIZE 1024
+typedef struct {
+    uint64_t ntp_time;
+    int bytes;
+} ingest_entry_t;
+static GMutex ingest_mutex;
+static ingest_entry_t ingest_ring[INGEST_RING_SIZE];
+static guint ingest_head = 0;
+static guint ingest_count = 0;
+static guint64 ingest_bytes = 0;
+static guint ingest_max_frames = 0;
+static guint64 ingest_max_bytes = 0;
+static guint64 ingest_max_time = 0;    /* nsecs */
+static bool ingest_limited = false;
+static bool ingest_drop_until_keyframe = false;
+static video_ingest_stats_t ingest_stats;
+
 
 typedef enum {
   //GST_PLAY_FLAG_VIDEO         = (1 << 0),
@@ -169,6 +192,117 @@ static const char jpeg_caps[]="image/jpeg";
 static const char h264_caps[]="video/x-h264,stream-format=(string)byte-stream,alignment=(string)au";
 static const char h265_caps[]="video/x-h265,stream-format=(string)byte-stream,alignment=(string)au";
 
+void video_renderer_set_ingest_limits(unsigned int max_frames, unsigned int max_kbytes, unsigned int max_ms) {
+    ingest_max_frames = (max_frames < INGEST_RING_SIZE ? max_frames : INGEST_RING_SIZE);
+    ingest_max_bytes = (guint64) max_kbytes * 1024;
+    ingest_max_time = (guint64) max_ms * 1000000;
+    ingest_limited = (max_frames || max_kbytes || max_ms);
+}
+
+/* the pipeline clock must be the clock that is used for timestamps by raop_ntp: returns false *
+ * if GStreamer cannot provide it.  (Call this before video_renderer_init.)                   */
+bool video_renderer_set_clock(clockid_t clock_id) {
+    switch (clock_id) {
+    case CLOCK_REALTIME:
+        pipeline_clock_type = GST_CLOCK_TYPE_REALTIME;
+        return true;
+    case CLOCK_MONOTONIC:
+        pipeline_clock_type = GST_CLOCK_TYPE_MONOTONIC;
+        return true;
+#if defined(CLOCK_TAI) && GST_CHECK_VERSION(1,18,0)
+    case CLOCK_TAI:
+        pipeline_clock_type = GST_CLOCK_TYPE_TAI;
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+void video_renderer_get_ingest_stats(video_ingest_stats_t *stats) {
+    g_mutex_lock(&ingest_mutex);
+    memcpy(stats, &ingest_stats, sizeof(video_ingest_stats_t));
+    g_mutex_unlock(&ingest_mutex);
+}
+
+static void ingest_queue_reset() {
+    g_mutex_lock(&ingest_mutex);
+    ingest_head = 0;
+    ingest_count = 0;
+    ingest_bytes = 0;
+    ingest_drop_until_keyframe = false;
+    g_mutex_unlock(&ingest_mutex);
+}
+
+/* called (in a GStreamer streaming thread) for each frame leaving the ingest queue */
+static GstPadProbeReturn ingest_queue_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    g_mutex_lock(&ingest_mutex);
+    if (ingest_count) {
+        ingest_bytes -= ingest_ring[ingest_head].bytes;
+        ingest_head = (ingest_head + 1) % INGEST_RING_SIZE;
+        ingest_count--;
+    }
+    g_mutex_unlock(&ingest_mutex);
+    return GST_PAD_PROBE_OK;
+}
+
+/* returns false if the frame should be dropped */
+static bool ingest_queue_admit(int bytes, uint64_t ntp_time, bool is_keyframe, bool is_reference) {
+    bool admit = true;
+    g_mutex_lock(&ingest_mutex);
+    bool over_limit = false;
+    if (ingest_max_frames && ingest_count >= ingest_max_frames) {
+        over_limit = true;
+    }
+    if (ingest_max_bytes && ingest_bytes + bytes > ingest_max_bytes) {
+        over_limit = true;
+    }
+    if (ingest_max_time && ingest_count && ntp_time > ingest_ring[ingest_head].ntp_time &&
+        ntp_time - ingest_ring[ingest_head].ntp_time > ingest_max_time) {
+        over_limit = true;
+    }
+    if (ingest_count == INGEST_RING_SIZE) {
+        /* ingest_queue_probe needs a ring entry for every frame pushed: with no room, even a keyframe is dropped */
+        if (!ingest_drop_until_keyframe) {
+            logger_log(logger, LOGGER_DEBUG, "video ingest: backlog of %u frames fills the ingest ring,"
+                       " dropping frames until next keyframe", ingest_count);
+            ingest_drop_until_keyframe = true;
+        }
+        ingest_stats.dropped_until_keyframe++;
+        admit = false;
+    } else if (is_keyframe) {
+        if (ingest_drop_until_keyframe) {
+            logger_log(logger, LOGGER_DEBUG, "video ingest: keyframe received, stop dropping frames");
+            ingest_drop_until_keyframe = false;
+        }
+    } else if (ingest_drop_until_keyframe) {
+        ingest_stats.dropped_until_keyframe++;
+        admit = false;
+    } else if (over_limit && !is_reference) {
+        ingest_stats.dropped_non_reference++;
+        admit = false;
+    } else if (over_limit) {
+        logger_log(logger, LOGGER_DEBUG, "video ingest: backlog of %u frames (%llu bytes) exceeds limits,"
+                   " dropping frames until next keyframe", ingest_count, (unsigned long long) ingest_bytes);
+        ingest_drop_until_keyframe = true;
+        ingest_stats.dropped_until_keyframe++;
+        admit = false;
+    }
+    if (admit) {
+        ingest_entry_t *entry = &ingest_ring[(ingest_head + ingest_count) % INGEST_RING_SIZE];
+        entry->ntp_time = ntp_time;
+        entry->bytes = bytes;
+        ingest_bytes += bytes;
+        ingest_count++;
+        if (ingest_count > ingest_stats.peak_frames_queued) {
+            ingest_stats.peak_frames_queued = ingest_count;
+        }
+        ingest_stats.frames_pushed++;
+    }
+    g_mutex_unlock(&ingest_mutex);
+    return admit;
+}
+
 void video_renderer_size(float *f_width_source, float *f_height_source, float *f_width, float *f_height) {
     width_source = (unsigned short) *f_width_source;
     height_source = (unsigned short) *f_height_source;
@@ -323,7 +457,7 @@ void  video_renderer_init(logger_t *render_logger, const char *server_name, vide
 	    if (jpeg_pipeline) {
                 g_string_append(launch, "jpegdec ");
 	    } else {
-                g_string_append(launch, "queue ! ");
+                g_string_append(launch, "queue name=ingest_queue ! ");
                 g_string_append(launch, parser);
                 g_string_append(launch, " ! ");
                 g_string_append(launch, decoder);
@@ -379,11 +513,19 @@ void  video_renderer_init(logger_t *render_logger, const char *server_name, vide
             g_assert (renderer_type[i]->pipeline);
 
             GstClock *clock = gst_system_clock_obtain();
-            g_object_set(clock, "clock-type", GST_CLOCK_TYPE_REALTIME, NULL);
+            g_object_set(clock, "clock-type", pipeline_clock_type, NULL);
             gst_pipeline_use_clock(GST_PIPELINE_CAST(renderer_type[i]->pipeline), clock);
             renderer_type[i]->appsrc = gst_bin_get_by_name (GST_BIN (renderer_type[i]->pipeline), "video_source");
             g_assert(renderer_type[i]->appsrc);
             g_object_set(renderer_type[i]->appsrc, "caps", caps, "stream-type", 0, "is-live", TRUE, "format", GST_FORMAT_TIME, NULL);
+            if (ingest_limited && !jpeg_pipeline) {
+                GstElement *queue = gst_bin_get_by_name (GST_BIN (renderer_type[i]->pipeline), "ingest_queue");
+                g_assert(queue);
+                GstPad *pad = gst_element_get_static_pad(queue, "src");
+                gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, ingest_queue_probe, NULL, NULL);
+                gst_object_unref(pad);
+                gst_object_unref(queue);
+            }
             g_string_free(launch, TRUE);
             gst_caps_unref(caps);
 	    gst_object_unref(clock);
@@ -478,6 +620,7 @@ void video_renderer_start() {
     }
     renderer = NULL;
     first_packet = true;
+    ingest_queue_reset();
 #ifdef X_DISPLAY_FIX
     X11_search_attempts = 0;
 #endif
@@ -513,8 +656,13 @@ void video_renderer_display_jpeg(const void *data, int *data_len) {
     }  
 }
 
-uint64_t video_renderer_render_buffer(unsigned char* data, int *data_len, int *nal_count, uint64_t *ntp_time) {
+/* if data_release is not NULL, the GstBuffer wraps *data without copying it, and takes ownership *
+ * of it: *data is then set to NULL, and data_release(data) will be called by GStreamer when the   *
+ * buffer is no longer needed. Otherwise, *data is copied into a new GstBuffer                    */
+uint64_t video_renderer_render_buffer(unsigned char** data_ptr, int *data_len, int *nal_count, bool is_keyframe,
+                                      bool is_reference, uint64_t *ntp_time, void (*data_release)(void *data)) {
     GstBuffer *buffer;
+    unsigned char *data = *data_ptr;
     GstClockTime pts = (GstClockTime) *ntp_time; /*now in nsecs */
     //GstClockTimeDiff latency = GST_CLOCK_DIFF(gst_element_get_current_clock_time (renderer->appsrc), pts);
     if (sync) {
@@ -531,7 +679,9 @@ uint64_t video_renderer_render_buffer(unsigned char* data, int *data_len, int *n
     /* first four bytes of valid  h264  video data are 0x00, 0x00, 0x00, 0x01.    *
      * nal_count is the number of NAL units in the data: short SPS, PPS, SEI NALs *
      * may  precede a VCL NAL. Each NAL starts with 0x00 0x00 0x00 0x01 and is    *
-     * byte-aligned: the first byte of invalid data (decryption failed) is 0x01   */
+     * byte-aligned: the first byte of invalid data (decryption failed) is 0x01   *
+     * The data is a complete access unit (caps have alignment=au), so it is      *
+     * pushed as a single buffer, marked as a delta unit unless it is a keyframe  */
     if (data[0]) {
         logger_log(logger, LOGGER_ERR, "*** ERROR decryption of video packet failed ");
     } else {
@@ -539,13 +689,25 @@ uint64_t video_renderer_render_buffer(unsigned char* data, int *data_len, int *n
             logger_log(logger, LOGGER_INFO, "Begin streaming to GStreamer video pipeline");
             first_packet = false;
         }
-        buffer = gst_buffer_new_allocate(NULL, *data_len, NULL);
-        g_assert(buffer != NULL);
+        if (ingest_limited && !ingest_queue_admit(*data_len, *ntp_time, is_keyframe, is_reference)) {
+            return 0;    /* frame dropped: data is released by the caller */
+        }
+        if (data_release) {
+            buffer = gst_buffer_new_wrapped_full(0, data, *data_len, 0, *data_len, data, (GDestroyNotify) data_release);
+            g_assert(buffer != NULL);
+            *data_ptr = NULL;
+        } else {
+            buffer = gst_buffer_new_allocate(NULL, *data_len, NULL);
+            g_assert(buffer != NULL);
+            gst_buffer_fill(buffer, 0, data, *data_len);
+        }
         //g_print("video latency %8.6f\n", (double) latency / SECOND_IN_NSECS);
         if (sync) {
             GST_BUFFER_PTS(buffer) = pts;
         }
-        gst_buffer_fill(buffer, 0, data, *data_len);
+        if (!is_keyframe) {
+            GST_BUFFER_FLAG_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+        }
         gst_app_src_push_buffer (GST_APP_SRC(renderer->appsrc), buffer);
 #ifdef X_DISPLAY_FIX
         if (renderer->gst_window && !(renderer->gst_window->window) && renderer->use_x11) {
@@ -568,6 +730,17 @@ void video_renderer_flush() {
 }
 
 void video_renderer_stop() {
+    if (ingest_limited) {
+        video_ingest_stats_t stats;
+        video_renderer_get_ingest_stats(&stats);
+        if (stats.dropped_non_reference || stats.dropped_until_keyframe) {
+            logger_log(logger, LOGGER_INFO, "video ingest queue: %llu frames played, dropped %llu non-reference frames"
+                       " and %llu frames while waiting for a keyframe (peak backlog %u frames)",
+                       (unsigned long long) stats.frames_pushed, (unsigned long long) stats.dropped_non_reference,
+                       (unsigned long long) stats.dropped_until_keyframe, stats.peak_frames_queued);
+        }
+        ingest_queue_reset();
+    }
     if (renderer) {
         logger_log(logger, LOGGER_DEBUG,"video_renderer_stop");
         if (renderer->appsrc) {
@@ -897,6 +1070,7 @@ int video_renderer_choose_codec (bool video_is_jpeg, bool video_is_h265) {
         return -1;
     }
     renderer = renderer_used;
+    ingest_queue_reset();
     gst_element_set_state (renderer->pipeline, GST_STATE_PLAYING);
     GstState old_state, new_state;
     if (gst_element_get_state(renderer->pipeline, &old_state, &new_state, 100 * GST_MSECOND) == GST_STATE_CHANGE_FAILURE) {
@@ -34,6 +34,7 @@ extern "C" {
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <time.h>
 #include "../lib/logger.h"
 
 typedef enum videoflip_e {
@@ -47,6 +48,13 @@ typedef enum videoflip_e {
 
 typedef struct video_renderer_s video_renderer_t;
 
+typedef struct video_ingest_stats_s {
+    uint64_t frames_pushed;            /* frames passed to the video pipeline */
+    uint64_t dropped_non_reference;    /* non-reference frames dropped while the backlog exceeded its limits */
+    uint64_t dropped_until_keyframe;   /* frames dropped while waiting for the next keyframe */
+    unsigned int peak_frames_queued;   /* largest backlog (in frames) seen */
+} video_ingest_stats_t;
+
 void video_renderer_init (logger_t *logger, const char *server_name, videoflip_t videoflip[2], const char *parser,
                           const char *decoder, const char *converter, const char *videosink, const char *videosink_options,
                           bool initial_fullscreen, bool video_sync, bool h265_support, guint playbin_version,  const char *uri);
@@ -57,7 +65,11 @@ void video_renderer_seek(float position);
 void video_renderer_set_start(float position);
 void video_renderer_resume ();
 bool video_renderer_is_paused();
-uint64_t  video_renderer_render_buffer (unsigned char* data, int *data_len, int *nal_count, uint64_t *ntp_time);
+uint64_t  video_renderer_render_buffer (unsigned char** data, int *data_len, int *nal_count, bool is_keyframe,
+                                       bool is_reference, uint64_t *ntp_time, void (*data_release)(void *data));
+void video_renderer_set_ingest_limits(unsigned int max_frames, unsigned int max_kbytes, unsigned int max_ms);
+bool video_renderer_set_clock(clockid_t clock_id);
+void video_renderer_get_ingest_stats(video_ingest_stats_t *stats);
 void video_renderer_display_jpeg(const void *data, int *data_len);
 void video_renderer_flush ();
 unsigned int video_renderer_listen(void *loop, int id);
@@ -76,6 +76,9 @@
 #define MISSED_FEEDBACK_LIMIT 15
 #define MIN_PASSWORD_LENGTH 4
 #define DEFAULT_PLAYBIN_VERSION 3
+#define DEFAULT_VIDEO_INGEST_MS 500
+#define DEFAULT_ADAPTIVE_DELAY_DECREASE 100
+#define DEFAULT_ADAPTIVE_DELAY_INCREASE 500
 #define BT709_FIX "capssetter caps=\"video/x-h264, colorimetry=bt709\""
 #define SRGB_FIX  " ! video/x-raw,colorimetry=sRGB,format=RGB  ! "
 #ifdef FULL_RANGE_RGB_FIX
@@ -91,10 +94,11 @@ static logger_t *render_logger = NULL;
 static bool audio_sync = false;
 static bool video_sync = true;
 static int64_t audio_delay_alac = 0;
+static clockid_t local_clock = CLOCK_REALTIME;
 static int64_t audio_delay_aac = 0;
 static bool relaunch_video = false;
 static bool reset_loop = false;
-static unsigned int open_connections= 0;
+static gint open_connections = 0;    /* atomic: conn_init and conn_destroy may run on different threads */
 static std::string videosink = "autovideosink";
 static std::string videosink_options = "";
 static videoflip_t videoflip[2] = { NONE , NONE };
@@ -141,10 +145,11 @@ static int log_level = LOGGER_INFO;
 static bool bt709_fix = false;
 static bool srgb_fix = DEFAULT_SRGB_FIX;
 static int nohold = 0;
+static unsigned int max_connections = 0;
+static unsigned int request_threads = 0;
 static bool nofreeze = false;
 static unsigned short raop_port;
 static unsigned short airplay_port;
-static uint64_t remote_clock_offset = 0;
 static std::vector<std::string> allowed_clients;
 static std::vector<std::string> blocked_clients;
 static bool restrict_clients;
@@ -173,6 +178,11 @@ static bool preserve_connections = false;
 static guint missed_feedback_limit = MISSED_FEEDBACK_LIMIT;
 static guint missed_feedback = 0;
 static guint playbin_version = DEFAULT_PLAYBIN_VERSION;
+static unsigned int video_decrypt_threads = 1;
+static unsigned int audio_buffer_depth = 0;
+static bool adaptive_audio_delay = false;
+static unsigned int adaptive_audio_delay_range[2] = {0};    /* max decrease, increase (msecs) */
+static unsigned int video_ingest_limits[3] = {0};    /* max frames, kB, ms queued for the video decoder */
 static bool reset_httpd = false;
 /* logging */
 
@@ -355,9 +365,11 @@ static void dump_audio_to_file(unsigned char *data, int datalen, unsigned char t
     }
 }
 
-static void dump_video_to_file(unsigned char *data, int datalen) {
-    /*  SPS NAL has (data[4] & 0x1f) = 0x07  */
-    if ((data[4] & 0x1f) == 0x07  && video_dumpfile && video_dump_limit) {
+static void dump_video_to_file(video_decode_struct *data) {
+    /* start a new file when the access unit begins with parameter sets (h264 SPS, h265 VPS) */
+    int first_nal_type = (data->nal_count ? data->nal_units[0].type : -1);
+    bool parameter_sets = (first_nal_type == (data->is_h265 ? 32 : 7));
+    if (parameter_sets && video_dumpfile && video_dump_limit) {
         fwrite(mark, 1, sizeof(mark), video_dumpfile);
         fclose(video_dumpfile);
         video_dumpfile = NULL;
@@ -381,16 +393,16 @@ static void dump_video_to_file(unsigned char *data, int datalen) {
 
     if (video_dumpfile) {
         if (video_dump_limit == 0) {
-            fwrite(data, 1, datalen, video_dumpfile);
+            fwrite(data->data, 1, data->data_len, video_dumpfile);
         } else if (video_dump_count < video_dump_limit) {
             video_dump_count++;
-            fwrite(data, 1, datalen, video_dumpfile);
+            fwrite(data->data, 1, data->data_len, video_dumpfile);
         }
     }
 }
 
 static gboolean feedback_callback(gpointer loop) {
-    if (open_connections) {
+    if (g_atomic_int_get(&open_connections)) {
         if (missed_feedback_limit && missed_feedback > missed_feedback_limit) {
             LOGI("***ERROR lost connection with client (network problem?)");
             LOGI("%u missed client feedback signals exceeds limit of %u", missed_feedback, missed_feedback_limit);
@@ -681,6 +693,8 @@ static void print_info (char *name) {
     printf("-vsync no Switch off audio/(server)video timestamp synchronization \n");
     printf("-async [x]Audio-Only mode: sync audio to client video (default: no)\n");
     printf("-async no Switch off audio/(client)video timestamp synchronization\n");
+    printf("-clock c  Clock used for timestamps: c = realtime (default), monotonic,\n");
+    printf("          or tai: these are not changed if the system time is reset.\n");
     printf("-db l[:h] Set minimum volume attenuation to l dB (decibels, negative);\n");
     printf("          optional: set maximum to h dB (+ or -) default: -30.0:0.0 dB\n");
     printf("-taper    Use a \"tapered\" AirPlay volume-control profile\n");
@@ -715,6 +729,10 @@ static void print_info (char *name) {
     printf("          osssink,oss4sink,osxaudiosink,wasapisink,directsoundsink.\n");
     printf("-as 0     (or -a)  Turn audio off, streamed video only\n");
     printf("-al x     Audio latency in seconds (default 0.25) reported to client.\n");
+    printf("-abuf n   Buffer up to n received audio packets (n=16-1024, rounded up\n");
+    printf("          to a power of 2; default 32) for reordering and resends\n");
+    printf("-apd [l,h] Adapt audio playout delay to network jitter: reduce it by up\n");
+    printf("          to l ms, or increase it by up to h ms (default 100,500)\n");
     printf("-ca [<fn>]In Audio (ALAC) mode, render cover-art [or write to file <fn>]\n");
     printf("-md <fn>  In Airplay Audio (ALAC) mode, write metadata text to file <fn>\n");
     printf("-reset n  Reset after n seconds of client silence (default n=%d, 0=never)\n", MISSED_FEEDBACK_LIMIT);
@@ -722,6 +740,10 @@ static void print_info (char *name) {
     printf("-nc       Do NOT  Close video window when client stops mirroring\n");
     printf("-nc no    Cancel the -nc option (DO close video window) \n");
     printf("-nohold   Drop current connection when new client connects.\n");
+    printf("-maxconn n Allow up to n simultaneous TCP connections from clients\n");
+    printf("          (n=4-1024, default 12)\n");
+    printf("-rqt n    Handle client requests on n worker threads (n=1-8; default:\n");
+    printf("          handle them on the network thread). Linux only.\n");
     printf("-restrict Restrict clients to those specified by \"-allow <deviceID>\"\n");
     printf("          UxPlay displays deviceID when a client attempts to connect\n");
     printf("          Use \"-restrict no\" for no client restrictions (default)\n");
@@ -729,6 +751,9 @@ static void print_info (char *name) {
     printf("-block <i>Always block connections from deviceID = <i>\n");
     printf("-FPSdata  Show video-streaming performance reports sent by client.\n");
     printf("-fps n    Set maximum allowed streaming framerate, default 30\n");
+    printf("-vdt n    Decrypt large (4K) video frames using n threads (n=1-8, default 1)\n");
+    printf("-vqueue [f,k,ms] Limit video backlog to f frames, k kB, ms millisecs (0=no\n");
+    printf("          limit; default 0,0,500) by dropping frames if decoder is too slow\n");
     printf("-f {H|V|I}Horizontal|Vertical flip, or both=Inversion=rotate 180 deg\n");
     printf("-r {R|L}  Rotate 90 degrees Right (cw) or Left (ccw)\n");
     printf("-m [mac]  Set MAC address (also Device ID);use for concurrent UxPlays\n");
@@ -798,6 +823,25 @@ static bool get_value (const char *str, unsigned int *n) {
     return true;
 }
 
+static bool get_value_list (const char *value, unsigned int *values, int nvalues) {
+    /* valid entries are up to nvalues comma-separated non-negative integers: missing values are 0 */
+    std::string val(value), str;
+    std::size_t pos;
+    for (int i = 0; i < nvalues; i++) {
+        values[i] = 0;
+    }
+    for (int i = 0; i < nvalues; i++) {
+        pos = val.find_first_of(',');
+        str = val.substr(0,pos);
+        unsigned int n = 0;
+        if (!get_value(str.c_str(), &n)) return false;
+        values[i] = n;
+        if (pos == std::string::npos) return true;
+        val.erase(0, pos+1);
+    }
+    return false;
+}
+
 static bool get_ports (int nports, std::string option, const char * value, unsigned short * const port) {
     /*valid entries are comma-separated values port_1,port_2,...,port_r, 0 < r <= nports */
     /*where ports are distinct, and are in the allowed range.                            */
@@ -953,6 +997,25 @@ static void parse_arguments (int argc, char *argv[]) {
                     }
                 }
             }
+        } else if (arg == "-clock") {
+            if (!option_has_value(i, argc, arg, argv[i+1])) exit(1);
+            std::string value(argv[++i]);
+            if (value == "realtime") {
+                local_clock = CLOCK_REALTIME;
+            } else if (value == "monotonic") {
+                local_clock = CLOCK_MONOTONIC;
+#ifdef CLOCK_TAI
+            } else if (value == "tai") {
+                local_clock = CLOCK_TAI;
+#endif
+            } else {
+                fprintf(stderr, "invalid \"-clock %s\"; -clock c: c = realtime, monotonic"
+#ifdef CLOCK_TAI
+                        " or tai"
+#endif
+                        "\n", argv[i]);
+                exit(1);
+            }
         } else if (arg == "-s") {
             if (!option_has_value(i, argc, argv[i], argv[i+1])) exit(1);
             std::string value(argv[++i]);
@@ -969,6 +1032,33 @@ static void parse_arguments (int argc, char *argv[]) {
                 exit(1);
             }
             display[3] = (unsigned short) n;
+        } else if (arg == "-vdt") {
+            if (!option_has_value(i, argc, arg, argv[i+1])) exit(1);
+            unsigned int n = 8;
+            if (!get_value(argv[++i], &n)) {
+                fprintf(stderr, "invalid \"-vdt %s\"; -vdt n : 1 <= n <= 8, default n=1\n", argv[i]);
+                exit(1);
+            }
+            video_decrypt_threads = n;
+        } else if (arg == "-rqt") {
+            if (!option_has_value(i, argc, arg, argv[i+1])) exit(1);
+            unsigned int n = 8;
+            if (!get_value(argv[++i], &n)) {
+                fprintf(stderr, "invalid \"-rqt %s\"; -rqt n : 1 <= n <= 8\n", argv[i]);
+                exit(1);
+            }
+            request_threads = n;
+        } else if (arg == "-vqueue") {
+            video_ingest_limits[0] = 0;
+            video_ingest_limits[1] = 0;
+            video_ingest_limits[2] = DEFAULT_VIDEO_INGEST_MS;
+            if (i < argc - 1 && *argv[i+1] != '-') {
+                if (!get_value_list(argv[++i], video_ingest_limits, 3)) {
+                    fprintf(stderr, "invalid \"-vqueue %s\"; -vqueue f,k,ms: up to three comma-separated"
+                            " non-negative integers (max frames, kB, ms), 0 = no limit\n", argv[i]);
+                    exit(1);
+                }
+            }
         } else if (arg == "-o") {
             display[4] = 1;
         } else if (arg == "-f") {
@@ -1196,6 +1286,14 @@ static void parse_arguments (int argc, char *argv[]) {
             }
         } else if (arg == "-nohold") {
             nohold = 1;
+        } else if (arg == "-maxconn") {
+            if (!option_has_value(i, argc, arg, argv[i+1])) exit(1);
+            unsigned int n = 1024;
+            if (!get_value(argv[++i], &n) || n < 4) {
+                fprintf(stderr, "invalid \"-maxconn %s\"; -maxconn n : 4 <= n <= 1024, default n=12\n", argv[i]);
+                exit(1);
+            }
+            max_connections = n;
         } else if (arg == "-al") {
 	    int n;
             char *end;
@@ -1209,6 +1307,26 @@ static void parse_arguments (int argc, char *argv[]) {
             fprintf(stderr, "invalid -al %s: value must be a decimal time offset in seconds, range [0,10]\n"
                     "(like 5 or 4.8, which will be converted to a whole number of microseconds)\n", argv[i]);
             exit(1);
+        } else if (arg == "-abuf") {
+            if (!option_has_value(i, argc, arg, argv[i+1])) exit(1);
+            unsigned int n = 1024;
+            if (!get_value(argv[++i], &n) || n < 16) {
+                fprintf(stderr, "invalid \"-abuf %s\"; -abuf n : 16 <= n <= 1024, default n=32\n", argv[i]);
+                exit(1);
+            }
+            audio_buffer_depth = n;
+        } else if (arg == "-apd") {
+            adaptive_audio_delay = true;
+            adaptive_audio_delay_range[0] = DEFAULT_ADAPTIVE_DELAY_DECREASE;
+            adaptive_audio_delay_range[1] = DEFAULT_ADAPTIVE_DELAY_INCREASE;
+            if (i < argc - 1 && *argv[i+1] != '-') {
+                if (!get_value_list(argv[++i], adaptive_audio_delay_range, 2) ||
+                    adaptive_audio_delay_range[0] > 2000 || adaptive_audio_delay_range[1] > 2000) {
+                    fprintf(stderr, "invalid \"-apd %s\"; -apd l,h: max decrease, increase of audio playout"
+                            " delay in ms (0 - 2000)\n", argv[i]);
+                    exit(1);
+                }
+            }
         } else if (arg == "-pin") {
             setup_legacy_pairing = true;
             pin_pw = 1;
@@ -1684,7 +1802,7 @@ extern "C" void video_reset(void *cls) {
     LOGD("video_reset");
     video_renderer_stop();
     url.erase();
-    remote_clock_offset = 0;
+    av_sync_reset(raop_get_av_sync(raop));
     relaunch_video = true;
     reset_loop = true;
 }
@@ -1731,17 +1849,17 @@ extern "C" void export_dacp(void *cls, const char *active_remote, const char *da
 }
 
 extern "C" void conn_init (void *cls) {
-    open_connections++;
-    LOGD("Open connections: %i", open_connections);
+    g_atomic_int_inc(&open_connections);
+    LOGD("Open connections: %i", g_atomic_int_get(&open_connections));
     //video_renderer_update_background(1);
 }
 
 extern "C" void conn_destroy (void *cls) {
     //video_renderer_update_background(-1);
-    open_connections--;
-    LOGD("Open connections: %i", open_connections);
-    if (open_connections == 0) {
-        remote_clock_offset = 0;
+    bool last = g_atomic_int_dec_and_test(&open_connections);
+    LOGD("Open connections: %i", g_atomic_int_get(&open_connections));
+    if (last) {
+        av_sync_reset(raop_get_av_sync(raop));
         if (use_audio) {
             audio_renderer_stop();
         }
@@ -1801,54 +1919,43 @@ extern "C" void report_client_request(void *cls, char *deviceid, char * model, c
 }
 
 extern "C" void audio_process (void *cls, raop_ntp_t *ntp, audio_decode_struct *data) {
-    if (dump_audio) {
+    if (dump_audio && !data->concealed) {
         dump_audio_to_file(data->data, data->data_len, (data->data)[0] & 0xf0);
     }
     if (use_audio) {
-        if (!remote_clock_offset) {
-            uint64_t local_time = (data->ntp_time_local ? data->ntp_time_local : get_local_time());
-            remote_clock_offset = local_time - data->ntp_time_remote;
-        }
-        data->ntp_time_remote = data->ntp_time_remote + remote_clock_offset;
+        int64_t audio_delay = 0;
         switch (data->ct) {
         case 2:
-            if (audio_delay_alac) {
-                data->ntp_time_remote = (uint64_t) ((int64_t) data->ntp_time_remote + audio_delay_alac);
-            }
+            audio_delay = audio_delay_alac;
             break;
         case 4:
         case 8:
-            if (audio_delay_aac) {
-                data->ntp_time_remote = (uint64_t) ((int64_t) data->ntp_time_remote + audio_delay_aac);
-            }
+            audio_delay = audio_delay_aac;
             break;
         default:
             break;
         }
-        audio_renderer_render_buffer(data->data, &(data->data_len), &(data->seqnum), &(data->ntp_time_remote));
+        uint64_t pts = av_sync_get_pts(raop_get_av_sync(raop), AV_SYNC_AUDIO, data->ntp_time_remote,
+                                       data->ntp_time_local, audio_delay);
+        audio_renderer_render_buffer(data->data, &(data->data_len), &(data->seqnum), &pts);
     }
 }
 
 extern "C" void video_process (void *cls, raop_ntp_t *ntp, video_decode_struct *data) {
     if (dump_video) {
-        dump_video_to_file(data->data, data->data_len);
+        dump_video_to_file(data);
     }
     if (use_video) {
-        if (!remote_clock_offset) {
-            uint64_t local_time = (data->ntp_time_local ? data->ntp_time_local : get_local_time());
-            remote_clock_offset = local_time - data->ntp_time_remote;
+        av_sync_t *av_sync = raop_get_av_sync(raop);
+        uint64_t pts = av_sync_get_pts(av_sync, AV_SYNC_VIDEO, data->ntp_time_remote, data->ntp_time_local, 0);
+        uint64_t pts_mismatch = video_renderer_render_buffer(&(data->data), &(data->data_len), &(data->nal_count),
+                                                             data->is_keyframe, data->is_reference, &pts, data->data_release);
+        /* the frame was due before the video pipeline started: delay both streams and retry once */
+        if (pts_mismatch && av_sync_delay_streams(av_sync, pts_mismatch)) {
+            pts = av_sync_get_pts(av_sync, AV_SYNC_VIDEO, data->ntp_time_remote, data->ntp_time_local, 0);
+            video_renderer_render_buffer(&(data->data), &(data->data_len), &(data->nal_count),
+                                         data->is_keyframe, data->is_reference, &pts, data->data_release);
         }
-        int count = 0;
-	uint64_t pts_mismatch = 0;
-	do {
-            data->ntp_time_remote = data->ntp_time_remote + remote_clock_offset;
-            pts_mismatch = video_renderer_render_buffer(data->data, &(data->data_len), &(data->nal_count), &(data->ntp_time_remote));
-            if (pts_mismatch) {
-                LOGI("adjust timestamps by %8.6f secs", (double) pts_mismatch / SECOND_IN_NSECS);
-                remote_clock_offset += pts_mismatch;
-            }
-            count++;
-        } while (pts_mismatch && count < 10);
     }
 }
 
@@ -1988,6 +2095,38 @@ extern "C" void audio_set_progress(void *cls, unsigned int start, unsigned int c
 	   position/60, position%60, remain/60, remain%60, duration/60, duration%60);
 }
 
+extern "C" void audio_report_stats(void *cls, audio_rtp_stats_t *stats) {
+    /* periodic reports are shown with -d, the end-of-session report always */
+    int level = (stats->session_end ? LOGGER_INFO : LOGGER_DEBUG);
+    std::string hist;
+    for (int i = 0; i < AUDIO_RESEND_LATENCY_BINS; i++) {
+        char bin[32];
+        if (i < AUDIO_RESEND_LATENCY_BINS - 1) {
+            snprintf(bin, sizeof(bin), " <%dms:%llu", 10 << i, (unsigned long long) stats->resend_latency_hist[i]);
+        } else {
+            snprintf(bin, sizeof(bin), " >=%dms:%llu", 10 << (i - 1), (unsigned long long) stats->resend_latency_hist[i]);
+        }
+        hist += bin;
+    }
+    log(level, "audio RTP stats%s: received %llu, duplicate %llu, late %llu, lost %llu (concealed %llu),"
+        " jitter %.3f ms, playout shift %.3f ms, client clock drift %.3f ppm",
+        (stats->session_end ? " (session end)" : ""),
+        (unsigned long long) stats->packets_received, (unsigned long long) stats->packets_duplicate,
+        (unsigned long long) stats->packets_late, (unsigned long long) stats->packets_lost,
+        (unsigned long long) stats->packets_concealed, stats->jitter * 1000,
+        stats->playout_shift * 1000, stats->clock_drift_ppm);
+    log(level, "audio RTP resends: %llu requests for %llu packets, %llu satisfied; latency%s",
+        (unsigned long long) stats->resend_requests, (unsigned long long) stats->resend_packets,
+        (unsigned long long) stats->resends_satisfied, hist.c_str());
+    av_sync_stats_t sync_stats;
+    av_sync_get_stats(raop_get_av_sync(raop), &sync_stats);
+    if (sync_stats.configured_av_offset_valid) {
+        log(level, "A/V sync: configured audio-video offset %.3f ms, clock offset error %.3f ms, added delay %.3f ms,"
+            " steps %llu", sync_stats.configured_av_offset * 1000, sync_stats.offset_error * 1000, sync_stats.delay * 1000,
+            (unsigned long long) sync_stats.steps);
+    }
+}
+
 extern "C" void audio_set_metadata(void *cls, const void *buffer, int buflen) {
     char dmap_tag[5] = {0x0};
     const unsigned char *metadata = (const  unsigned char *) buffer;
@@ -2161,6 +2300,7 @@ static int start_raop_server (unsigned short display[5], unsigned short tcp[3],
     raop_cbs.audio_set_coverart = audio_set_coverart;
     raop_cbs.audio_stop_coverart_rendering = audio_stop_coverart_rendering;
     raop_cbs.audio_set_progress = audio_set_progress;
+    raop_cbs.audio_report_stats = audio_report_stats;
     raop_cbs.report_client_request = report_client_request;
     raop_cbs.display_pin = display_pin;
     raop_cbs.register_client = register_client;
@@ -2202,6 +2342,19 @@ static int start_raop_server (unsigned short display[5], unsigned short tcp[3],
     if (audiodelay >= 0) raop_set_plist(raop, "audio_delay_micros", audiodelay);
     if (pin_pw == 1) raop_set_plist(raop, "pin", (int) pin);
     if (hls_support) raop_set_plist(raop, "hls", 1);
+    if (video_decrypt_threads > 1) raop_set_plist(raop, "video_decrypt_threads", (int) video_decrypt_threads);
+    if (audio_buffer_depth) raop_set_plist(raop, "audio_buffer_depth", (int) audio_buffer_depth);
+    if (local_clock != CLOCK_REALTIME) raop_set_plist(raop, "local_clock", (int) local_clock);
+    if (max_connections && raop_set_plist(raop, "max_connections", (int) max_connections)) {
+        LOGW("could not allow %u simultaneous connections, using the default", max_connections);
+    }
+    if (request_threads && raop_set_plist(raop, "request_threads", (int) request_threads)) {
+        LOGW("could not use worker threads for client requests on this system");
+    }
+    if (adaptive_audio_delay) {
+        raop_set_plist(raop, "adaptive_delay_min_micros", (int) adaptive_audio_delay_range[0] * 1000);
+        raop_set_plist(raop, "adaptive_delay_max_micros", (int) adaptive_audio_delay_range[1] * 1000);
+    }
 
     /* network port selection (ports listed as "0" will be dynamically assigned) */
     raop_set_tcp_ports(raop, tcp);
@@ -2529,12 +2682,18 @@ int main (int argc, char *argv[]) {
     logger_set_callback(render_logger, log_callback, NULL);
     logger_set_level(render_logger, log_level);
 
+    if (!audio_renderer_set_clock(local_clock) || !video_renderer_set_clock(local_clock)) {
+        LOGE("the clock requested with \"-clock\" is not supported by this GStreamer version");
+        exit(1);
+    }
+
     if (use_audio) {
       audio_renderer_init(render_logger, audiosink.c_str(), &audio_sync, &video_sync);
     } else {
         LOGI("audio_disabled");
     }
     if (use_video) {
+        video_renderer_set_ingest_limits(video_ingest_limits[0], video_ingest_limits[1], video_ingest_limits[2]);
         video_renderer_init(render_logger, server_name.c_str(), videoflip, video_parser.c_str(),
                             video_decoder.c_str(), video_converter.c_str(), videosink.c_str(),
                             videosink_options.c_str(), fullscreen, video_sync, h265_support, playbin_version, NULL);